@@ -0,0 +1,305 @@
+/* Benchmarks for len. Writes a set of reproducible corpora, runs a len  */
+/* binary over each of them in several modes, and prints one JSON record */
+/* per run: throughput, lines per second and peak RSS.                   */
+/*                                                                        */
+/* Usage: bench LEN DIR [MB [REPEATS [REV [-- EXTRA ARGS FOR LEN]]]]      */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Files in the many-small-files tree, spread over TREE_DIRS directories */
+#define TREE_FILES 10000
+#define TREE_DIRS 100
+
+/* Most arguments a run of len gets */
+#define MAX_ARGS 32
+
+struct corpus {
+        const char      *name;
+        const char      *path;          /* Under DIR                      */
+        bool            tree;           /* A directory, checked with -R   */
+        unsigned long long bytes;
+        unsigned long long lines;
+};
+
+struct mode {
+        const char      *name;
+        const char      *args[4];
+};
+
+static const struct mode MODES[] = {
+        { "check",      { NULL } },
+        { "p",          { "-p", NULL } },
+        { "pc-ln",      { "-pc", "-ln", NULL } },
+        { "P-r",        { "-P", "-r", NULL } },
+};
+
+/* xorshift64*: the same corpora on every machine */
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+        seed ^= seed >> 12;
+        seed ^= seed << 25;
+        seed ^= seed >> 27;
+        return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned pick(unsigned below)
+{
+        return (unsigned) (next_random() % below);
+}
+
+static void die(const char *what, const char *name)
+{
+        fprintf(stderr, "bench: %s %s\n", what, name);
+        exit(EXIT_FAILURE);
+}
+
+/* Fills a line with printable text, no tabs */
+static void put_text(FILE *f, unsigned n)
+{
+        for (unsigned k = 0; k < n; ++k)
+                fputc(' ' + pick(95), f);
+}
+
+static FILE *create(const char *path)
+{
+        FILE *f = fopen(path, "wb");
+        if (f == NULL) die("could not create", path);
+        return f;
+}
+
+/* Each writer makes about limit bytes of one kind of text */
+static void write_short(FILE *f, unsigned long long limit,
+                        struct corpus *c)
+{
+        while (c->bytes < limit) {
+                unsigned n = pick(80);
+                put_text(f, n);
+                fputc('\n', f);
+                c->bytes += n + 1;
+                ++c->lines;
+        }
+}
+
+static void write_long(FILE *f, unsigned long long limit,
+                       struct corpus *c)
+{
+        for (int line = 0; line < 4; ++line) {
+                unsigned long long n = limit / 4;
+                for (unsigned long long k = 0; k < n; k += 4096)
+                        put_text(f, n - k < 4096 ? (unsigned) (n - k) : 4096);
+                fputc('\n', f);
+                c->bytes += n + 1;
+                ++c->lines;
+        }
+}
+
+static void write_tabs(FILE *f, unsigned long long limit,
+                       struct corpus *c)
+{
+        while (c->bytes < limit) {
+                unsigned indent = 1 + pick(6);
+                unsigned words = pick(6);
+                for (unsigned k = 0; k < indent; ++k) fputc('\t', f);
+                c->bytes += indent;
+                for (unsigned k = 0; k < words; ++k) {
+                        unsigned n = 1 + pick(10);
+                        put_text(f, n);
+                        fputc('\t', f);
+                        c->bytes += n + 1;
+                }
+                fputc('\n', f);
+                ++c->bytes;
+                ++c->lines;
+        }
+}
+
+static void write_crlf(FILE *f, unsigned long long limit,
+                       struct corpus *c)
+{
+        while (c->bytes < limit) {
+                unsigned n = pick(80);
+                put_text(f, n);
+                fputs("\r\n", f);
+                c->bytes += n + 2;
+                ++c->lines;
+        }
+}
+
+static void write_empty(FILE *f, unsigned long long limit,
+                        struct corpus *c)
+{
+        while (c->bytes < limit) {
+                unsigned n = pick(2) ? 0 : pick(100);
+                put_text(f, n);
+                fputc('\n', f);
+                c->bytes += n + 1;
+                ++c->lines;
+        }
+}
+
+static void write_tree(const char *dir, struct corpus *c)
+{
+        char path[4096 + 32];
+
+        if (mkdir(dir, 0777) != 0) die("could not create", dir);
+        for (unsigned d = 0; d < TREE_DIRS; ++d) {
+                snprintf(path, sizeof(path), "%s/d%03u", dir, d);
+                if (mkdir(path, 0777) != 0) die("could not create", path);
+        }
+        for (unsigned k = 0; k < TREE_FILES; ++k) {
+                snprintf(path, sizeof(path), "%s/d%03u/f%05u.c", dir,
+                         k % TREE_DIRS, k);
+                FILE *f = create(path);
+                unsigned long long before = c->bytes;
+                write_short(f, before + 1024 + pick(3072), c);
+                fclose(f);
+        }
+}
+
+/* Starts DIR over so nothing is left from other sizes */
+static void clean(const char *dir)
+{
+        pid_t pid = fork();
+        if (pid == 0) {
+                execlp("rm", "rm", "-rf", dir, (char *) NULL);
+                _exit(127);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+        if (mkdir(dir, 0777) != 0) die("could not create", dir);
+}
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs len once with its output thrown away. Returns the wall time, and */
+/* the exit status and peak RSS through rc and rss.                      */
+static double run(char **argv, int *rc, long *rss)
+{
+        struct rusage ru;
+        int status;
+        double start = now();
+
+        pid_t pid = fork();
+        if (pid < 0) die("could not fork for", argv[0]);
+        if (pid == 0) {
+                int null = open("/dev/null", O_WRONLY);
+                if (null >= 0) dup2(null, STDOUT_FILENO);
+                execv(argv[0], argv);
+                _exit(127);
+        }
+        if (wait4(pid, &status, 0, &ru) < 0) die("lost", argv[0]);
+
+        double took = now() - start;
+        *rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        *rss = ru.ru_maxrss;
+        return took;
+}
+
+int main(int argc, char **argv)
+{
+        if (argc < 3) {
+                fprintf(stderr, "Usage: bench LEN DIR [MB [REPEATS [REV "
+                                "[-- ARGS]]]]\n");
+                return EXIT_FAILURE;
+        }
+
+        const char *len = argv[1];
+        const char *dir = argv[2];
+        unsigned long long mb = argc > 3 ? strtoull(argv[3], NULL, 10) : 32;
+        int repeats = argc > 4 ? atoi(argv[4]) : 3;
+        const char *rev = argc > 5 ? argv[5] : "unknown";
+        int extra = argc > 7 && strcmp(argv[6], "--") == 0 ? 7 : argc;
+        unsigned long long limit = mb << 20;
+        char path[4096];
+
+        if (repeats < 1) repeats = 1;
+
+        struct corpus corpora[] = {
+                { "short",      "short.txt",    false, 0, 0 },
+                { "long",       "long.txt",     false, 0, 0 },
+                { "tabs",       "tabs.txt",     false, 0, 0 },
+                { "crlf",       "crlf.txt",     false, 0, 0 },
+                { "empty",      "empty.txt",    false, 0, 0 },
+                { "tree",       "tree",         true,  0, 0 },
+        };
+        void (*writers[])(FILE *, unsigned long long, struct corpus *) = {
+                write_short, write_long, write_tabs, write_crlf, write_empty,
+        };
+        size_t count = sizeof(corpora) / sizeof(*corpora);
+
+        clean(dir);
+        for (size_t k = 0; k < count; ++k) {
+                snprintf(path, sizeof(path), "%s/%s", dir, corpora[k].path);
+                if (corpora[k].tree) {
+                        write_tree(path, &corpora[k]);
+                        continue;
+                }
+                FILE *f = create(path);
+                writers[k](f, limit, &corpora[k]);
+                fclose(f);
+        }
+
+        for (size_t k = 0; k < count; ++k) {
+                const struct corpus *c = &corpora[k];
+
+                snprintf(path, sizeof(path), "%s/%s", dir, c->path);
+                for (size_t m = 0; m < sizeof(MODES) / sizeof(*MODES); ++m) {
+                        char *args[MAX_ARGS];
+                        int n = 0;
+
+                        args[n++] = (char *) len;
+                        for (int e = extra; e < argc && n < MAX_ARGS - 8; ++e)
+                                args[n++] = argv[e];
+                        if (c->tree) args[n++] = "-R";
+                        for (int a = 0; MODES[m].args[a] != NULL; ++a)
+                                args[n++] = (char *) MODES[m].args[a];
+                        args[n++] = path;
+                        args[n] = NULL;
+
+                        /* Best of the repeats, which is the least noisy */
+                        double best = 0;
+                        long rss = 0;
+                        int rc = 0;
+                        for (int r = 0; r < repeats; ++r) {
+                                long used;
+                                double took = run(args, &rc, &used);
+                                if (r == 0 || took < best) best = took;
+                                if (used > rss) rss = used;
+                        }
+                        if (best <= 0) best = 1e-9;
+
+                        printf("{\"rev\":\"%s\",\"corpus\":\"%s\","
+                               "\"mode\":\"%s\",\"bytes\":%llu,"
+                               "\"lines\":%llu,\"seconds\":%.6f,"
+                               "\"mb_per_s\":%.2f,\"lines_per_s\":%.0f,"
+                               "\"max_rss_kb\":%ld,\"exit\":%d}\n",
+                               rev, c->name, MODES[m].name, c->bytes,
+                               c->lines, best, c->bytes / best / 1048576.0,
+                               c->lines / best, rss, rc);
+                        fflush(stdout);
+                }
+        }
+        return EXIT_SUCCESS;
+}
@@ -1,3 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
+/* For syscall() and the DT_* constants */
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -5,10 +9,51 @@
 #include <limits.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
-#define MY_GETLINE_TABWIDTH tabWidth
-#define MY_GETLINE_TABSTOPS true
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LEN_AVX2 1
+#endif
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#define LEN_INOTIFY 1
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#define LEN_URING 1
+#endif
+#endif
+#endif
+
+#include "len.h"
+
+/* liblen is built from this file with LEN_LIBRARY defined, which leaves */
+/* out everything only the command line uses                             */
+
+#define LEN_TABWIDTH tabWidth
+#define LEN_TABSTOPS true
 
 /*******************************CONSTANTS************************************/
 
@@ -20,6 +65,8 @@ const char      *INCOMPLETE_ARG         = "Incomplete arguments to a flag";
 const char      *NO_FILE                = "No file specified";
 const char      *BAD_OPTION             = "Unrecognized option:";
 const char      *NO_COMBINE             = "Cannot combine option:";
+const char      *NO_MEMORY              = "Unable to allocate memory";
+const char      *NO_SPILL               = "Unable to hold a long line";
 
 /* Help text */
 const char *HELP_ME =
@@ -54,7 +101,48 @@ const char *HELP_ME =
 "--set-good: Set the color for in-range portions of lines\n"
 "--set-colors: Requires two arguments. Equivalent to specifying both\n"
 "              --set-good and --set-bad in that order\n"
-"-h, --help: Display this help and exit\n\n"
+"-j, --jobs: Check this many files at once (default: 1, 0: one per CPU)\n"
+"--summary: Instead of printing lines, report the number of lines, the\n"
+"           longest, the mean and percentiles of line lengths\n"
+"--histogram: Like --summary, plus counts of lines by length\n"
+"--top: Instead of printing lines, print this many of the longest lines\n"
+"       once every file has been checked, longest first\n"
+"-R, --recursive: Check every file under directories named as files\n"
+"--include: Only check walked files whose names match this glob.\n"
+"           May be given more than once\n"
+"--exclude: Skip walked files and directories whose names match this\n"
+"           glob. May be given more than once\n"
+"--gitignore: Skip what .gitignore files in walked directories ignore\n"
+"--io-uring: Open and read small files in batches through io_uring\n"
+"-q, --quiet: Print nothing, and stop at the first line out of range\n"
+"--cache: Remember which files passed in this file, and answer for\n"
+"         unchanged files from it without reading them\n"
+"--cache-strict: Make --cache read files to be sure they are unchanged\n"
+"--diff: Only check the lines a unified diff (git diff -U0) adds to the\n"
+"        files it names, instead of files given on the command line.\n"
+"        Specify - to read the diff from stdin\n"
+"--stats: Report on stderr how many bytes and lines were read, the longest\n"
+"         line, bytes written and the time spent opening and reading,\n"
+"         scanning and printing, for each file\n"
+"--utf8: Count the columns UTF-8 text takes up on screen instead of\n"
+"        bytes. Wide characters count twice, combining marks not at all\n"
+"--keep-tabs: Print tabs in lines as they are instead of as spaces\n"
+"--format: Print a record for each line out of range instead of the\n"
+"          line, as ndjson, sarif or checkstyle\n"
+"--daemon: Stay running, and answer --client runs through this socket\n"
+"          from results kept since files last changed\n"
+"--client: Have the daemon listening on this socket check the files.\n"
+"          Output and return values are those of a run without it\n"
+"--config: Read settings for files by name from this file instead of\n"
+"          .lenrc in the current directory\n"
+"--ignore-pattern: Don't count lines out of range that match this\n"
+"                  extended regex, nor those holding len:ignore.\n"
+"                  May be given more than once\n"
+"-h, --help: Display this help and exit\n\n";
+
+/* The rest of it, kept apart to stay within what C99 says a string */
+/* literal may hold                                                  */
+const char *HELP_END =
 "Colors: red, green, yellow, blue, magenta, cyan, white\n"
 "Return values:\n"
 "    Other values indicate other errors (see man page for more details)\n"
@@ -81,6 +169,9 @@ const char      NEWLINES        = 'N';
 const char      INVERT          = 'i';
 const char      HELP            = 'h';
 const char      ALT             = 'a';
+const char      JOBS            = 'j';
+const char      RECURSIVE       = 'R';
+const char      QUIET           = 'q';
 
 /* Specify this last to read from stdin */
 const char      READ_STDIN     = '-';
@@ -95,6 +186,7 @@ const char      *LINE_NUMS_LONG     = "line-numbers";
 const char      *COLOR_LONG         = "color";
 const char      *HELP_LONG          = "help";
 const char      *FLAGS_LONG         = "flags";
+const char      *STATS_LONG         = "stats";
 const char      *TRUNCATE_LONG      = "truncate";
 const char      *NEWLINES_LONG      = "count-newlines";
 const char      *LINE_LENGTHS_LONG  = "line-lengths";
@@ -106,6 +198,26 @@ const char      *FILE_LONG          = "file-colors";
 const char      *SET_BAD_LONG       = "set-bad";
 const char      *SET_GOOD_LONG      = "set-good";
 const char      *SET_COLORS_LONG    = "set-colors";
+const char      *JOBS_LONG          = "jobs";
+const char      *SUMMARY_LONG       = "summary";
+const char      *HISTOGRAM_LONG     = "histogram";
+const char      *TOP_LONG           = "top";
+const char      *RECURSIVE_LONG     = "recursive";
+const char      *INCLUDE_LONG       = "include";
+const char      *EXCLUDE_LONG       = "exclude";
+const char      *GITIGNORE_LONG     = "gitignore";
+const char      *URING_LONG         = "io-uring";
+const char      *QUIET_LONG         = "quiet";
+const char      *CACHE_LONG         = "cache";
+const char      *CACHE_STRICT_LONG  = "cache-strict";
+const char      *DIFF_LONG          = "diff";
+const char      *UTF8_LONG          = "utf8";
+const char      *KEEP_TABS_LONG     = "keep-tabs";
+const char      *FORMAT_LONG        = "format";
+const char      *DAEMON_LONG        = "daemon";
+const char      *CLIENT_LONG        = "client";
+const char      *CONFIG_LONG        = "config";
+const char      *IGNORE_PATTERN_LONG = "ignore-pattern";
 
 /* Color strings */
 #define red_str     "red"
@@ -129,10 +241,16 @@ const int       BAD_FILE                = 103;
 const int       BAD_ARGS                = 104;
 const int       NO_ARGS                 = 105;
 
-/* Default values */
-static unsigned         maxLen          = 80;
-static unsigned         minLen          = 1; /* Empty lines are 1 char long */
-static unsigned         tabWidth        = 8;
+/* Default values. The first three are the ones for the file being */
+/* checked, which the config can change, so each thread has its own */
+/* (see limits_for()).                                               */
+#if !defined(LEN_LIBRARY)
+static __thread unsigned maxLen         = 80;
+static __thread unsigned minLen         = 1; /* Empty lines are 1 char long */
+#endif
+static __thread unsigned tabWidth       = 8;
+#if !defined(LEN_LIBRARY)
+static unsigned         jobs            = 1;
 
 /* Behavior flags controlled by args to program */
 static bool             print           = false;
@@ -141,11 +259,81 @@ static bool             offenders       = true;   /* No effect without print */
 static bool             lineNums        = false;
 static bool             color           = false;
 static bool             flags           = false;
-static bool             truncate        = false;
+static bool             truncating      = false;
 static bool             newlines        = false;
 static bool             lineLengths     = false;
 static bool             inverted        = false;
 static bool             alternate       = false;
+static bool             summary         = false;
+static bool             histogram       = false;
+static unsigned         topLines        = 0;      /* --top, 0 if not   */
+static bool             recursive       = false;
+static bool             gitignore       = false;
+static bool             uring           = false;
+static bool             quiet           = false;
+static const char       *cacheName      = NULL;
+static bool             cacheStrict     = false;
+static const char       *diffName       = NULL;
+static bool             stats           = false;
+#endif
+static bool             utf8            = false;
+#if !defined(LEN_LIBRARY)
+static bool             keepTabs        = false;
+
+/* --format: records for tools instead of lines for people */
+enum format { FORMAT_TEXT, FORMAT_NDJSON, FORMAT_SARIF, FORMAT_CHECKSTYLE };
+static enum format      format          = FORMAT_TEXT;
+
+static const char       *daemonName     = NULL;
+static const char       *clientName     = NULL;
+static const char       *configName     = NULL;   /* Else .lenrc      */
+#endif
+
+/* Read stdin on a thread of its own, set when there's a CPU to spare */
+/* or -j asks for more than one job                                   */
+static bool             pipeStdin       = false;
+
+#if !defined(LEN_LIBRARY)
+/* --include and --exclude globs, matched against walked names */
+struct globs {
+        const char      **pat;
+        size_t          count;
+};
+
+static struct globs     includes        = { NULL, 0 };
+static struct globs     excludes        = { NULL, 0 };
+#endif
+
+/* A string to look for with memchr() on one of its bytes, at, picked */
+/* to be one that turns up less often than letters do                  */
+struct literal {
+        const char      *text;
+        size_t          len;
+        size_t          at;
+};
+
+/* Lines out of range holding this aren't counted as out of range */
+static const struct literal MARKER = { "len:ignore", 10, 3 };
+
+/* --ignore-pattern regexes, which exempt lines out of range they match. */
+/* lit is a string any line a regex matches has to hold, if one could   */
+/* be found, so most lines never get as far as regexec().               */
+struct exempt {
+        regex_t         re;
+        struct literal  lit;
+};
+
+static struct exempt    *exempts        = NULL;
+static size_t           nexempts        = 0;
+/* Each thread's copy of the line being matched, kept for the next */
+static __thread char    *exemptLine     = NULL;
+static __thread size_t  exemptCap       = 0;
+#if !defined(LEN_LIBRARY)
+static uint64_t         exemptsHash     = 0;   /* Of the patterns given  */
+
+/* Number of files named on the command line */
+static int              numFiles        = 0;
+#endif
 /* Flags for colors */
 typedef const char *COLOR_T;
 
@@ -168,6 +356,40 @@ COLOR_T file_alt   = cyan;
 /****************************************************************************/
 
 #define PRINTING (print || printAll)
+#define REPORTING (summary || histogram)
+/* Walked directories may hold any number of files */
+#define MANY_FILES (numFiles > 1 || recursive)
+
+#if !defined(LEN_LIBRARY)
+/* Set once -q has seen a line out of range, to the number of the first */
+/* file, in the order given, found to have one. Files from it on wind    */
+/* down and nothing after it is opened or read, but the files before it  */
+/* are still checked, so that which of them can't be opened, and with    */
+/* it the exit status, doesn't depend on which thread got there first.   */
+static int              stopAt          = INT_MAX;
+
+inline static bool stopped(void)
+{
+        return __atomic_load_n(&stopAt, __ATOMIC_RELAXED) != INT_MAX;
+}
+
+/* Whether the file numbered number can give up */
+inline static bool stopped_at(int number)
+{
+        return number >= __atomic_load_n(&stopAt, __ATOMIC_RELAXED);
+}
+
+static void stop_all(int number)
+{
+        int at = __atomic_load_n(&stopAt, __ATOMIC_RELAXED);
+
+        while (number < at &&
+               !__atomic_compare_exchange_n(&stopAt, &at, number, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+}
+#endif
 
 /****************************************************************************/
 
@@ -189,24 +411,23 @@ COLOR_T file_alt   = cyan;
                                 exit(BAD_ARGS);                              \
                      }
 
-/* Scope: File-level loop */
+/* Same as ARG_CHECK, for flags taking any string */
+/* Scope: arg_check */
+#define STR_ARG_CHECK(I) if ((argc - 1) < ++I) {                             \
+                                fprintf(stderr, "%s %s %s\n", BAD_ARG,       \
+                                argv[I - 1], "requires an argument");        \
+                                exit(BAD_ARGS);                              \
+                     }
+
+/* Scope: check_file() */
+/* Parallel runs leave the header to the writer, which alone knows which  */
+/* color comes next; workers only note where in their output it goes.    */
 #define PRINT_FILENAME_HEADER                                                \
-                if (numFiles > 1) {                                          \
+                if (MANY_FILES || format != FORMAT_TEXT) {                   \
                         if (PRINTING) {                                      \
-                                if (fd != stdin){                            \
-                                        term_file();                         \
-                                        fprintf(stdout, "--|%d: %s|--\n",    \
-                                                numFiles - (argc - i) + 1,   \
-                                                argv[i]);                    \
-                                        term_default();                      \
-                                }                                            \
-                                else {                                       \
-                                        term_file();                         \
-                                        fprintf(stdout, "--|%d: %s|--\n",    \
-                                                numFiles - (argc - i) + 1,   \
-                                                "Standard Input");           \
-                                        term_default();                      \
-                                }                                            \
+                                if (job->deferHeader)                        \
+                                        job->headerAt = (long) out->len;     \
+                                else print_header(out, job);                 \
                         }                                                    \
                 }
 
@@ -214,21 +435,754 @@ COLOR_T file_alt   = cyan;
 #define MATCH_S(I, J, SHORT_FLAG) argv[I][J] == SHORT_FLAG
 #define MATCH_L(I, LONG_FLAG) !strcmp(&(argv[I][2]), LONG_FLAG)
 
+#if !defined(LEN_LIBRARY)
 /* Print flags for debugging purposes */
 /* Printout enabled by the undocumented "--flags" option */
 /* Does not interrupt normal execution */
 inline static void print_flags(int i, int argc);
 
-/* Functions relating to colors */
-inline static void term_default();
-inline static void term_color(bool isGood);
-inline static void term_file();
+/* Printed output is collected here and written out in big pieces. With a */
+/* sink it is flushed there whenever it fills up; without one it grows    */
+/* and holds everything until the writer takes it.                        */
+struct outbuf {
+        char            *data;
+        size_t          len;
+        size_t          cap;
+        FILE            *sink;
+        unsigned long long flushed;     /* Bytes already sent to sink     */
+};
+
+/* Size of the buffer in front of stdout */
+#define OUT_BUFFER (1 << 20)
+
+static void ob_init(struct outbuf *ob, FILE *sink);
+static void ob_flush(struct outbuf *ob);
+static void ob_write(struct outbuf *ob, const char *p, size_t n);
+static void ob_fill(struct outbuf *ob, char c, size_t n);
+/* Everything ever written to ob, flushed or not */
+inline static unsigned long long ob_total(const struct outbuf *ob);
+inline static void ob_putc(struct outbuf *ob, char c);
+/* Like printf's %*lu */
+static void ob_num(struct outbuf *ob, unsigned long n, int width);
+
+/* Functions relating to colors. The escape sequences are put together */
+/* once, by term_init(), after the options are known.                  */
+struct esc {
+        char            seq[16];
+        size_t          len;
+};
+
+static void term_init(void);
+inline static void term_default(struct outbuf *out);
+inline static void term_color(struct outbuf *out, bool isGood);
+inline static void term_file(struct outbuf *out);
 static COLOR_T strtocolor(char *str);
+#endif
+
+/* --stats: what checking a file cost. Times are in nanoseconds, and */
+/* the clock is left alone unless --stats is given.                  */
+struct stats {
+        unsigned long long      bytes;          /* Read in               */
+        unsigned long long      lines;
+        size_t                  longest;        /* As -l shows it        */
+        unsigned long long      written;
+        uint64_t                open;           /* Opening and reading   */
+        uint64_t                scan;
+        uint64_t                render;
+};
+
+#if !defined(LEN_LIBRARY)
+/* Monotonic nanoseconds, or 0 without --stats */
+inline static uint64_t stats_clock(void);
+/* Adds the time since since to *into and returns the time now */
+inline static uint64_t stats_lap(uint64_t *into, uint64_t since);
+#endif
+
+/* Finds where a line ends, adding its columns to *cols, with tabs tabs */
+/* columns wide                                                         */
+typedef const char *(*line_fn)(const char *p, const char *end, size_t *cols,
+                               size_t tabs);
+
+/* Where lines come from. Regular files are mapped and lines are handed  */
+/* out as pointers straight into the mapping; anything that can't be     */
+/* mapped (stdin, pipes, devices) is read through a window of SCAN_BLOCK */
+/* bytes that lines are handed out of instead. However long a line is,   */
+/* that window is all the memory it takes.                               */
+struct source {
+        FILE            *fd;            /* Fallback stream, NULL if mapped */
+        const char      *map;
+        size_t          mapLen;
+        size_t          pos;            /* In map, or in buf for streams   */
+        char            *buf;           /* The window                      */
+        size_t          size;
+        bool            borrowed;       /* map belongs to someone else     */
+        struct stats    *stats;         /* --stats, or NULL                */
+        size_t          have;           /* Bytes in the window             */
+        bool            eof;
+        bool            skipLF;         /* Last line ended in a \r         */
+        bool            inLine;         /* Partway through a long line     */
+        size_t          col;            /* Its width so far                */
+        line_fn         line;           /* How lines are measured: the     */
+        size_t          tabs;           /* options' kernel and tab width,  */
+        bool            wide;           /* and whether it's --utf8         */
+        struct unpack   *unpack;        /* Compressed streams, and stdin   */
+        char            head[4];        /* Read to tell which they are,    */
+        size_t          headLen;        /* not yet handed out              */
+};
+
+/* One line of input, or a window's worth of one too long for a window. */
+/* text is NOT terminated and still contains its tabs; len is the width */
+/* with tabs expanded, plus one for the newline. For a piece of a long  */
+/* line, len counts everything up to the end of the piece.              */
+struct line {
+        const char      *text;
+        size_t          bytes;          /* Raw bytes, newline excluded     */
+        size_t          len;
+        bool            partial;        /* More of the line is to come     */
+};
+
+#if !defined(LEN_LIBRARY)
+/* Opening and reading in a range set up lines to be measured the way */
+/* the options say                                                     */
+static bool source_open(struct source *src, const char *name);
+static bool source_failed(const struct source *src);
+#endif
+/* Maps or streams what fdno is open on, and closes fdno either way */
+static bool source_fd(struct source *src, int fdno);
+static bool source_sniff(struct source *src);
+/* Measures lines with tabs tabs columns wide, as --utf8 text or not */
+static void source_measure(struct source *src, size_t tabs, bool wide);
+static void source_range(struct source *src, const char *p, size_t n);
+static bool source_next(struct source *src, struct line *ln);
+#if !defined(LEN_LIBRARY)
+/* Moves past one line without measuring it */
+static bool source_skip(struct source *src);
+#endif
+/* Reads from a stream, decompressing if it's compressed. Like read(), */
+/* it can come up short whenever no more has turned up yet; 0 is the  */
+/* end.                                                                */
+static size_t source_read(struct source *src, char *p, size_t n);
+/* read(), tried again when interrupted */
+static ssize_t fd_read(int fdno, char *p, size_t n);
+/* True if compressed input turned out to be damaged or cut short */
+static bool source_broken(const struct source *src);
+static void source_close(struct source *src);
+
+/* Compressed input, told apart by its first bytes and decompressed on */
+/* a thread of its own while the lines before are checked. The thread  */
+/* fills a ring of UNPACK_RING buffers while the reader empties them,  */
+/* so those and the decompressor's own state are all it takes, however */
+/* big the file. zlib and libzstd are loaded the first time they're    */
+/* needed, so len builds and runs without them. With CPUs to spare,   */
+/* stdin goes through a thread even when it isn't compressed, one that */
+/* only reads, so lines are checked while whatever feeds len writes.   */
+#define UNPACK_BLOCK (1 << 18)
+#define UNPACK_INPUT (1 << 16)
+#define UNPACK_RING 4
+#define GZIP_HEADER 10                  /* Bytes, at the least           */
+
+enum codec { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+
+static enum codec codec_of(const char *p, size_t n);
+/* Starts decompressing in, which head was already read from, or just */
+/* reading it for CODEC_NONE. NULL with errno ENOSYS if the library it */
+/* takes can't be loaded, or ENOMEM if memory or threads ran out.      */
+static struct unpack *unpack_start(FILE *in, enum codec codec,
+                                   const char *head, size_t n);
+static size_t unpack_read(struct unpack *u, char *p, size_t n);
+static void unpack_stop(struct unpack *u);
+static bool unpack_broken(struct unpack *u);
+
+/* Column reached by a tab starting at column col. The kernels know at */
+/* compile time whether the tab width is a power of two (pow2), which  */
+/* spares them the division.                                           */
+#if !defined(LEN_LIBRARY)
+inline static size_t tab_stop(size_t col);
+#endif
+inline static size_t tab_next(size_t col, size_t tabs, bool pow2);
+
+/* --utf8: how many bytes the character at p takes up, and through width */
+/* how many columns. Bytes that aren't valid UTF-8 are one column each.  */
+inline static size_t utf8_char(const char *p, const char *end,
+                               size_t *width);
+/* Columns a code point takes up: 0, 1 or 2 */
+static size_t utf8_width(uint32_t cp);
+/* Bytes at p before the first one of \n, \r, \t and NUL or, with wide, */
+/* past ASCII: a stretch that counts a column a byte                   */
+inline static size_t text_run(const char *p, const char *end, bool wide);
+/* How many of n bytes end on a whole character */
+static size_t utf8_cut(const char *p, size_t n);
+
+#if !defined(LEN_LIBRARY)
+/* Line length histogram for --summary and --histogram. Lengths are the */
+/* ones -l shows; blank lines are counted apart since they are never    */
+/* checked. Short lengths are counted exactly, longer ones by power of  */
+/* two. Two histograms merge by adding them up, so jobs and chunks each */
+/* keep their own.                                                       */
+#define HIST_EXACT 1024
+
+struct hist {
+        unsigned long long      exact[HIST_EXACT];
+        unsigned long long      log2[64];       /* By highest bit set    */
+        unsigned long long      count;
+        unsigned long long      blank;
+        unsigned long long      sum;
+        size_t                  max;
+};
+
+inline static void hist_add(struct hist *h, size_t length);
+static void hist_merge(struct hist *into, const struct hist *from);
+static struct hist *hist_new(void);
+
+/* --top: the longest lines seen so far, in a min-heap that never holds  */
+/* more than topLines of them, so the shortest is the one to go when a   */
+/* longer line turns up. Lines in mapped files are kept by where they    */
+/* start and read again when they're printed. Streams can't be read      */
+/* again, so their lines are copied, up to the window's worth a line of  */
+/* them comes in first. Like histograms, jobs and chunks each keep their */
+/* own and they're merged as the writer gets to them.                    */
+struct top_line {
+        size_t          len;            /* As check_file() counts it      */
+        size_t          line;
+        int             number;         /* The file's, for ties           */
+        char            *name;          /* Owned, once in the total       */
+        size_t          offset;         /* In the file, or SIZE_MAX       */
+        char            *text;          /* Owned copy if not mapped       */
+        size_t          bytes;
+        bool            cut;            /* text is only the start of it   */
+        uint64_t        dev;            /* The file when it was checked,  */
+        uint64_t        ino;            /* to be sure it's the same when  */
+        int64_t         mtime;          /* it's read again; 0 if unknown  */
+};
+
+struct top {
+        struct top_line *lines;
+        size_t          count;
+        size_t          cap;
+        char            *first;         /* A long stream line's start     */
+        uint64_t        dev;            /* What lines merged by name get  */
+        uint64_t        ino;
+        int64_t         mtime;          /* Nanoseconds                    */
+};
+
+static struct top *top_new(void);
+/* Offers a line borrowing its text, which is copied if it's kept */
+inline static void top_offer(struct top *t, const struct top_line *cand);
+/* Moves the lines of from into into, counting from's line numbers and */
+/* offsets from lineBase and offsetBase. With a name, the lines moved  */
+/* get their own copies of it.                                          */
+static void top_merge(struct top *into, struct top *from, const char *name,
+                      size_t lineBase, size_t offsetBase);
+static void top_free(struct top *t);
+/* Prints the lines kept, longest first */
+static void report_top(struct outbuf *out, struct top *t);
+#endif
+
+#if !defined(LEN_LIBRARY)
+/* Check-only scanning, used when nothing is printed. Input is fed in */
+/* blocks of any size and a line may span blocks; all that comes out  */
+/* is whether some line was out of range.                             */
+struct scan {
+        size_t          col;            /* Width of the line so far       */
+        bool            skipLF;         /* Last block ended with a \r     */
+        bool            violated;
+        struct hist     *hist;          /* Line lengths go here if set    */
+        size_t          longest;        /* Of the non-blank lines, as -l  */
+        size_t          shortest;       /* shows them                     */
+        unsigned long long lines;
+
+        /* --utf8: a character may be split across blocks */
+        uint32_t        cp;             /* Its bits so far                */
+        unsigned        need;           /* Continuation bytes to come     */
+        unsigned        have;           /* Bytes of it seen               */
+
+        /* Where the line being measured starts, for line_exempt() to */
+        /* look at if it's out of range. NULL once the block it's in  */
+        /* is gone, which leaves what first holds of it.              */
+        const char      *start;
+        char            *first;
+        size_t          firstLen;
+};
+
+static void scan_finish(struct scan *st, const char *end);
+#endif
+
+/* Size of the blocks read from streams that can't be mapped */
+#define SCAN_BLOCK (1 << 16)
+
+/* The inner loops are built once for each set of the options that     */
+/* change them, with those options as constants, and looked up in a    */
+/* table indexed by the set: KERNEL_WIDE for --utf8, KERNEL_POW2 for a */
+/* tab width that's a power of two.                                    */
+#define KERNEL_WIDE 1
+#define KERNEL_POW2 2
+#define KERNEL_SETS 4
+
+#if !defined(LEN_LIBRARY)
+typedef void (*scan_fn)(struct scan *st, const char *p, size_t n);
+
+/* Picks the widest kernels this CPU can run for scan_kernels */
+static void kernel_select(void);
+static const scan_fn *scan_kernels = NULL;
+#endif
+/* The set for a tab width and whether text is --utf8 */
+static int kernel_set(size_t tabs, bool wide);
+
+#if !defined(LEN_LIBRARY)
+struct job;
+
+/* Runs a whole source through its scan kernel, filling in the job's */
+/* histogram and line widths. True if it had a violation.            */
+static bool source_scan(struct source *src, struct job *job);
+
+/* Mapped files at least twice this size are split into chunks of about */
+/* this size and checked in parallel when more than one job is allowed.  */
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (1 << 23)
+#endif
 
-/* my_getline() will react to the MY_GETLINE_TABWIDTH macro by expanding */
-/* tabs to that many spaces                                              */
-size_t my_getline(char **buf, size_t *size, FILE *fd);
+/* A line number left for the writer: chunks don't know where they start */
+struct mark {
+        size_t          at;             /* Offset in the buffered output   */
+        size_t          line;           /* Line number within the chunk    */
+};
 
+/* A mark for format_separator() rather than a line number */
+#define MARK_SEPARATOR SIZE_MAX
+
+/* One file to check. Parallel runs keep one per file so results can be */
+/* written out in the order the files were given.                       */
+struct job {
+        const char      *name;
+        int             number;         /* 1-indexed, for the header      */
+        bool            opened;
+        bool            violated;
+        bool            done;
+        struct outbuf   *out;           /* Where printed lines go         */
+        bool            deferHeader;    /* Leave the header to the writer */
+        long            headerAt;       /* Its offset in out, -1 if none  */
+        struct outbuf   text;           /* Buffered output (parallel)     */
+
+        /* Set for one chunk of a file split up by check_chunks() */
+        const char      *range;
+        size_t          rangeLen;
+        size_t          lines;          /* Lines in the chunk             */
+        bool            deferLines;     /* Mark line numbers, don't print */
+        struct mark     *marks;
+        size_t          nmarks;
+        size_t          capMarks;
+
+        struct hist     *hist;          /* --summary and --histogram      */
+        struct top      *top;           /* --top                          */
+
+        /* Set for files found by walk() */
+        char            *path;          /* Owned copy of name              */
+        bool            unreadable;     /* A directory that wouldn't open */
+
+        /* Set when uring_load() has already read in the whole file */
+        const char      *data;
+        size_t          dataLen;
+        bool            preloaded;
+
+        /* Widest and narrowest non-blank lines, when nothing is printed */
+        size_t          longest;
+        size_t          shortest;
+
+        struct stats    stats;          /* --stats                        */
+};
+
+/* --cache: verdicts for files, kept in a file of fixed-size slots that */
+/* is mapped shared, so any number of threads and processes can use it */
+/* at once. A slot is written under a sequence number, odd while the    */
+/* write is going on, and is only believed if the number is even and    */
+/* the same before and after reading it. A file is looked up by where   */
+/* it lives and when it last changed, and by every setting that could   */
+/* change its verdict. --cache-strict also wants a hash of the contents */
+/* to match.                                                            */
+#define CACHE_MAGIC "len-cache-1"
+#define CACHE_VERSION 2
+#define CACHE_SLOTS (1 << 18)           /* Power of two                  */
+#define CACHE_PROBES 8
+
+#define CACHE_VIOLATED  1
+#define CACHE_HASHED    2
+
+/* --diff: the lines a diff adds to each file it names. Files are checked */
+/* in the order the diff gives them, so a job's number finds its hunks.  */
+struct hunk {
+        size_t          first;          /* 1-indexed                      */
+        size_t          last;           /* One past the end               */
+};
+
+struct dfile {
+        char            *name;
+        struct hunk     *hunks;
+        size_t          count;
+        size_t          cap;
+};
+
+static struct {
+        struct dfile    *files;         /* NULL without --diff            */
+        size_t          count;
+        char            **names;
+} diff;
+
+static void diff_load(const char *name);
+/* Skips to the next line inside a hunk and reads it, leaving line at */
+/* its number. h is the hunk to start looking in.                     */
+static bool diff_next(struct source *src, const struct dfile *df,
+                      size_t *h, size_t *line, struct line *ln);
+
+struct cache_key {
+        uint64_t        dev;
+        uint64_t        ino;
+        uint64_t        size;
+        int64_t         mtime;          /* Nanoseconds                   */
+};
+
+/* The file starts with one slot's worth of header */
+struct cache_slot {
+        uint64_t        seq;
+        uint64_t        dev;
+        uint64_t        ino;
+        uint64_t        size;
+        int64_t         mtime;
+        uint64_t        hash;           /* With CACHE_HASHED             */
+        uint32_t        settings;
+        uint32_t        flags;
+        uint32_t        longest;        /* Widths as -l shows them       */
+        uint32_t        shortest;
+};
+
+static struct {
+        char            *map;           /* NULL if there's no cache      */
+        size_t          mapLen;
+        uint64_t        slots;
+} cache;
+
+/* Nothing printed needs the lines themselves */
+#define CACHING (cache.map != NULL && !PRINTING && !REPORTING && \
+                 diff.files == NULL && topLines == 0)
+
+static bool cache_open(const char *name);
+static bool cache_key(const char *name, struct cache_key *key);
+static uint64_t content_hash(const char *p, size_t n);
+inline static uint64_t hash_mix(uint64_t h, uint64_t v);
+/* True if the cache knows the file; *violated then says how it went */
+static bool cache_lookup(const struct cache_key *key, uint64_t hash,
+                         bool *violated);
+static void cache_store(const struct cache_key *key, uint64_t hash,
+                        const struct job *job);
+
+/* --daemon: a len that stays running and checks files for --client    */
+/* runs, so they skip starting up and reading files that haven't       */
+/* changed. Results are kept in memory by path and settings, and       */
+/* dropped when inotify says the file changed. Pending events are read */
+/* before every lookup, so nothing written before a request was sent   */
+/* is missed. Each of a pool of threads accepts and serves clients.    */
+/*                                                                     */
+/* A request is DAEMON_MAGIC, then "MAX MIN TABS NEWLINES UTF8 RECORDS */
+/* COUNT", the first five in the units of struct len_options, then     */
+/* COUNT absolute paths, each ended by a NUL. The reply is a line      */
+/* "STATUS HITS" for each file in order, STATUS being 0, 1 (lines out  */
+/* of range) or 2 (couldn't be read), followed by HITS lines "LINE     */
+/* LENGTH" if RECORDS is 1. Otherwise HITS is 0.                       */
+/*                                                                     */
+/* The socket is made readable and writable by its owner only. Clients */
+/* that stay silent are hung up on after DAEMON_TIMEOUT seconds, and   */
+/* once DAEMON_KEEP results are kept, older ones make way for new.     */
+#define DAEMON_MAGIC "len-daemon-1"
+#define DAEMON_BUCKETS 1024             /* To start with, power of two   */
+#define DAEMON_KEEP (1 << 16)           /* Results kept at most          */
+#define DAEMON_TIMEOUT 5                /* Seconds a client may idle     */
+#define DAEMON_BACKOFF 100              /* ms to wait out fd exhaustion  */
+
+/* inotify events that could change a kept result */
+#define KEPT_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+struct hit {
+        size_t          line;
+        size_t          length;         /* As -l shows it                */
+};
+
+/* A file's result under one set of settings */
+struct kept_file {
+        char            *path;
+        struct len_options opts;
+        uint64_t        hash;           /* Of path and opts              */
+        uint64_t        dev;            /* What path named when read     */
+        uint64_t        ino;
+        int             wd;
+        int             status;
+        struct hit      *hits;
+        size_t          count;
+        size_t          cap;
+        struct kept_file *next;         /* In the same bucket            */
+        struct kept_file *nextWatch;    /* Under the same watch          */
+};
+
+/* Indexed by watch descriptor */
+struct watch {
+        struct kept_file *files;
+        uint64_t        changed;        /* kept.serial at the last event */
+        unsigned        users;          /* Checks reading under it       */
+        bool            watched;        /* Not yet removed from inotify  */
+};
+
+static struct {
+        int             sock;
+        int             inotify;        /* -1: nothing is kept           */
+        pthread_mutex_t lock;
+        struct kept_file **buckets;
+        size_t          nbuckets;
+        size_t          count;
+        size_t          evict;          /* Bucket to make room from next */
+        struct watch    *watches;
+        size_t          nwatches;
+        uint64_t        serial;         /* Counts events                 */
+        uint64_t        forgot;         /* serial when the queue overflowed */
+} kept;
+
+/* Never returns */
+static void daemon_run(const char *name, int count);
+/* Returns only if no daemon answered */
+static void client_run(const char *name, char **names, int count);
+
+/* With --io-uring, small files are read a batch at a time: the opens,  */
+/* reads and closes for a whole batch go to the kernel in one call, and */
+/* the checker gets the contents already in memory. Only regular files */
+/* are taken; ones that are too big or not regular, or that fail, go    */
+/* through source_open() as usual, so nothing is lost when io_uring     */
+/* isn't there. One ring per thread. Pool workers take a few jobs at a  */
+/* time, so that one of them doesn't sit on work the others could do.   */
+#define URING_BATCH 64
+#define URING_CLAIM 8
+#define URING_BUFFER (1 << 16)          /* Files must be smaller         */
+#define URING_ENTRIES 256               /* Three per file, rounded up    */
+
+struct uring {
+        int                     fd;
+        bool                    broken;
+#if defined(LEN_URING)
+        void                    *sqMap;
+        void                    *cqMap;
+        size_t                  sqLen;
+        size_t                  cqLen;  /* 0 if shared with sqMap        */
+        struct io_uring_sqe     *sqes;
+        size_t                  sqesLen;
+        unsigned                *sqTail;
+        unsigned                *sqArray;
+        unsigned                sqMask;
+        unsigned                *cqHead;
+        unsigned                *cqTail;
+        unsigned                cqMask;
+        struct io_uring_cqe     *cqes;
+        char                    *bufs;  /* URING_BATCH registered buffers */
+#endif
+};
+
+/* False if io_uring can't be used here */
+static bool uring_init(struct uring *u);
+static void uring_free(struct uring *u);
+/* Marks those of the jobs it manages to read in whole as preloaded */
+static void uring_load(struct uring *u, struct job **list, size_t n);
+
+/* Checks one file, printing to job->out. False if it couldn't be opened */
+static bool check_file(struct source *src, struct job *job);
+static void job_mark(struct job *job, size_t at, size_t line);
+
+/* The -n and -l columns in front of a printed line. Returns how many */
+/* columns they take up on screen.                                    */
+static size_t print_prefix(struct outbuf *out, struct job *job, size_t line,
+                           size_t len);
+
+/* Sees a line that came as pieces (ln->partial) through to its end, and */
+/* returns its len. Prints it if it should be, header and all, and says */
+/* through exempt whether it's let off being out of range.               */
+static size_t stream_line(struct source *src, struct job *job, size_t line,
+                          struct line *ln, bool *violatedHere, bool *exempt);
+
+/* A long line whose fate waits on its end. The first HOLD_LIMIT bytes */
+/* are kept in data, and whatever comes after goes to a temporary file. */
+struct hold {
+        char            *data;
+        size_t          len;
+        FILE            *spill;
+};
+
+#define HOLD_LIMIT (1 << 20)
+
+/* Splits a big mapped file into line-aligned chunks, checks them in */
+/* parallel and writes the results to file->out in order            */
+static bool check_chunks(const struct source *src, struct job *file);
+
+/* Where a line being printed has got to. Text can be fed to it in */
+/* pieces; the color changes wait until there's text past them.     */
+struct render {
+        size_t          col;
+        size_t          tabEnd;
+        size_t          indent;         /* Screen columns the prefix took */
+        bool            maxPending;
+        bool            minPending;
+        bool            minColor;
+        bool            truncated;
+};
+
+/* Prints one line's text with -c coloring, -r truncation and the rear */
+/* padding short lines get, then the newline. indent is the width   */
+/* print_prefix() returned.                                           */
+static void render_line(struct outbuf *out, const struct line *ln,
+                        size_t indent);
+/* The same a piece at a time. len is only needed up front for whether */
+/* the line turns green at minLen, which it does whenever it's printed */
+/* while longer than maxLen.                                           */
+static void render_start(struct render *r, size_t len, size_t indent);
+static void render_feed(struct outbuf *out, struct render *r, const char *p,
+                        size_t n);
+static void render_end(struct outbuf *out, const struct render *r,
+                       size_t len);
+
+/* Prints the --|k: name|-- header that starts a file's offenders, or */
+/* what --format starts them with                                     */
+static void print_header(struct outbuf *out, const struct job *job);
+/* What --format ends them with */
+static void print_footer(struct outbuf *out);
+
+/* --format output. Records go straight into the output buffer, so     */
+/* nothing is allocated per line. The document around them, for sarif */
+/* and checkstyle, is opened before the first file and closed after    */
+/* the last.                                                           */
+static enum format strtoformat(const char *str);
+static void format_open(struct outbuf *out);
+static void format_close(struct outbuf *out);
+/* One record for a line out of range */
+static void print_record(struct outbuf *out, struct job *job, size_t line,
+                         size_t len);
+/* What goes between two records, which only the writer knows */
+static void format_separator(struct outbuf *out);
+/* Escape str for the inside of a JSON string or an XML attribute. */
+/* Bytes that aren't valid UTF-8 come out as U+FFFD, as do control  */
+/* characters XML can't hold.                                       */
+static void json_string(struct outbuf *out, const char *str);
+static void xml_string(struct outbuf *out, const char *str);
+/* Percent-encodes str for a URI reference, for sarif */
+static void uri_string(struct outbuf *out, const char *str);
+
+/* Checks files on a pool of jobs threads and writes their output in */
+/* order. Returns true if any file had a violation.                   */
+static bool run_jobs(char **names, int count, struct outbuf *out,
+                     struct hist *total, struct stats *statsTotal,
+                     struct top *topTotal);
+
+/* Prints a file's --summary or --histogram report and adds its lengths */
+/* to total. Frees the file's histogram.                                */
+static void report_job(struct outbuf *out, struct job *job,
+                       struct hist *total);
+static void report_total(struct outbuf *out, const struct hist *total);
+
+/* Prints a file's --stats line and adds it to total */
+static void stats_job(const struct job *job, struct stats *total);
+static void stats_merge(struct stats *into, const struct stats *from);
+/* Shares the time since start out among jobs read in one batch */
+static void stats_spread(struct job **list, size_t n, uint64_t start);
+/* Prints the line for all files, if there were several, and wall time */
+static void stats_total(const struct stats *total, uint64_t start);
+
+/* Hands each file named in names to emit, in order. With -R, directories */
+/* are walked in name order, on threads walkers when there are any, and   */
+/* every file under them that the filters let through is handed on as    */
+/* soon as its place in that order comes up. emit owns the paths it gets. */
+typedef void (*emit_fn)(void *ctx, char *path, bool unreadable);
+static void walk(char **names, int count, emit_fn emit, void *ctx,
+                 unsigned walkers);
+
+/* What check_serial() needs to check files one at a time as they come. */
+/* With --io-uring they are held back until a batch has been read.      */
+struct serial {
+        struct source   *src;
+        struct outbuf   *out;
+        struct hist     *total;
+        struct stats    *stats;         /* --stats for all files          */
+        struct top      *top;           /* --top for all files            */
+        int             number;
+        bool            violated;
+        struct uring    *uring;         /* NULL if not batching           */
+        struct job      batch[URING_BATCH];
+        size_t          pending;
+};
+
+static void check_serial(void *ctx, char *path, bool unreadable);
+/* Checks whatever check_serial() has held back */
+static void serial_flush(struct serial *ser);
+
+/* Adds a --include or --exclude glob */
+static void globs_add(struct globs *g, const char *pat);
+
+/* The config (--config, or .lenrc): sections headed by a glob in  */
+/* brackets, each giving the files whose paths match it settings   */
+/* that take the place of the defaults. Limits given on the        */
+/* command line are kept whatever the config says. Where several   */
+/* sections match, the later one wins:                             */
+/*                                                                 */
+/*      [*.java]                                                   */
+/*      max = 100                                                  */
+/*      [Makefile]                                                 */
+/*      tab-width = 4                                              */
+/*                                                                 */
+/* Globs without a / are matched against the last part of the path */
+/* and those with one against all of it. Globs that are just *.EXT */
+/* or a plain name are found in a hash table by the file's         */
+/* extension and name, and only the rest are tried one by one.     */
+#define SECTION_MAX     1
+#define SECTION_MIN     2
+#define SECTION_TABS    4
+
+struct section {
+        char            *glob;
+        unsigned        set;            /* Which of these it gives       */
+        unsigned        max;
+        unsigned        min;
+        unsigned        tabs;
+};
+
+/* The sections found under one extension or name, in order */
+struct section_slot {
+        const char      *key;           /* NULL if the slot is empty     */
+        bool            ext;
+        size_t          *sections;
+        size_t          count;
+};
+
+static struct {
+        struct section  *sections;
+        size_t          count;
+        struct section_slot *slots;
+        size_t          nslots;         /* Power of two                  */
+        size_t          *globbed;       /* Sections matched one by one   */
+        size_t          nglobbed;
+        unsigned        max;            /* From the command line, before */
+        unsigned        min;            /* they count the newline        */
+        unsigned        tabs;
+        unsigned        given;          /* SECTION_ bits for what it set */
+} config;
+
+/* Reads the config in name. It's only an error for it not to be there */
+/* if required.                                                          */
+static void config_load(const char *name, bool required);
+/* Sets maxLen, minLen and tabWidth for checking the file name on the */
+/* calling thread                                                     */
+static void limits_for(const char *name);
+
+/* Compiles a --ignore-pattern, and finds the literal it needs */
+static void exempt_add(const char *pat);
+/* Frees the calling thread's copy of the line, for a worker that's done */
+static void exempt_release(void);
+#endif
+/* Whether a line found out of range is to be let off: it holds the */
+/* marker or matches a --ignore-pattern. text excludes the newline. */
+static bool line_exempt(const char *text, size_t bytes);
+
+#if !defined(LEN_LIBRARY)
 int parseArgs(int argc, char **argv);
 
 int main(int argc, char **argv)
@@ -240,6 +1194,7 @@ int main(int argc, char **argv)
 
         /* i gives the index of the first filename */
         int i = parseArgs(argc, argv);
+        uint64_t start = stats_clock();
 
         /* Sanity check: minLen must not be greater than maxLen          */
         if (maxLen < minLen) {
@@ -248,12 +1203,59 @@ int main(int argc, char **argv)
                 exit(BAD_ARGS);
         }
 
+        /* As given, for files no section of the config matches */
+        config.max = maxLen;
+        config.min = minLen;
+        config.tabs = tabWidth;
+        if (daemonName == NULL)
+                config_load(configName ? configName : ".lenrc",
+                            configName != NULL);
+
+        /* All a client gets back is where lines are and how long */
+        if (clientName != NULL && config.count > 0) {
+                fprintf(stderr, "%s %s\n", NO_COMBINE, "--client with a "
+                        "config");
+                exit(BAD_ARGS);
+        }
+        /* Nor does it have any say in what the daemon, serving them */
+        /* all, ignores                                                */
+        if ((clientName != NULL || daemonName != NULL) && nexempts > 0) {
+                fprintf(stderr, "%s %s\n", NO_COMBINE, "--ignore-pattern "
+                        "with --client or --daemon");
+                exit(BAD_ARGS);
+        }
+        if (clientName != NULL && ((PRINTING && format == FORMAT_TEXT) ||
+            REPORTING || topLines != 0 || recursive || diffName != NULL)) {
+                fprintf(stderr, "%s %s\n", NO_COMBINE, "--client with -p, "
+                        "-P, -R, --diff, --top or reports");
+                exit(BAD_ARGS);
+        }
+
+        /* Reports take the place of printed lines */
+        if (REPORTING || topLines != 0) print = printAll = false;
+
+        /* Only the return value is wanted */
+        if (quiet) print = printAll = summary = histogram = false;
+        if (quiet) topLines = 0;
+
+        /* Records are for the lines out of range, and nothing else */
+        if (format != FORMAT_TEXT) {
+                if (REPORTING || topLines != 0 || quiet) {
+                        fprintf(stderr, "%s %s\n", NO_COMBINE,
+                                quiet ? "--format with --quiet" :
+                                "--format with reports");
+                        exit(BAD_ARGS);
+                }
+                print = offenders = true;
+                printAll = color = false;
+        }
+
         /* When the user specifies 0 chars, we have to account for the fact */
         /* that newlines are, in fact, characters, and will be counted by   */
         /* the program.                                                     */
         if (minLen == 0) minLen = 1;
 
-        int numFiles = argc - i;
+        numFiles = argc - i;
 
         /* Since getline counts newlines, we need to allow for them  */
         if (!newlines) {
@@ -263,202 +1265,2257 @@ int main(int argc, char **argv)
         }
 
         /* These must persist and are set for each file examined     */
-        FILE *fd = NULL;
-        char *buf = NULL;
-        size_t size = 0;
+        struct source src = { NULL, NULL, 0, 0, NULL, 0, false, NULL,
+                               0, false, false, false, 0, NULL, 0, false,
+                               NULL, { 0 }, 0 };
 
         if (flags) print_flags(i, argc);
 
-        /* If no file specified but '-' specified as last option, read from */
-        /* stdin instead and reduce i so to pretend stdin is a file.        */
-        if ((argv[argc - 1][0] == READ_STDIN &&
-            argv[argc - 1][1] == NULLCHAR)) {
-                if (numFiles == 0) {
-                        fd = stdin;
-                        i--;
-                }
+        if (cacheName != NULL && !cache_open(cacheName)) {
+                fprintf(stderr, "%s %s\n", "Could not use cache", cacheName);
+                exit(BAD_FILE);
         }
 
-        /* If no file specified, print an error message and exit */
-        if (argc - i < 1) {
-                fprintf(stderr, "%s\n", NO_FILE);
-                exit(BAD_FILE);
+        kernel_select();
+
+        /* -j 0 means one job per CPU */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs == 0) jobs = cpus > 0 ? (unsigned) cpus : 1;
+        pipeStdin = cpus > 1 || jobs > 1;
+
+        /* The daemon takes its settings from each client instead */
+        if (daemonName != NULL) daemon_run(daemonName, argc - i);
+
+        /* With no daemon to ask, the files are checked here as usual */
+        if (clientName != NULL) client_run(clientName, &argv[i], argc - i);
+
+        char **names;
+        int count;
+
+        /* With --diff the files are the ones the diff names */
+        if (diffName != NULL) {
+                if (argc - i > 0) {
+                        fprintf(stderr, "%s %s\n", NO_COMBINE,
+                                "--diff with file names");
+                        exit(BAD_ARGS);
+                }
+                diff_load(diffName);
+                names = diff.names;
+                count = (int) diff.count;
+                numFiles = count;
+        } else {
+                /* If no file specified but '-' specified as last option, */
+                /* read from stdin instead and reduce i so to pretend     */
+                /* stdin is a file.                                       */
+                if ((argv[argc - 1][0] == READ_STDIN &&
+                    argv[argc - 1][1] == NULLCHAR)) {
+                        if (numFiles == 0) i--;
+                }
+
+                /* If no file specified, print an error message and exit */
+                if (argc - i < 1) {
+                        fprintf(stderr, "%s\n", NO_FILE);
+                        exit(BAD_FILE);
+                }
+                names = &argv[i];
+                count = argc - i;
         }
 
         /* violated is tracked cumulatively. A violation in any file will     */
         /* cause the entire batch to be reported as bad                       */
         bool violated = false;
 
+        /* All files' line lengths, for --summary and --histogram */
+        static struct hist total;
+        static struct stats statsTotal;
+        static struct top topTotal;
+
+        /* Everything printed goes through here on its way to stdout */
+        struct outbuf out;
+        ob_init(&out, stdout);
+        term_init();
+        format_open(&out);
+
+        /* Several files and several jobs: hand them to the worker pool */
+        if (jobs > 1 && (count > 1 || recursive))
+                violated = run_jobs(names, count, &out, &total, &statsTotal,
+                                    &topTotal);
+
+        /* Otherwise process each remaining argument as a filename */
+        else {
+                static struct serial ser;
+                struct uring ring;
+
+                ser.src = &src;
+                ser.out = &out;
+                ser.total = &total;
+                ser.stats = &statsTotal;
+                ser.top = &topTotal;
+                if (uring && uring_init(&ring)) ser.uring = &ring;
+                walk(names, count, check_serial, &ser, 0);
+                serial_flush(&ser);
+                if (ser.uring != NULL) uring_free(ser.uring);
+                violated = ser.violated;
+        }
+
+        /* Several files: the histogram for all of them goes last */
+        if (REPORTING && MANY_FILES) report_total(&out, &total);
+        if (topLines != 0) report_top(&out, &topTotal);
+
+        format_close(&out);
+        ob_flush(&out);
+        if (stats) {
+                fflush(stdout);
+                stats_total(&statsTotal, start);
+        }
+        free(out.data);
+        free(src.buf);
+        return violated ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static bool check_file(struct source *src, struct job *job)
+{
+        struct outbuf *out = job->out;
+        struct line ln;
+        struct cache_key key;
+        uint64_t hash = 0;
+        uint64_t start = stats_clock();
+
+        if (job->unreadable) return false;
+        limits_for(job->name);
+
+        /* Unchanged files can be answered from the cache unopened */
+        bool cached = CACHING && job->range == NULL &&
+                      cache_key(job->name, &key);
+        if (cached && !cacheStrict &&
+            cache_lookup(&key, 0, &job->violated)) {
+                job->opened = true;
+                return true;
+        }
+
+        if (job->range != NULL) {
+                source_range(src, job->range, job->rangeLen);
+        } else if (job->preloaded &&
+                   codec_of(job->data, job->dataLen) == CODEC_NONE) {
+                source_range(src, job->data, job->dataLen);
+                if (PRINTING && color) term_default(out);
+        } else {
+                if (!source_open(src, job->name)) return false;
+                if (PRINTING && color) term_default(out);
+        }
+        job->opened = true;
+        if (REPORTING) job->hist = hist_new();
+        if (topLines != 0) job->top = top_new();
+
+        /* Mapped lines are read back by offset when they're printed */
+        struct stat st;
+        if (job->top != NULL && job->range == NULL && src->fd == NULL &&
+            stat(job->name, &st) == 0) {
+                job->top->dev = (uint64_t) st.st_dev;
+                job->top->ino = (uint64_t) st.st_ino;
+                job->top->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 +
+                                  st.st_mtim.tv_nsec;
+        }
+
+        /* Mapped bytes count as read; streams count theirs as they go */
+        src->stats = stats ? &job->stats : NULL;
+        if (stats) {
+                if (job->range == NULL) job->stats.bytes += src->mapLen;
+                stats_lap(&job->stats.open, start);
+        }
+
+        /* Only what's mapped is hashed; the rest isn't cached strictly */
+        if (cached && cacheStrict) {
+                cached = src->map != NULL || src->mapLen == 0;
+                if (cached) hash = content_hash(src->map, src->mapLen);
+                if (cached && cache_lookup(&key, hash, &job->violated)) {
+                        source_close(src);
+                        return true;
+                }
+        }
+
         /* Track per-file violations for conditional filename header printing */
         bool violatedHere = false;
 
-        /* Process each remaining argument as a filename */
-        for (; i < argc; ++i) {
-                if (argv[i][0] == READ_STDIN) {
-                        if (argv[i][1] == '\0')
-                                fd = stdin;
-                        else {
-                                fd = NULL;
-                        }
-                }
-                else fd = fopen(argv[i], "r");
-                if (fd == NULL){
-                        fprintf(stderr, "%s %s %s\n", "Could not open file",
-                                                      argv[i], "for reading");
-                        exit(BAD_FILE);
-                }
+        /* With --diff, only lines in the file's hunks are looked at */
+        const struct dfile *df = NULL;
+        size_t h = 0;
+        if (diff.files != NULL) df = &diff.files[job->number - 1];
 
-                violatedHere = false;
+        /* Big files get split up, unless they're already being checked */
+        /* alongside others by run_jobs()                                */
+        if (jobs > 1 && job->range == NULL && !job->deferHeader && !df &&
+            src->map != NULL && src->mapLen >= 2 * (size_t) CHUNK_SIZE) {
+                job->violated = check_chunks(src, job);
+                if (job->violated && PRINTING) print_footer(out);
+                source_close(src);
+                if (cached && !stopped_at(job->number))
+                        cache_store(&key, hash, job);
+                return true;
+        }
 
-                if (PRINTING && color) term_default();
+        /* Nothing is printed, so all that matters is whether any */
+        /* line is out of range                                    */
+        if (!PRINTING && df == NULL && job->top == NULL) {
+                job->violated = source_scan(src, job);
+                job->opened = !source_broken(src);
+                source_close(src);
+                if (!job->opened) return false;
 
+                /* A scan -q cut short has no verdict worth keeping */
+                if (cached && !stopped_at(job->number))
+                        cache_store(&key, hash, job);
+                return true;
+        }
 
-                size_t line = 0;
-                size_t len = -1;
-                size_t index = 0;
-                size_t charCount = 0;
+        size_t line = 0;
+        size_t len = -1;
+        uint64_t loop = stats_clock();
 
-                /* Assignment evaluates to the value assigned */
-                while((len = my_getline(&buf, &size, fd)) !=
-                                        (size_t) -1) {
-                        /* Real life counting is 1-indexed */
-                        ++line;
+        while (df == NULL ? source_next(src, &ln) :
+                            diff_next(src, df, &h, &line, &ln)) {
+                len = ln.len;
 
-                        /* Don't process blank lines for violations, */
-                        /* but do print them when printing files     */
-                        if (len == 1 && !printAll) continue;
+                /* Real life counting is 1-indexed */
+                if (df == NULL) ++line;
 
-                        /* Print lines that fit none, either, or any */
-                        /* condition. Track violations of the range. */
-                        /* Don't count newlines at the end of non    */
-                        /* empty lines. ( > instead of >= )          */
-                        if ((len < minLen || len > maxLen)) {
-                                /* Label files at first violation. Don't call */
-                                /* out files completely within tolerance.     */
-                                if (!violatedHere) PRINT_FILENAME_HEADER;
-                                violated = true;
-                                violatedHere = true;
-                                if (!offenders && !printAll) continue;
-                        } else {
-                                if (offenders && !printAll) continue;
+                /* Lines longer than the window are seen to the end, */
+                /* and printed if need be, before being counted       */
+                bool streamed = ln.partial;
+                bool exempt = false;
+                size_t firstBytes = 0;
+                if (streamed && job->top != NULL) {
+                        struct top *t = job->top;
+                        if (t->first == NULL) t->first = malloc(SCAN_BLOCK);
+                        if (t->first == NULL) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
                         }
+                        firstBytes = ln.bytes;
+                        memcpy(t->first, ln.text, firstBytes);
+                }
+                if (streamed)
+                        len = stream_line(src, job, line, &ln, &violatedHere,
+                                          &exempt);
 
-                        /* Line numbers up to 10^7 - 1. If your files are  */
-                        /* longer than that, you have bigger problems than */
-                        /* the output from this program not lining up      */
-                        if (PRINTING && lineNums)
-                                fprintf(stdout, "%7lu", (unsigned long) line);
-
-                        /* Line lengths up to 10^3 - 1. If your  lines are */
-                        /* longer than that, you have other problems.      */
-                        if (PRINTING && lineLengths) {
-                                fputc(' ', stdout);
-                                if ((color) && (len != 1)){
-                                        if (len < minLen || len > maxLen)
-                                                term_color(false);
-                                        else term_color(true);
-                                }
-                                /* We may or may not want to count newlines */
-                                fprintf(stdout, "[%3lu]", newlines ?
-                                                           len : (len - 1));
-                                if (color) term_default();
+                if (job->top != NULL && len != 1) {
+                        struct top_line cand = { len, line, job->number,
+                                                 NULL, SIZE_MAX,
+                                                 (char *) ln.text, ln.bytes,
+                                                 false, 0, 0, 0 };
+                        if (streamed) {
+                                cand.text = job->top->first;
+                                cand.bytes = firstBytes;
+                                cand.cut = true;
+                        } else if (src->fd == NULL) {
+                                cand.offset = ln.text - src->map;
                         }
+                        top_offer(job->top, &cand);
+                }
 
-                        if (PRINTING && (lineNums || lineLengths)) {
-                            fprintf(stdout, ": ");
-                        }
+                if (job->hist != NULL) {
+                        if (len == 1) ++job->hist->blank;
+                        else hist_add(job->hist, newlines ? len : len - 1);
+                }
+                if (stats) {
+                        size_t shown = newlines ? len : len - 1;
+                        ++job->stats.lines;
+                        if (len != 1 && shown > job->stats.longest)
+                                job->stats.longest = shown;
+                }
 
-                        bool overMaxLen = false;
-                        bool overMinLen = false;
-                        index = 0;
-
-                        /* Yes, I know this looks stupid. Trust me. */
-                        for (charCount = 0; charCount < (len - 1) &&
-                                            index < (len - 1); ++index) {
-
-                                /* Only turn red once we pass maxLen, but */
-                                /* we have to remember that the length    */
-                                /* counts the newline as a single char    */
-                                if (!overMaxLen && charCount >= (maxLen - 1)) {
-                                        overMaxLen = true;
-                                        if (PRINTING && color)
-                                                term_color(false);
-                                        if (truncate) {
-                                                fprintf(stdout, "%c",
-                                                        TRUNCATE_CHAR);
-                                                break;
-                                        }
-                                }
+                /* Don't process blank lines for violations, */
+                /* but do print them when printing files     */
+                if (len == 1 && !printAll) continue;
 
-                                /* Only turn green once we pass minLen, but */
-                                /* don't turn green if only printing lines  */
-                                /* out of tolerance - not relevant there    */
-                                if (!overMinLen &&
-                                    (charCount >= (minLen - 1))) {
-                                        overMinLen = true;
-                                        if (PRINTING || !offenders) {
-                                                if (color && (minLen != 1))
-                                                        if ((len <= maxLen) ||
-                                                            printAll)
-                                                               term_color(true);
-                                        }
-                                }
+                /* Exempt lines go the same way. Only lines out of */
+                /* range are looked at, so the rest cost nothing.  */
+                bool outside = len < minLen || len > maxLen;
+                if (outside && !streamed)
+                        exempt = line_exempt(ln.text, ln.bytes);
+                if (outside && exempt) {
+                        if (!printAll) continue;
+                        outside = false;
+                }
 
-                                if (PRINTING) {
-                                        fprintf(stdout, "%c", buf[index]);
-                                        ++charCount;
-                                }
+                /* Print lines that fit none, either, or any */
+                /* condition. Track violations of the range. */
+                /* Don't count newlines at the end of non    */
+                /* empty lines. ( > instead of >= )          */
+                if (outside) {
+                        /* Label files at first violation. Don't call */
+                        /* out files completely within tolerance.     */
+                        if (!violatedHere) PRINT_FILENAME_HEADER;
+                        violatedHere = true;
+                        if (quiet) {
+                                stop_all(job->number);
+                                break;
                         }
+                        if (!PRINTING) continue;
+                        if (!offenders && !printAll) continue;
+                } else {
+                        if (!PRINTING) continue;
+                        if (offenders && !printAll) continue;
+                }
+                if (format != FORMAT_TEXT) {
+                        print_record(out, job, line, len);
+                        continue;
+                }
+                if (streamed) continue;
 
-                        /* We don't want to rear pad if no minimum length */
-                        /* is set.                                        */
-                        /* Don't punish empty lines, but don't forget to  */
-                        /* account for the newline in nonempty lines      */
-                        if (minLen != 1 && len > 1 && charCount < minLen) {
-                                if (PRINTING && color) term_color(false);
-                                for (; charCount < (minLen - 1); ++charCount) {
-                                        if (color) {
-                                                fprintf(stdout, "%c",
-                                                        REAR_PADDING);
-                                        }
-                                }
-                        }
+                uint64_t rendering = stats_clock();
+                size_t indent = print_prefix(out, job, line, len);
+                render_line(out, &ln, indent);
+                if (stats) stats_lap(&job->stats.render, rendering);
+        }
+
+        /* The rest of the loop went to finding and measuring lines, */
+        /* which for streams is reading them                          */
+        if (stats) {
+                uint64_t rest = stats_clock() - loop - job->stats.render;
+                if (src->fd != NULL) job->stats.open += rest;
+                else job->stats.scan += rest;
+        }
+
+        /* Chunks leave the footer to the file they're part of */
+        if (violatedHere && PRINTING && job->range == NULL) print_footer(out);
+
+        job->opened = !source_broken(src);
+        source_close(src);
+        job->violated = violatedHere;
+        job->lines = line;
+        return job->opened;
+}
+
+/* Columns n takes up printed at least width wide */
+static size_t num_width(unsigned long n, size_t width)
+{
+        size_t count = 1;
+
+        while (n >= 10) {
+                n /= 10;
+                ++count;
+        }
+        return count > width ? count : width;
+}
+
+static size_t print_prefix(struct outbuf *out, struct job *job, size_t line,
+                           size_t len)
+{
+        size_t width = 0;
+
+        /* Line numbers up to 10^7 - 1. If your files are  */
+        /* longer than that, you have bigger problems than */
+        /* the output from this program not lining up      */
+        if (lineNums) {
+                if (job->deferLines) job_mark(job, out->len, line);
+                else ob_num(out, line, 7);
+                width += num_width(line, 7);
+        }
 
-                        /* The last character should be a newline. We take */
-                        /* this opporunity to reset terminal text color.   */
-                        if (PRINTING && color) term_default();
-                        if (PRINTING) fprintf(stdout, "%c", '\n');
+        /* Line lengths up to 10^3 - 1. If your  lines are */
+        /* longer than that, you have other problems.      */
+        if (lineLengths) {
+                ob_putc(out, ' ');
+                if ((color) && (len != 1)){
+                        if (len < minLen || len > maxLen)
+                                term_color(out, false);
+                        else term_color(out, true);
                 }
+                /* We may or may not want to count newlines */
+                ob_putc(out, '[');
+                ob_num(out, newlines ? len : (len - 1), 3);
+                ob_putc(out, ']');
+                if (color) term_default(out);
+                width += 3 + num_width(newlines ? len : (len - 1), 3);
+        }
 
-                if (fd != stdin) fclose(fd);
+        if (lineNums || lineLengths) {
+                ob_write(out, ": ", 2);
+                width += 2;
         }
+        return width;
+}
 
-        free(buf);
-        return violated ? EXIT_FAILURE : EXIT_SUCCESS;
+static void hold_add(struct hold *h, const char *p, size_t n)
+{
+        /* Pieces are kept whole, so what's in memory ends on a character */
+        if (h->spill == NULL && h->len + n <= HOLD_LIMIT) {
+                if (h->data == NULL) h->data = malloc(HOLD_LIMIT);
+                if (h->data == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                memcpy(h->data + h->len, p, n);
+                h->len += n;
+                return;
+        }
+
+        if (h->spill == NULL) h->spill = tmpfile();
+        if (h->spill == NULL || fwrite(p, 1, n, h->spill) != n) {
+                fprintf(stderr, "%s\n", NO_SPILL);
+                exit(MEM_EXCEEDED);
+        }
 }
 
-int parseArgs(int argc, char **argv)
+/* Feeds everything held to r, reading the spill back through data */
+static void hold_release(struct outbuf *out, struct render *r,
+                         struct hold *h)
 {
-        int i;
-        for (i = 1; argv[i] != NULL; ++(i)) {
-                if (MATCH_S(i, 0, OPTION)){
-                        if (MATCH_S(i, 1, NULLCHAR)) {
-                                return i;
+        render_feed(out, r, h->data, h->len);
+        if (h->spill == NULL) return;
+
+        rewind(h->spill);
+        size_t left = 0;
+        size_t got;
+        while ((got = fread(h->data + left, 1, HOLD_LIMIT - left,
+                            h->spill)) > 0) {
+                size_t n = left + got;
+                size_t cut = utf8 ? utf8_cut(h->data, n) : n;
+                render_feed(out, r, h->data, cut);
+                left = n - cut;
+                memmove(h->data, h->data + cut, left);
+        }
+        if (ferror(h->spill)) {
+                fprintf(stderr, "%s\n", NO_SPILL);
+                exit(MEM_EXCEEDED);
+        }
+        render_feed(out, r, h->data, left);
+}
+
+static void hold_free(struct hold *h)
+{
+        free(h->data);
+        if (h->spill != NULL) fclose(h->spill);
+}
+
+/* A line's fate is settled as soon as possible, and until it is, its  */
+/* pieces are held. -p and -a lines print from the start once their    */
+/* file's header is out of the way; offenders print once they pass     */
+/* maxLen, which is also when -P drops them. -l has to wait for the    */
+/* whole length to print it first, and short lines for their end.     */
+/* Whether the line is exempt is up to its first piece, as that is all */
+/* there is of it to go on, but it's only matched once the line is     */
+/* known to be out of range. The first piece nearly always shows that  */
+/* by itself; if it doesn't, it's kept until the rest does.            */
+static size_t stream_line(struct source *src, struct job *job, size_t line,
+                          struct line *ln, bool *violatedHere, bool *exempt)
+{
+        enum { UNDECIDED, PRINT, DROP } fate = UNDECIDED;
+        struct outbuf *out = job->out;
+        struct hold h = { NULL, 0, NULL };
+        struct render r;
+        size_t len = ln->len;
+        bool over = false;
+        bool matched = len > maxLen;
+        char *first = NULL;
+        size_t firstBytes = ln->bytes;
+
+        *exempt = matched && line_exempt(ln->text, ln->bytes);
+        if (!matched) {
+                first = malloc(firstBytes ? firstBytes : 1);
+                if (first == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                memcpy(first, ln->text, firstBytes);
+        }
+
+        if (!PRINTING || format != FORMAT_TEXT) {
+                fate = DROP;
+        } else if (printAll && !lineLengths &&
+                   (*violatedHere || !MANY_FILES)) {
+                fate = PRINT;
+                render_start(&r, len, print_prefix(out, job, line, len));
+        }
+
+        for (;;) {
+                if (!matched && len > maxLen) {
+                        *exempt = line_exempt(first, firstBytes);
+                        matched = true;
+                }
+                over = len > maxLen && !*exempt;
+                if (over && !*violatedHere) {
+                        PRINT_FILENAME_HEADER;
+                        *violatedHere = true;
+                }
+                if (over && quiet) break;
+
+                if (len > maxLen && *exempt && !printAll) fate = DROP;
+                if (over && fate == UNDECIDED) {
+                        if (!offenders && !printAll) {
+                                fate = DROP;
+                        } else if (!lineLengths) {
+                                fate = PRINT;
+                                render_start(&r, len, print_prefix(out, job,
+                                                                   line, len));
+                                hold_release(out, &r, &h);
                         }
-                        if (MATCH_S(i, 1, OPTION)){ /* Long form options */
-                                if (MATCH_L(i, MAX_LONG)) {
-                                        ARG_CHECK(i);
-                                        maxLen = strtol(argv[i],
-                                                        (char **)NULL, 10);
-                                } else if (MATCH_L(i, MIN_LONG)) {
-                                        ARG_CHECK(i);
-                                        minLen = strtol(argv[i],
-                                                 (char **)NULL, 10);
-                                } else if (MATCH_L(i, TABWIDTH_LONG)) {
-                                        ARG_CHECK(i);
-                                        tabWidth = strtol(argv[i],
-                                                         (char **)NULL, 10);
-                                } else if (MATCH_L(i, MATCHES_LONG)) {
+                }
+
+                if (fate == PRINT) render_feed(out, &r, ln->text, ln->bytes);
+                else if (fate == UNDECIDED)
+                        hold_add(&h, ln->text, ln->bytes);
+
+                if (!ln->partial || !source_next(src, ln)) break;
+                len = ln->len;
+        }
+
+        if (!matched && len < minLen)
+                *exempt = line_exempt(first, firstBytes);
+        free(first);
+
+        /* Decided just as check_file() would have */
+        if (fate == UNDECIDED && !(over && quiet)) {
+                bool outside = len < minLen || len > maxLen;
+                bool show;
+                if (outside && *exempt) {
+                        show = printAll;
+                } else if (outside) {
+                        if (!*violatedHere) PRINT_FILENAME_HEADER;
+                        *violatedHere = true;
+                        show = !quiet && (offenders || printAll);
+                } else {
+                        show = !offenders || printAll;
+                }
+                if (show) {
+                        fate = PRINT;
+                        render_start(&r, len, print_prefix(out, job, line,
+                                                           len));
+                        hold_release(out, &r, &h);
+                }
+        }
+        if (fate == PRINT) render_end(out, &r, len);
+
+        hold_free(&h);
+        return len;
+}
+
+static void job_mark(struct job *job, size_t at, size_t line)
+{
+        if (job->nmarks == job->capMarks) {
+                size_t cap = job->capMarks ? 2 * job->capMarks : 256;
+                struct mark *grown = realloc(job->marks,
+                                             cap * sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                job->marks = grown;
+                job->capMarks = cap;
+        }
+        job->marks[job->nmarks].at = at;
+        job->marks[job->nmarks].line = line;
+        ++job->nmarks;
+}
+
+/* How far workers may run ahead of the writer, in files. Bounds the */
+/* amount of buffered output.                                         */
+#define JOB_WINDOW 256
+
+/* A pool started without a list is fed by pool_add() until pool_close(). */
+/* Its jobs then live in a ring of window slots, reused once written.     */
+struct pool {
+        pthread_mutex_t lock;
+        pthread_cond_t  changed;        /* A job finished or was written */
+        struct job      *jobs;
+        int             count;
+        int             window;         /* Max jobs out but not written  */
+        int             next;           /* Next job to hand out          */
+        int             written;        /* Jobs already written out      */
+        bool            open;           /* More jobs may still be added  */
+        bool            ring;
+        size_t          batch;          /* Jobs a worker takes at a time */
+        pthread_t       *tids;
+        unsigned        threads;
+};
+
+static struct job *pool_job(struct pool *pool, int k)
+{
+        return &pool->jobs[pool->ring ? k % pool->window : k];
+}
+
+/* Whether -q leaves nothing from the next job on to check. Called with */
+/* the lock held.                                                       */
+static bool pool_stopped(struct pool *pool)
+{
+        if (pool->next < pool->count)
+                return stopped_at(pool_job(pool, pool->next)->number);
+        return stopped();
+}
+
+static void *job_worker(void *arg)
+{
+        struct pool *pool = arg;
+        struct source src = { NULL, NULL, 0, 0, NULL, 0, false, NULL,
+                               0, false, false, false, 0, NULL, 0, false,
+                               NULL, { 0 }, 0 };
+        struct job *run[URING_BATCH];
+        struct uring ring;
+        bool batching = pool->batch > 1 && uring_init(&ring);
+        size_t most = batching ? pool->batch : 1;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                while (!pool_stopped(pool) &&
+                       ((pool->next >= pool->count && pool->open) ||
+                        (pool->next < pool->count &&
+                         pool->next >= pool->written + pool->window)))
+                        pthread_cond_wait(&pool->changed, &pool->lock);
+                if (pool->next >= pool->count || pool_stopped(pool)) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+
+                /* Whatever is ready, up to a batch */
+                size_t n = 0;
+                do run[n++] = pool_job(pool, pool->next++);
+                while (n < most && pool->next < pool->count &&
+                       pool->next < pool->written + pool->window);
+                pthread_mutex_unlock(&pool->lock);
+
+                if (batching) {
+                        uint64_t t = stats_clock();
+                        uring_load(&ring, run, n);
+                        stats_spread(run, n, t);
+                }
+
+                for (size_t k = 0; k < n; ++k) {
+                        struct job *job = run[k];
+
+                        ob_init(&job->text, NULL);
+                        job->out = &job->text;
+                        if (!stopped_at(job->number)) check_file(&src, job);
+                        if (quiet && job->violated) stop_all(job->number);
+
+                        pthread_mutex_lock(&pool->lock);
+                        job->done = true;
+                        pthread_cond_broadcast(&pool->changed);
+                        pthread_mutex_unlock(&pool->lock);
+                }
+        }
+
+        if (batching) uring_free(&ring);
+        free(src.buf);
+        exempt_release();
+        return NULL;
+}
+
+/* Starts up to jobs workers on the given jobs, which they take batch at */
+/* a time                                                                */
+static void pool_start(struct pool *pool, struct job *list, int count,
+                       int window, size_t batch)
+{
+        pool->batch = batch;
+        pool->jobs = list;
+        pool->count = count;
+        pool->window = window;
+        pool->next = 0;
+        pool->written = 0;
+        pool->open = list == NULL;
+        pool->ring = list == NULL;
+        pool->threads = jobs < (unsigned) count ? jobs : (unsigned) count;
+        if (pool->ring) {
+                pool->jobs = calloc(window, sizeof(*pool->jobs));
+                pool->threads = jobs;
+        }
+        pool->tids = malloc(pool->threads * sizeof(*pool->tids));
+        if (pool->tids == NULL || pool->jobs == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->changed, NULL);
+
+        for (unsigned t = 0; t < pool->threads; ++t) {
+                if (pthread_create(&pool->tids[t], NULL, job_worker, pool)) {
+                        /* Whatever did start will get through the list */
+                        if (t == 0) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
+                        }
+                        pool->threads = t;
+                        break;
+                }
+        }
+}
+
+/* Blocks until job k has been checked. False if there is no job k and */
+/* none will be added, or if -q has called everything off.              */
+static bool pool_wait(struct pool *pool, int k)
+{
+        pthread_mutex_lock(&pool->lock);
+        while (!(k < pool->count ? stopped_at(pool_job(pool, k)->number)
+                                 : stopped()) &&
+               ((k >= pool->count && pool->open) ||
+                (k < pool->count && !pool_job(pool, k)->done)))
+                pthread_cond_wait(&pool->changed, &pool->lock);
+        bool there = k < pool->count &&
+                     !stopped_at(pool_job(pool, k)->number);
+        pthread_mutex_unlock(&pool->lock);
+        return there;
+}
+
+/* Queues a file found by walk(), once its slot in the ring is free */
+static void pool_add(void *ctx, char *path, bool unreadable)
+{
+        struct pool *pool = ctx;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!stopped() && pool->count >= pool->written + pool->window)
+                pthread_cond_wait(&pool->changed, &pool->lock);
+        if (stopped()) {
+                pthread_mutex_unlock(&pool->lock);
+                free(path);
+                return;
+        }
+
+        struct job *job = pool_job(pool, pool->count);
+        memset(job, 0, sizeof(*job));
+        job->name = path;
+        job->path = path;
+        job->unreadable = unreadable;
+        job->number = pool->count + 1;
+        job->deferHeader = true;
+        job->headerAt = -1;
+        ++pool->count;
+
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_close(struct pool *pool)
+{
+        pthread_mutex_lock(&pool->lock);
+        pool->open = false;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/* Job k has been written out; lets the workers move further ahead */
+static void pool_release(struct pool *pool, int k)
+{
+        struct job *job = pool_job(pool, k);
+
+        free(job->text.data);
+        free(job->marks);
+        free(job->hist);
+        top_free(job->top);
+        free(job->path);
+        job->text.data = NULL;
+        job->marks = NULL;
+        job->hist = NULL;
+        job->top = NULL;
+        job->path = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->written = k + 1;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_finish(struct pool *pool)
+{
+        for (unsigned t = 0; t < pool->threads; ++t)
+                pthread_join(pool->tids[t], NULL);
+        pthread_cond_destroy(&pool->changed);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->tids);
+        if (pool->ring) free(pool->jobs);
+}
+
+/* Writes a job's buffered output, putting the header (if wanted) and */
+/* any deferred line numbers, offset by lineBase, where it marked them */
+static void emit_job(struct outbuf *out, const struct job *job,
+                     const struct job *file, size_t lineBase, bool header)
+{
+        size_t pos = 0;
+        size_t m = 0;
+
+        header = header && job->headerAt >= 0;
+        for (;;) {
+                size_t next = job->text.len;
+                bool isHeader = false;
+
+                if (m < job->nmarks) next = job->marks[m].at;
+                if (header && (size_t) job->headerAt <= next) {
+                        next = job->headerAt;
+                        isHeader = true;
+                }
+
+                ob_write(out, job->text.data + pos, next - pos);
+                pos = next;
+
+                if (isHeader) {
+                        print_header(out, file);
+                        header = false;
+                } else if (m < job->nmarks) {
+                        size_t line = job->marks[m].line;
+                        if (line == MARK_SEPARATOR) format_separator(out);
+                        else ob_num(out, lineBase + line,
+                                    format == FORMAT_TEXT ? 7 : 0);
+                        ++m;
+                } else break;
+        }
+}
+
+/* With -R the files aren't known up front: walk() feeds them to the */
+/* pool from a thread of its own while they are being checked         */
+struct feed {
+        struct pool     *pool;
+        char            **names;
+        int             count;
+};
+
+static void *feed_pool(void *arg)
+{
+        struct feed *feed = arg;
+
+        walk(feed->names, feed->count, pool_add, feed->pool, jobs);
+        pool_close(feed->pool);
+        return NULL;
+}
+
+static bool run_jobs(char **names, int count, struct outbuf *out,
+                     struct hist *total, struct stats *statsTotal,
+                     struct top *topTotal)
+{
+        struct pool pool;
+        bool violated = false;
+        struct job *list = NULL;
+        struct feed feed = { &pool, names, count };
+        pthread_t feeder;
+
+        if (recursive) {
+                pool_start(&pool, NULL, 0, JOB_WINDOW,
+                           uring ? URING_CLAIM : 1);
+                if (pthread_create(&feeder, NULL, feed_pool, &feed)) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+        } else {
+                list = calloc(count, sizeof(*list));
+                if (list == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                for (int k = 0; k < count; ++k) {
+                        list[k].name = names[k];
+                        list[k].number = k + 1;
+                        list[k].deferHeader = true;
+                        list[k].headerAt = -1;
+                }
+                pool_start(&pool, list, count, JOB_WINDOW,
+                           uring ? URING_CLAIM : 1);
+        }
+
+        /* The writer: output goes out strictly in file order */
+        for (int k = 0; pool_wait(&pool, k); ++k) {
+                struct job *job = pool_job(&pool, k);
+
+                /* A stream broken partway, compressed input cut short */
+                /* say, still shows what was read of it, as without -j */
+                if (!job->opened) {
+                        emit_job(out, job, job, 0, true);
+                        ob_flush(out);
+                        fprintf(stderr, "%s %s %s\n", "Could not open file",
+                                                      job->name, "for reading");
+                        exit(BAD_FILE);
+                }
+                if (job->violated) violated = true;
+                unsigned long long before = ob_total(out);
+                emit_job(out, job, job, 0, true);
+                if (REPORTING) report_job(out, job, total);
+                if (job->top != NULL)
+                        top_merge(topTotal, job->top, job->name, 0, 0);
+                if (stats) {
+                        job->stats.written = ob_total(out) - before;
+                        stats_job(job, statsTotal);
+                }
+                pool_release(&pool, k);
+        }
+
+        if (recursive) pthread_join(feeder, NULL);
+        pool_finish(&pool);
+        free(list);
+        return violated || stopped();
+}
+
+/* Where the chunk holding the byte at p should end: just past the */
+/* first line ending at or after p, a whole \r\n included.         */
+static const char *chunk_cut(const char *p, const char *end)
+{
+        for (; p < end; ++p) {
+                if (*p == '\n' || *p == NULLCHAR) return p + 1;
+                if (*p == '\r') {
+                        if (p + 1 < end && p[1] == '\n') return p + 2;
+                        return p + 1;
+                }
+        }
+        return end;
+}
+
+static bool check_chunks(const struct source *src, struct job *file)
+{
+        struct pool pool;
+        bool violated = false;
+        bool headerDone = false;
+        size_t lineBase = 0;
+        size_t count = src->mapLen / CHUNK_SIZE;
+
+        file->longest = 0;
+        file->shortest = SIZE_MAX;
+        size_t step = src->mapLen / count;
+        struct job *list = calloc(count, sizeof(*list));
+
+        if (list == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+
+        /* Chunks start on line boundaries, so nothing needs to be */
+        /* carried from one to the next but the line count         */
+        const char *p = src->map;
+        const char *end = src->map + src->mapLen;
+        size_t n = 0;
+        for (; n < count && p < end; ++n) {
+                const char *cut = end;
+                if (n + 1 < count) {
+                        const char *at = src->map + (n + 1) * step;
+                        cut = chunk_cut(at > p ? at : p, end);
+                }
+                list[n].name = file->name;
+                list[n].number = file->number;
+                list[n].range = p;
+                list[n].rangeLen = cut - p;
+                list[n].deferHeader = true;
+                list[n].headerAt = -1;
+                list[n].deferLines = lineNums || format != FORMAT_TEXT;
+                p = cut;
+        }
+
+        pool_start(&pool, list, (int) n, 2 * jobs, 1);
+
+        for (size_t k = 0; k < n; ++k) {
+                struct job *job = &list[k];
+
+                if (!pool_wait(&pool, (int) k)) break;
+                if (job->violated) violated = true;
+                emit_job(file->out, job, file, lineBase, !headerDone);
+                if (job->headerAt >= 0) headerDone = true;
+                if (job->hist != NULL) hist_merge(file->hist, job->hist);
+                if (job->top != NULL)
+                        top_merge(file->top, job->top, NULL, lineBase,
+                                  job->range - src->map);
+                if (job->longest > file->longest)
+                        file->longest = job->longest;
+                if (job->shortest < file->shortest)
+                        file->shortest = job->shortest;
+                if (stats) stats_merge(&file->stats, &job->stats);
+                lineBase += job->lines;
+                pool_release(&pool, (int) k);
+        }
+
+        pool_finish(&pool);
+        free(list);
+        return violated || stopped();
+}
+
+static void serial_check(struct serial *ser, struct job *job)
+{
+        unsigned long long before = ob_total(ser->out);
+
+        if (!check_file(ser->src, job)) {
+                ob_flush(ser->out);
+                fprintf(stderr, "%s %s %s\n", "Could not open file",
+                                              job->name, "for reading");
+                exit(BAD_FILE);
+        }
+        if (job->violated) ser->violated = true;
+        if (quiet && job->violated) stop_all(job->number);
+        if (REPORTING) report_job(ser->out, job, ser->total);
+        if (job->top != NULL) {
+                top_merge(ser->top, job->top, job->name, 0, 0);
+                top_free(job->top);
+        }
+        if (stats) {
+                job->stats.written = ob_total(ser->out) - before;
+                stats_job(job, ser->stats);
+        }
+        free(job->path);
+}
+
+static void check_serial(void *ctx, char *path, bool unreadable)
+{
+        struct serial *ser = ctx;
+        struct job *job = &ser->batch[ser->pending];
+
+        if (stopped()) {
+                free(path);
+                return;
+        }
+        memset(job, 0, sizeof(*job));
+        job->name = path;
+        job->path = path;
+        job->unreadable = unreadable;
+        job->number = ++ser->number;
+        job->out = ser->out;
+        job->headerAt = -1;
+
+        if (ser->uring == NULL) serial_check(ser, job);
+        else if (++ser->pending == URING_BATCH) serial_flush(ser);
+}
+
+static void serial_flush(struct serial *ser)
+{
+        struct job *list[URING_BATCH];
+
+        if (ser->pending == 0) return;
+        for (size_t k = 0; k < ser->pending; ++k) list[k] = &ser->batch[k];
+        uint64_t t = stats_clock();
+        uring_load(ser->uring, list, ser->pending);
+        stats_spread(list, ser->pending, t);
+        for (size_t k = 0; k < ser->pending; ++k) {
+                if (stopped()) free(ser->batch[k].path);
+                else serial_check(ser, &ser->batch[k]);
+        }
+        ser->pending = 0;
+}
+
+#if defined(LEN_URING)
+static int uring_enter(int fd, unsigned submit, unsigned wait)
+{
+        return (int) syscall(__NR_io_uring_enter, fd, submit, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static bool uring_init(struct uring *u)
+{
+        struct io_uring_params p;
+
+        memset(u, 0, sizeof(*u));
+        memset(&p, 0, sizeof(p));
+        u->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if (u->fd < 0) return false;
+
+        u->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        u->cqLen = p.cq_off.cqes +
+                   p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (u->cqLen > u->sqLen) u->sqLen = u->cqLen;
+                u->cqLen = 0;
+        }
+        u->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        u->sqMap = mmap(NULL, u->sqLen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        u->cqMap = u->sqMap;
+        if (u->sqMap != MAP_FAILED && u->cqLen > 0)
+                u->cqMap = mmap(NULL, u->cqLen, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, u->fd,
+                                IORING_OFF_CQ_RING);
+        u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        u->bufs = malloc((size_t) URING_BATCH * URING_BUFFER);
+        if (u->sqMap == MAP_FAILED || u->cqMap == MAP_FAILED ||
+            u->sqes == MAP_FAILED || u->bufs == NULL) {
+                uring_free(u);
+                return false;
+        }
+
+        char *sq = u->sqMap;
+        char *cq = u->cqMap;
+        u->sqTail = (unsigned *) (sq + p.sq_off.tail);
+        u->sqMask = *(unsigned *) (sq + p.sq_off.ring_mask);
+        u->sqArray = (unsigned *) (sq + p.sq_off.array);
+        u->cqHead = (unsigned *) (cq + p.cq_off.head);
+        u->cqTail = (unsigned *) (cq + p.cq_off.tail);
+        u->cqMask = *(unsigned *) (cq + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+        /* One buffer and one direct descriptor slot per file in a batch */
+        struct iovec iov[URING_BATCH];
+        int files[URING_BATCH];
+        for (unsigned k = 0; k < URING_BATCH; ++k) {
+                iov[k].iov_base = u->bufs + (size_t) k * URING_BUFFER;
+                iov[k].iov_len = URING_BUFFER;
+                files[k] = -1;
+        }
+        if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+                    iov, URING_BATCH) < 0 ||
+            syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+                    files, URING_BATCH) < 0) {
+                uring_free(u);
+                return false;
+        }
+        return true;
+}
+
+static void uring_free(struct uring *u)
+{
+        if (u->sqes != NULL && u->sqes != MAP_FAILED)
+                munmap(u->sqes, u->sqesLen);
+        if (u->cqLen > 0 && u->cqMap != NULL && u->cqMap != MAP_FAILED)
+                munmap(u->cqMap, u->cqLen);
+        if (u->sqMap != NULL && u->sqMap != MAP_FAILED)
+                munmap(u->sqMap, u->sqLen);
+        if (u->fd >= 0) close(u->fd);
+        free(u->bufs);
+        memset(u, 0, sizeof(*u));
+        u->fd = -1;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u, unsigned *tail,
+                                      __u8 op, __u64 data)
+{
+        unsigned at = *tail & u->sqMask;
+        struct io_uring_sqe *sqe = &u->sqes[at];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op;
+        sqe->user_data = data;
+        u->sqArray[at] = at;
+        ++*tail;
+        return sqe;
+}
+
+/* Each file is an open, a read into its own buffer and a close, linked */
+/* so that they run in order. The read is hard linked to the close so a */
+/* short read, which is what a file that fits looks like, still closes. */
+/* A short read only means the whole file for a regular file, and only  */
+/* if it is the size stat() saw. Anything else, a pipe most of all,     */
+/* could block the batch or stop short, so it is left alone; the open   */
+/* doesn't block in case one turns up in a regular file's place.        */
+static void uring_load(struct uring *u, struct job **list, size_t n)
+{
+        unsigned tail = *u->sqTail;
+        unsigned queued = 0;
+        int got[URING_BATCH];
+        off_t size[URING_BATCH];
+
+        if (u->broken) return;
+        for (size_t k = 0; k < n; ++k) {
+                struct job *job = list[k];
+                struct io_uring_sqe *sqe;
+                struct stat st;
+
+                got[k] = -1;
+                if (job->unreadable || job->range != NULL ||
+                    (job->name[0] == READ_STDIN && job->name[1] == NULLCHAR))
+                        continue;
+                if (stat(job->name, &st) != 0 || !S_ISREG(st.st_mode) ||
+                    st.st_size >= URING_BUFFER)
+                        continue;
+                size[k] = st.st_size;
+
+                sqe = uring_sqe(u, &tail, IORING_OP_OPENAT, k * 3);
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (__u64) (uintptr_t) job->name;
+                sqe->open_flags = O_RDONLY | O_NONBLOCK;
+                sqe->file_index = k + 1;
+                sqe->flags = IOSQE_IO_LINK;
+
+                sqe = uring_sqe(u, &tail, IORING_OP_READ_FIXED, k * 3 + 1);
+                sqe->fd = (__s32) k;
+                sqe->addr = (__u64) (uintptr_t)
+                            (u->bufs + k * URING_BUFFER);
+                sqe->len = URING_BUFFER;
+                sqe->buf_index = (__u16) k;
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+                sqe = uring_sqe(u, &tail, IORING_OP_CLOSE, k * 3 + 2);
+                sqe->file_index = k + 1;
+
+                queued += 3;
+        }
+        if (queued == 0) return;
+        __atomic_store_n(u->sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned submit = queued;
+        while (queued > 0) {
+                int ret = uring_enter(u->fd, submit, 1);
+                if (ret < 0 && errno == EINTR) continue;
+                if (ret < 0) {
+                        /* Nothing more is trusted to this ring: every */
+                        /* file goes the usual way from now on         */
+                        u->broken = true;
+                        return;
+                }
+                submit -= (unsigned) ret < submit ? (unsigned) ret : submit;
+
+                unsigned head = *u->cqHead;
+                unsigned ctail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+                for (; head != ctail; ++head) {
+                        struct io_uring_cqe *cqe = &u->cqes[head & u->cqMask];
+                        if (cqe->user_data % 3 == 1)
+                                got[cqe->user_data / 3] = cqe->res;
+                        --queued;
+                }
+                __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        /* A file that changed size may not be whole, and a failure is */
+        /* left for source_open() to run into and report as it always  */
+        /* has.                                                        */
+        for (size_t k = 0; k < n; ++k) {
+                if (got[k] < 0 || got[k] != size[k]) continue;
+                list[k]->data = u->bufs + k * URING_BUFFER;
+                list[k]->dataLen = (size_t) got[k];
+                list[k]->preloaded = true;
+        }
+}
+#else
+static bool uring_init(struct uring *u)
+{
+        (void) u;
+        return false;
+}
+
+static void uring_free(struct uring *u)
+{
+        (void) u;
+}
+
+static void uring_load(struct uring *u, struct job **list, size_t n)
+{
+        (void) u;
+        (void) list;
+        (void) n;
+}
+#endif
+
+/* Rules from one .gitignore. Patterns with a slash before their end are */
+/* matched against the path below the .gitignore's directory, the rest  */
+/* against names alone. The last rule to match decides, and rules from  */
+/* deeper directories win over those above them.                        */
+struct rule {
+        const char      *pat;
+        bool            negate;
+        bool            dirOnly;
+        bool            anchored;
+};
+
+struct ignore {
+        char            *text;
+        struct rule     *rules;
+        size_t          count;
+        size_t          base;           /* Where paths below the dir start */
+        struct ignore   *up;
+};
+
+/* A directory being walked. Directories are listed ahead of time by   */
+/* the walker threads, or by walk_visit() itself when it gets to one   */
+/* first, and are freed once everything under them has been handed on. */
+/* Each is opened through its parent's descriptor, which stays open    */
+/* until the last subdirectory has been opened.                        */
+enum { WALK_QUEUED, WALK_LISTING, WALK_LISTED };
+
+/* No more than this many directories are listed ahead of walk_visit() */
+#define WALK_AHEAD 64
+
+struct wentry {
+        char            *name;
+        struct wnode    *dir;           /* NULL for files                 */
+};
+
+struct wnode {
+        char            *path;
+        const char      *name;          /* Last part of path               */
+        struct wnode    *parent;
+        int             fd;             /* -1 once no longer needed        */
+        size_t          unopened;       /* Subdirectories still to open    */
+        size_t          at;             /* Next entry walk_visit() takes   */
+        struct ignore   *ignore;        /* Rules in force here             */
+        bool            ownIgnore;      /* ignore came from this directory */
+        int             state;
+        bool            failed;
+        struct wentry   *entries;
+        size_t          count;
+        size_t          cap;
+        struct wnode    *prev;          /* Place in the walkers' stack     */
+        struct wnode    *next;
+};
+
+struct walker {
+        pthread_mutex_t lock;
+        pthread_cond_t  changed;        /* Work was queued or listed      */
+        struct wnode    *stack;         /* Directories waiting for a list */
+        unsigned        ahead;          /* Listed by threads, not visited */
+        bool            done;
+        emit_fn         emit;
+        void            *ctx;
+};
+
+static void *walk_alloc(size_t size)
+{
+        void *p = malloc(size);
+        if (p == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        return p;
+}
+
+static char *walk_join(const char *dir, const char *name)
+{
+        size_t dirLen = strlen(dir);
+        size_t nameLen = strlen(name);
+        bool slash = dirLen > 0 && dir[dirLen - 1] != '/';
+        char *path = walk_alloc(dirLen + slash + nameLen + 1);
+
+        memcpy(path, dir, dirLen);
+        if (slash) path[dirLen] = '/';
+        memcpy(path + dirLen + slash, name, nameLen + 1);
+        return path;
+}
+
+static struct wnode *wnode_new(char *path, struct ignore *ignore)
+{
+        struct wnode *node = walk_alloc(sizeof(*node));
+
+        memset(node, 0, sizeof(*node));
+        node->path = path;
+        node->name = path;
+        node->fd = -1;
+        node->ignore = ignore;
+        node->state = WALK_QUEUED;
+        return node;
+}
+
+/* Reads the .gitignore in a directory, if there is one */
+static struct ignore *ignore_load(int dirfd, const char *path,
+                                  struct ignore *up)
+{
+        int fd = openat(dirfd, ".gitignore", O_RDONLY);
+        struct stat st;
+
+        if (fd < 0) return NULL;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                close(fd);
+                return NULL;
+        }
+
+        struct ignore *ign = walk_alloc(sizeof(*ign));
+        size_t size = (size_t) st.st_size;
+        size_t got = 0;
+        ssize_t n = 1;
+
+        ign->text = walk_alloc(size + 1);
+        while (got < size && (n = read(fd, ign->text + got, size - got)) > 0)
+                got += n;
+        close(fd);
+        ign->text[got] = NULLCHAR;
+
+        /* No more rules than lines */
+        size_t lines = 1;
+        for (size_t k = 0; k < got; ++k) lines += ign->text[k] == '\n';
+        ign->rules = walk_alloc(lines * sizeof(*ign->rules));
+        ign->count = 0;
+        ign->base = strlen(path) + (path[strlen(path) - 1] != '/');
+        ign->up = up;
+
+        char *line = ign->text;
+        while (line != NULL) {
+                char *end = strchr(line, '\n');
+                char *next = end ? end + 1 : NULL;
+                if (end == NULL) end = line + strlen(line);
+
+                /* Trailing spaces and \r go, as do comments */
+                while (end > line && (end[-1] == ' ' || end[-1] == '\r'))
+                        --end;
+                *end = NULLCHAR;
+
+                struct rule *r = &ign->rules[ign->count];
+                r->negate = line[0] == '!';
+                if (r->negate) ++line;
+                r->dirOnly = end > line && end[-1] == '/';
+                if (r->dirOnly) *--end = NULLCHAR;
+                r->anchored = strchr(line, '/') != NULL;
+                if (line[0] == '/') ++line;
+                r->pat = line;
+                if (line[0] != NULLCHAR && line[0] != '#') ++ign->count;
+
+                line = next;
+        }
+        return ign;
+}
+
+static bool ignored(const struct ignore *ign, const char *path,
+                    const char *name, bool isDir)
+{
+        for (; ign != NULL; ign = ign->up) {
+                for (size_t k = ign->count; k-- > 0; ) {
+                        const struct rule *r = &ign->rules[k];
+                        if (r->dirOnly && !isDir) continue;
+                        if (r->anchored ?
+                            fnmatch(r->pat, path + ign->base,
+                                    FNM_PATHNAME) == 0 :
+                            fnmatch(r->pat, name, 0) == 0)
+                                return !r->negate;
+                }
+        }
+        return false;
+}
+
+static void globs_add(struct globs *g, const char *pat)
+{
+        const char **grown = realloc(g->pat, (g->count + 1) * sizeof(*grown));
+        if (grown == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        g->pat = grown;
+        g->pat[g->count++] = pat;
+}
+
+static bool globs_match(const struct globs *g, const char *name)
+{
+        for (size_t k = 0; k < g->count; ++k)
+                if (fnmatch(g->pat[k], name, 0) == 0) return true;
+        return false;
+}
+
+static void config_fail(const char *name, size_t line, const char *why)
+{
+        fprintf(stderr, "%s %s:%lu: %s\n", BAD_ARG, name,
+                (unsigned long) line, why);
+        exit(BAD_ARGS);
+}
+
+/* The slot key is in, or the empty one it would go in */
+static struct section_slot *config_slot(const char *key, size_t len,
+                                        bool ext)
+{
+        size_t mask = config.nslots - 1;
+        size_t k = (size_t) hash_mix(content_hash(key, len), ext) & mask;
+
+        for (;; k = (k + 1) & mask) {
+                struct section_slot *slot = &config.slots[k];
+                if (slot->key == NULL) return slot;
+                if (slot->ext == ext && strncmp(slot->key, key, len) == 0 &&
+                    slot->key[len] == NULLCHAR)
+                        return slot;
+        }
+}
+
+/* Sorts each section into the table or the list to be tried */
+static void config_index(void)
+{
+        config.nslots = 16;
+        while (config.nslots < 2 * config.count) config.nslots *= 2;
+        config.slots = calloc(config.nslots, sizeof(*config.slots));
+        config.globbed = calloc(config.count, sizeof(*config.globbed));
+        if (config.slots == NULL || config.globbed == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+
+        for (size_t k = 0; k < config.count; ++k) {
+                const char *glob = config.sections[k].glob;
+                const char *ext = glob + 2;
+                bool isExt = glob[0] == '*' && glob[1] == '.' &&
+                             ext[strcspn(ext, "*?[\\/.")] == NULLCHAR &&
+                             ext[0] != NULLCHAR;
+                bool isName = glob[strcspn(glob, "*?[\\/")] == NULLCHAR;
+
+                if (!isExt && !isName) {
+                        config.globbed[config.nglobbed++] = k;
+                        continue;
+                }
+
+                const char *key = isExt ? ext : glob;
+                struct section_slot *slot = config_slot(key, strlen(key),
+                                                        isExt);
+                size_t *grown = realloc(slot->sections, (slot->count + 1) *
+                                        sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                slot->key = key;
+                slot->ext = isExt;
+                slot->sections = grown;
+                slot->sections[slot->count++] = k;
+        }
+}
+
+static void config_load(const char *name, bool required)
+{
+        FILE *f = fopen(name, "r");
+        if (f == NULL) {
+                if (!required && errno == ENOENT) return;
+                fprintf(stderr, "%s %s %s\n", "Could not open file", name,
+                                              "for reading");
+                exit(BAD_FILE);
+        }
+
+        char *text = NULL;
+        size_t cap = 0;
+        size_t number = 0;
+        while (getline(&text, &cap, f) >= 0) {
+                char *line = text;
+                char *end = line + strlen(line);
+                ++number;
+
+                /* Surrounding blanks and \r go, as do comments */
+                while (end > line && isspace((unsigned char) end[-1]))
+                        --end;
+                *end = NULLCHAR;
+                while (isspace((unsigned char) *line)) ++line;
+                if (*line == NULLCHAR || *line == '#' || *line == ';')
+                        continue;
+
+                if (*line == '[') {
+                        if (end - line < 3 || end[-1] != ']')
+                                config_fail(name, number, "expected [GLOB]");
+                        end[-1] = NULLCHAR;
+
+                        struct section *grown = realloc(config.sections,
+                                (config.count + 1) * sizeof(*grown));
+                        char *glob = strdup(line + 1);
+                        if (grown == NULL || glob == NULL) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
+                        }
+                        config.sections = grown;
+                        memset(&grown[config.count], 0, sizeof(*grown));
+                        grown[config.count++].glob = glob;
+                        continue;
+                }
+
+                char *eq = strchr(line, '=');
+                if (eq == NULL)
+                        config_fail(name, number, "expected KEY = VALUE");
+                if (config.count == 0)
+                        config_fail(name, number, "setting outside a "
+                                    "[GLOB] section");
+
+                char *key_end = eq;
+                while (key_end > line && isspace((unsigned char) key_end[-1]))
+                        --key_end;
+                *key_end = NULLCHAR;
+                char *value = eq + 1;
+                while (isspace((unsigned char) *value)) ++value;
+                if (!isdigit((unsigned char) *value) ||
+                    value[strspn(value, "0123456789")] != NULLCHAR)
+                        config_fail(name, number, "requires a numeric "
+                                    "value");
+
+                struct section *sec = &config.sections[config.count - 1];
+                unsigned n = (unsigned) strtoul(value, NULL, 10);
+                if (strcmp(line, MAX_LONG) == 0) {
+                        sec->max = n;
+                        sec->set |= SECTION_MAX;
+                } else if (strcmp(line, MIN_LONG) == 0) {
+                        sec->min = n;
+                        sec->set |= SECTION_MIN;
+                } else if (strcmp(line, TABWIDTH_LONG) == 0) {
+                        if (n == 0)
+                                config_fail(name, number, "requires a "
+                                            "tab-width of at least 1");
+                        sec->tabs = n;
+                        sec->set |= SECTION_TABS;
+                } else {
+                        config_fail(name, number, "is not one of max, min "
+                                    "or tab-width");
+                }
+                if ((sec->set & SECTION_MAX) && (sec->set & SECTION_MIN) &&
+                    sec->min > sec->max)
+                        config_fail(name, number, "gives a min greater than "
+                                    "the section's max");
+        }
+        free(text);
+        fclose(f);
+
+        if (config.count > 0) config_index();
+}
+
+/* Only what the command line left to its defaults is replaced */
+static void section_apply(const struct section *sec, unsigned *max,
+                          unsigned *min, unsigned *tabs)
+{
+        unsigned set = sec->set & ~config.given;
+
+        if (set & SECTION_MAX) *max = sec->max;
+        if (set & SECTION_MIN) *min = sec->min;
+        if (set & SECTION_TABS) *tabs = sec->tabs;
+}
+
+static void limits_for(const char *name)
+{
+        unsigned max = config.max;
+        unsigned min = config.min;
+        unsigned tabs = config.tabs;
+
+        if (config.count > 0) {
+                const char *path = name;
+                if (path[0] == '.' && path[1] == '/') path += 2;
+                const char *base = strrchr(path, '/');
+                base = base != NULL ? base + 1 : path;
+                const char *dot = strrchr(base, '.');
+
+                /* The sections from each place, merged back into order */
+                static const struct section_slot none = { NULL, false,
+                                                          NULL, 0 };
+                const struct section_slot *byExt = &none;
+                const struct section_slot *byName = config_slot(base,
+                                        strlen(base), false);
+                if (dot != NULL && dot[1] != NULLCHAR)
+                        byExt = config_slot(dot + 1, strlen(dot + 1), true);
+                size_t e = 0, n = 0, g = 0;
+
+                for (;;) {
+                        size_t k = SIZE_MAX;
+                        if (e < byExt->count) k = byExt->sections[e];
+                        if (n < byName->count && byName->sections[n] < k)
+                                k = byName->sections[n];
+                        if (g < config.nglobbed && config.globbed[g] < k)
+                                k = config.globbed[g];
+                        if (k == SIZE_MAX) break;
+
+                        const struct section *sec = &config.sections[k];
+                        if (e < byExt->count && byExt->sections[e] == k) {
+                                ++e;
+                        } else if (n < byName->count &&
+                                   byName->sections[n] == k) {
+                                ++n;
+                        } else {
+                                ++g;
+                                bool anchored = strchr(sec->glob, '/');
+                                if (fnmatch(sec->glob, anchored ? path : base,
+                                            anchored ? FNM_PATHNAME : 0))
+                                        continue;
+                        }
+                        section_apply(sec, &max, &min, &tabs);
+                }
+        }
+
+        if (max < min) {
+                fprintf(stderr, "%s %s\n", "Maximum length must be greater "
+                        "than minimum length for", name);
+                exit(BAD_ARGS);
+        }
+
+        /* Counted the way main() counts the command line's */
+        if (min == 0) min = 1;
+        if (!newlines) {
+                ++max;
+                if (min != 1) ++min;
+        }
+        maxLen = max;
+        minLen = min;
+        tabWidth = tabs;
+}
+
+/* Picks the byte of a literal for memchr() to look for: the first that */
+/* isn't a letter, digit or space, as those are the bytes most text is */
+/* made of                                                              */
+static size_t literal_anchor(const char *text, size_t len)
+{
+        for (size_t k = 0; k < len; ++k) {
+                unsigned char c = text[k];
+                if (!isalnum(c) && !isspace(c)) return k;
+        }
+        return 0;
+}
+#endif
+
+static bool literal_in(const struct literal *lit, const char *p, size_t n)
+{
+        if (lit->len == 0) return true;
+        if (lit->len > n) return false;
+
+        /* Where lit->text[at] can be for all of lit to fit */
+        const char *q = p + lit->at;
+        const char *last = p + n - lit->len + lit->at;
+        while (q <= last) {
+                q = memchr(q, lit->text[lit->at], last - q + 1);
+                if (q == NULL) return false;
+                if (memcmp(q - lit->at, lit->text, lit->len) == 0)
+                        return true;
+                ++q;
+        }
+        return false;
+}
+
+#if !defined(LEN_LIBRARY)
+/* The longest run of characters an extended regex can only match   */
+/* text holding. Runs end at anything that isn't a plain character,  */
+/* and a character a quantifier may leave out comes off its run.     */
+/* Groups are skipped, and alternatives outside them leave nothing.  */
+static void regex_literal(const char *pat, struct literal *lit)
+{
+        size_t n = strlen(pat);
+        char *run = malloc(n + 1);
+        char *best = malloc(n + 1);
+        size_t runLen = 0;
+        size_t bestLen = 0;
+        int depth = 0;
+
+        if (run == NULL || best == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+
+        for (const char *p = pat; *p != NULLCHAR; ++p) {
+                char c = *p;
+                bool plain = false;
+
+                if (c == '\\' && p[1] != NULLCHAR) {
+                        /* \w, \b and back references aren't characters */
+                        c = *++p;
+                        plain = depth == 0 && !isalnum((unsigned char) c);
+                } else if (c == '[') {
+                        /* ]] and []] hold a ] as the first in the set */
+                        if (p[1] == '^') ++p;
+                        if (p[1] == ']') ++p;
+                        while (p[1] != NULLCHAR && p[1] != ']') {
+                                ++p;
+                                if (*p == '[' && (p[1] == ':' || p[1] == '.' ||
+                                                  p[1] == '=')) {
+                                        const char *close = strchr(p + 2, ']');
+                                        if (close != NULL) p = close;
+                                }
+                        }
+                        if (p[1] == ']') ++p;
+                } else if (c == '(') {
+                        ++depth;
+                } else if (c == ')') {
+                        if (depth > 0) --depth;
+                } else if (c == '|' && depth == 0) {
+                        runLen = bestLen = 0;
+                        break;
+                } else if (c == '*' || c == '?' || c == '{') {
+                        if (runLen > 0) --runLen;
+                        if (c == '{')
+                                while (p[1] != NULLCHAR && *p != '}') ++p;
+                } else if (c != '+' && c != '.' && c != '^' && c != '$') {
+                        plain = depth == 0;
+                }
+
+                if (plain) {
+                        run[runLen++] = c;
+                        continue;
+                }
+
+                /* What follows is no longer next to the run. c+ needs */
+                /* a c but may have more, so its run stops there too.  */
+                if (runLen > bestLen) {
+                        memcpy(best, run, runLen);
+                        bestLen = runLen;
+                }
+                runLen = 0;
+        }
+        if (runLen > bestLen) {
+                memcpy(best, run, runLen);
+                bestLen = runLen;
+        }
+
+        free(run);
+        best[bestLen] = NULLCHAR;
+        lit->text = best;
+        lit->len = bestLen;
+        lit->at = literal_anchor(best, bestLen);
+}
+
+static void exempt_add(const char *pat)
+{
+        struct exempt *grown = realloc(exempts,
+                                       (nexempts + 1) * sizeof(*grown));
+        if (grown == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        exempts = grown;
+
+        struct exempt *ex = &exempts[nexempts];
+        int err = regcomp(&ex->re, pat, REG_EXTENDED | REG_NOSUB);
+        if (err != 0) {
+                char why[256];
+                regerror(err, &ex->re, why, sizeof(why));
+                fprintf(stderr, "%s %s: %s\n", BAD_ARG, pat, why);
+                exit(BAD_ARGS);
+        }
+        regex_literal(pat, &ex->lit);
+        ++nexempts;
+        exemptsHash = hash_mix(exemptsHash, content_hash(pat, strlen(pat)));
+}
+#endif
+
+static bool exempt_match(const struct exempt *ex, const char *text,
+                         size_t bytes)
+{
+        if (!literal_in(&ex->lit, text, bytes)) return false;
+
+        /* regexec() wants a string, and lines aren't terminated. Not */
+        /* all of them take REG_STARTEND, and not all that do honor it */
+        if (bytes + 1 > exemptCap) {
+                size_t cap = exemptCap ? exemptCap : 256;
+                while (cap < bytes + 1) cap *= 2;
+                char *grown = realloc(exemptLine, cap);
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                exemptLine = grown;
+                exemptCap = cap;
+        }
+        memcpy(exemptLine, text, bytes);
+        exemptLine[bytes] = NULLCHAR;
+        return regexec(&ex->re, exemptLine, 0, NULL, 0) == 0;
+}
+
+static bool line_exempt(const char *text, size_t bytes)
+{
+        if (literal_in(&MARKER, text, bytes)) return true;
+        for (size_t k = 0; k < nexempts; ++k)
+                if (exempt_match(&exempts[k], text, bytes)) return true;
+        return false;
+}
+
+#if !defined(LEN_LIBRARY)
+static void exempt_release(void)
+{
+        free(exemptLine);
+        exemptLine = NULL;
+        exemptCap = 0;
+}
+
+/* Keeps an entry of a directory being listed if the filters let it through */
+static void wnode_add(struct wnode *node, const char *name, bool isDir)
+{
+        if (name[0] == '.' && (name[1] == NULLCHAR ||
+            (name[1] == '.' && name[2] == NULLCHAR)))
+                return;
+        if (globs_match(&excludes, name)) return;
+        if (!isDir && includes.count > 0 && !globs_match(&includes, name))
+                return;
+        if (gitignore && isDir && strcmp(name, ".git") == 0) return;
+
+        char *path = walk_join(node->path, name);
+        if (node->ignore != NULL && ignored(node->ignore, path, name, isDir)) {
+                free(path);
+                return;
+        }
+
+        if (node->count == node->cap) {
+                size_t cap = node->cap ? 2 * node->cap : 16;
+                struct wentry *grown = realloc(node->entries,
+                                               cap * sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                node->entries = grown;
+                node->cap = cap;
+        }
+
+        struct wentry *e = &node->entries[node->count++];
+        e->name = walk_alloc(strlen(name) + 1);
+        strcpy(e->name, name);
+        e->dir = NULL;
+        if (!isDir) {
+                free(path);
+                return;
+        }
+        e->dir = wnode_new(path, node->ignore);
+        e->dir->name = path + strlen(path) - strlen(name);
+        e->dir->parent = node;
+}
+
+/* Symbolic links are never followed, and anything but regular files */
+/* and directories is skipped                                         */
+static void wnode_stat(struct wnode *node, int fd, const char *name)
+{
+        struct stat st;
+
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+        if (S_ISDIR(st.st_mode)) wnode_add(node, name, true);
+        else if (S_ISREG(st.st_mode)) wnode_add(node, name, false);
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct linux_dirent64 {
+        uint64_t        d_ino;
+        int64_t         d_off;
+        unsigned short  d_reclen;
+        unsigned char   d_type;
+        char            d_name[];
+};
+
+/* Straight from getdents64(), which gives the type of most entries */
+/* without a stat() for each                                        */
+static bool wnode_read(struct wnode *node, int fd)
+{
+        union {
+                struct linux_dirent64 align;
+                char            bytes[1 << 15];
+        } buf;
+        long got;
+
+        while ((got = syscall(SYS_getdents64, fd, buf.bytes,
+                              sizeof(buf.bytes))) > 0) {
+                for (long at = 0; at < got; ) {
+                        struct linux_dirent64 *d = (void *) (buf.bytes + at);
+                        at += d->d_reclen;
+                        if (d->d_type == DT_DIR)
+                                wnode_add(node, d->d_name, true);
+                        else if (d->d_type == DT_REG)
+                                wnode_add(node, d->d_name, false);
+                        else if (d->d_type == DT_UNKNOWN)
+                                wnode_stat(node, fd, d->d_name);
+                }
+        }
+        return got == 0;
+}
+#else
+static bool wnode_read(struct wnode *node, int fd)
+{
+        /* The descriptor outlives the listing, for opening subdirectories */
+        int own = dup(fd);
+        DIR *dir = own < 0 ? NULL : fdopendir(own);
+        struct dirent *d;
+
+        if (dir == NULL) {
+                if (own >= 0) close(own);
+                return false;
+        }
+        while ((d = readdir(dir)) != NULL)
+                wnode_stat(node, fd, d->d_name);
+        closedir(dir);
+        return true;
+}
+#endif
+
+static int wentry_cmp(const void *a, const void *b)
+{
+        return strcmp(((const struct wentry *) a)->name,
+                      ((const struct wentry *) b)->name);
+}
+
+/* Lets go of a directory's descriptor once its last subdirectory is open */
+static void wnode_release(struct walker *w, struct wnode *node)
+{
+        if (node == NULL) return;
+        pthread_mutex_lock(&w->lock);
+        if (--node->unopened == 0) {
+                close(node->fd);
+                node->fd = -1;
+        }
+        pthread_mutex_unlock(&w->lock);
+}
+
+/* Lists a directory, sorts it and queues its subdirectories, first */
+/* ones on top                                                      */
+static void wnode_list(struct walker *w, struct wnode *node)
+{
+        int fd = -1;
+        size_t dirs = 0;
+
+        /* What's left is only walked to be freed */
+        if (!stopped()) {
+                if (node->parent != NULL)
+                        fd = openat(node->parent->fd, node->name,
+                                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                else
+                        fd = open(node->path, O_RDONLY | O_DIRECTORY);
+        }
+        wnode_release(w, node->parent);
+        if (stopped()) {
+                if (fd >= 0) close(fd);
+                return;
+        }
+        if (fd < 0) {
+                node->failed = true;
+                return;
+        }
+        if (gitignore) {
+                struct ignore *own = ignore_load(fd, node->path,
+                                                 node->ignore);
+                if (own != NULL) {
+                        node->ignore = own;
+                        node->ownIgnore = true;
+                }
+        }
+        /* Half a listing is no use: the whole directory counts as unread */
+        if (!wnode_read(node, fd)) {
+                close(fd);
+                node->failed = true;
+                for (size_t k = 0; k < node->count; ++k) {
+                        struct wnode *child = node->entries[k].dir;
+                        if (child != NULL) free(child->path);
+                        free(child);
+                        free(node->entries[k].name);
+                }
+                node->count = 0;
+                return;
+        }
+        if (node->count > 1)
+                qsort(node->entries, node->count, sizeof(*node->entries),
+                      wentry_cmp);
+        for (size_t k = 0; k < node->count; ++k)
+                dirs += node->entries[k].dir != NULL;
+        if (dirs == 0) close(fd);
+
+        pthread_mutex_lock(&w->lock);
+        node->fd = dirs > 0 ? fd : -1;
+        node->unopened = dirs;
+        for (size_t k = node->count; k-- > 0; ) {
+                struct wnode *child = node->entries[k].dir;
+                if (child == NULL) continue;
+                child->prev = NULL;
+                child->next = w->stack;
+                if (w->stack != NULL) w->stack->prev = child;
+                w->stack = child;
+        }
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+}
+
+/* Takes a queued directory off the stack. Called with the lock held. */
+static void wnode_claim(struct walker *w, struct wnode *node)
+{
+        if (node->prev != NULL) node->prev->next = node->next;
+        else w->stack = node->next;
+        if (node->next != NULL) node->next->prev = node->prev;
+        node->state = WALK_LISTING;
+}
+
+static void wnode_listed(struct walker *w, struct wnode *node)
+{
+        pthread_mutex_lock(&w->lock);
+        node->state = WALK_LISTED;
+        pthread_cond_broadcast(&w->changed);
+        pthread_mutex_unlock(&w->lock);
+}
+
+static void *walk_worker(void *arg)
+{
+        struct walker *w = arg;
+
+        for (;;) {
+                pthread_mutex_lock(&w->lock);
+                while ((w->stack == NULL || w->ahead >= WALK_AHEAD) &&
+                       !w->done)
+                        pthread_cond_wait(&w->changed, &w->lock);
+                if (w->stack == NULL) {
+                        pthread_mutex_unlock(&w->lock);
+                        break;
+                }
+                struct wnode *node = w->stack;
+                wnode_claim(w, node);
+                ++w->ahead;
+                pthread_mutex_unlock(&w->lock);
+
+                wnode_list(w, node);
+                wnode_listed(w, node);
+        }
+        return NULL;
+}
+
+/* Waits for a directory's listing, or lists it if nobody has started */
+static void wnode_enter(struct walker *w, struct wnode *node)
+{
+        pthread_mutex_lock(&w->lock);
+        if (node->state == WALK_QUEUED) {
+                wnode_claim(w, node);
+                pthread_mutex_unlock(&w->lock);
+                wnode_list(w, node);
+                wnode_listed(w, node);
+        } else {
+                while (node->state != WALK_LISTED)
+                        pthread_cond_wait(&w->changed, &w->lock);
+                --w->ahead;
+                pthread_cond_broadcast(&w->changed);
+                pthread_mutex_unlock(&w->lock);
+        }
+
+        if (node->failed && !stopped()) {
+                w->emit(w->ctx, node->path, true);
+                node->path = NULL;
+        }
+}
+
+static void wnode_free(struct wnode *node)
+{
+        if (node->ownIgnore) {
+                free(node->ignore->text);
+                free(node->ignore->rules);
+                free(node->ignore);
+        }
+        free(node->entries);
+        free(node->path);
+        free(node);
+}
+
+/* Hands on everything under a directory in order, freeing directories */
+/* as it leaves them. Depth first, without recursion.                  */
+static void walk_visit(struct walker *w, struct wnode *node)
+{
+        wnode_enter(w, node);
+        while (node != NULL) {
+                if (node->at == node->count) {
+                        struct wnode *up = node->parent;
+                        wnode_free(node);
+                        node = up;
+                        continue;
+                }
+
+                struct wentry *e = &node->entries[node->at++];
+                struct wnode *dir = e->dir;
+                if (dir == NULL && !stopped())
+                        w->emit(w->ctx, walk_join(node->path, e->name),
+                                false);
+                free(e->name);
+                if (dir != NULL) {
+                        node = dir;
+                        wnode_enter(w, node);
+                }
+        }
+}
+
+static void walk(char **names, int count, emit_fn emit, void *ctx,
+                 unsigned walkers)
+{
+        struct walker w;
+        pthread_t *tids = NULL;
+        unsigned started = 0;
+
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.changed, NULL);
+        w.stack = NULL;
+        w.ahead = 0;
+        w.done = false;
+        w.emit = emit;
+        w.ctx = ctx;
+
+        if (recursive && walkers > 0) {
+                tids = walk_alloc(walkers * sizeof(*tids));
+                for (; started < walkers; ++started)
+                        if (pthread_create(&tids[started], NULL,
+                                           walk_worker, &w))
+                                break;
+        }
+
+        for (int k = 0; k < count; ++k) {
+                struct stat st;
+                char *path = walk_alloc(strlen(names[k]) + 1);
+
+                strcpy(path, names[k]);
+                if (stopped()) {
+                        free(path);
+                        continue;
+                }
+                if (!recursive || stat(path, &st) != 0 ||
+                    !S_ISDIR(st.st_mode)) {
+                        emit(ctx, path, false);
+                        continue;
+                }
+
+                /* Trailing slashes would be doubled up in the paths */
+                size_t len = strlen(path);
+                while (len > 1 && path[len - 1] == '/') path[--len] = NULLCHAR;
+                walk_visit(&w, wnode_new(path, NULL));
+        }
+
+        pthread_mutex_lock(&w.lock);
+        w.done = true;
+        pthread_cond_broadcast(&w.changed);
+        pthread_mutex_unlock(&w.lock);
+        for (unsigned t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+        free(tids);
+        pthread_cond_destroy(&w.changed);
+        pthread_mutex_destroy(&w.lock);
+}
+
+int parseArgs(int argc, char **argv)
+{
+        int i;
+        for (i = 1; argv[i] != NULL; ++(i)) {
+                if (MATCH_S(i, 0, OPTION)){
+                        if (MATCH_S(i, 1, NULLCHAR)) {
+                                return i;
+                        }
+                        if (MATCH_S(i, 1, OPTION)){ /* Long form options */
+                                if (MATCH_L(i, MAX_LONG)) {
+                                        ARG_CHECK(i);
+                                        maxLen = strtol(argv[i],
+                                                        (char **)NULL, 10);
+                                        config.given |= SECTION_MAX;
+                                } else if (MATCH_L(i, MIN_LONG)) {
+                                        ARG_CHECK(i);
+                                        minLen = strtol(argv[i],
+                                                 (char **)NULL, 10);
+                                        config.given |= SECTION_MIN;
+                                } else if (MATCH_L(i, TABWIDTH_LONG)) {
+                                        ARG_CHECK(i);
+                                        tabWidth = strtol(argv[i],
+                                                         (char **)NULL, 10);
+                                        config.given |= SECTION_TABS;
+                                } else if (MATCH_L(i, JOBS_LONG)) {
+                                        ARG_CHECK(i);
+                                        jobs = strtol(argv[i],
+                                                      (char **)NULL, 10);
+                                } else if (MATCH_L(i, SUMMARY_LONG)) {
+                                        summary = true;
+                                } else if (MATCH_L(i, HISTOGRAM_LONG)) {
+                                        histogram = true;
+                                } else if (MATCH_L(i, TOP_LONG)) {
+                                        ARG_CHECK(i);
+                                        char *end;
+                                        unsigned long n = strtoul(argv[i],
+                                                                  &end, 10);
+                                        if (*end != NULLCHAR || n == 0 ||
+                                            n > UINT_MAX) {
+                                                fprintf(stderr, "%s %s %s\n",
+                                                        BAD_ARG, argv[i - 1],
+                                                        "requires a positive "
+                                                        "integer");
+                                                exit(BAD_ARGS);
+                                        }
+                                        topLines = (unsigned) n;
+                                } else if (MATCH_L(i, RECURSIVE_LONG)) {
+                                        recursive = true;
+                                } else if (MATCH_L(i, INCLUDE_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        globs_add(&includes, argv[i]);
+                                } else if (MATCH_L(i, EXCLUDE_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        globs_add(&excludes, argv[i]);
+                                } else if (MATCH_L(i, GITIGNORE_LONG)) {
+                                        gitignore = true;
+                                } else if (MATCH_L(i, URING_LONG)) {
+                                        uring = true;
+                                } else if (MATCH_L(i, QUIET_LONG)) {
+                                        quiet = true;
+                                } else if (MATCH_L(i, CACHE_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        cacheName = argv[i];
+                                } else if (MATCH_L(i, CACHE_STRICT_LONG)) {
+                                        cacheStrict = true;
+                                } else if (MATCH_L(i, DIFF_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        diffName = argv[i];
+                                } else if (MATCH_L(i, UTF8_LONG)) {
+                                        utf8 = true;
+                                } else if (MATCH_L(i, KEEP_TABS_LONG)) {
+                                        keepTabs = true;
+                                } else if (MATCH_L(i, FORMAT_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        format = strtoformat(argv[i]);
+                                } else if (MATCH_L(i, DAEMON_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        daemonName = argv[i];
+                                } else if (MATCH_L(i, CLIENT_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        clientName = argv[i];
+                                } else if (MATCH_L(i, CONFIG_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        configName = argv[i];
+                                } else if (MATCH_L(i, IGNORE_PATTERN_LONG)) {
+                                        STR_ARG_CHECK(i);
+                                        exempt_add(argv[i]);
+                                } else if (MATCH_L(i, MATCHES_LONG)) {
                                         if (print) printAll = true;
                                         if (!print) {
                                                 print = true;
@@ -473,9 +3530,11 @@ int parseArgs(int argc, char **argv)
                                 } else if (MATCH_L(i, LINE_NUMS_LONG)) {
                                         lineNums = true;
                                 } else if (MATCH_L(i, TRUNCATE_LONG)) {
-                                        truncate = true;
+                                        truncating = true;
                                 } else if (MATCH_L(i, COLOR_LONG)) {
                                         color = true;
+                                } else if (MATCH_L(i, STATS_LONG)) {
+                                        stats = true;
                                 } else if (MATCH_L(i, FLAGS_LONG)) {
                                         flags = true;
                                 } else if (MATCH_L(i, LINE_LENGTHS_LONG)) {
@@ -502,7 +3561,8 @@ int parseArgs(int argc, char **argv)
                                         file_alt = strtocolor(argv[++i]);
                                         alternate = true;
                                 } else if (MATCH_L(i, HELP_LONG)) {
-                                        fprintf(stdout, "%s", HELP_ME);
+                                        fprintf(stdout, "%s%s", HELP_ME,
+                                                                HELP_END);
                                         exit(EXIT_SUCCESS);
                                 /* Unrecognized option */
                                 } else {
@@ -512,248 +3572,3743 @@ int parseArgs(int argc, char **argv)
                                 }
                         }
 
-                        /* Loop through for short form options */
-                        else for (int j = 1; argv[i][j] != '\0'; ++j) {
-                        /* max cannot be combined with other options */
-                        if (MATCH_S(i, j, MAX)) {
-                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
-                                        ARG_CHECK(i);
-                                        maxLen = strtol(argv[i],
-                                                 (char **)NULL, 10);
-                                        break;
-                                }
-                                else {
-                                        fprintf(stderr, "%s [%c]\n",
-                                                NO_COMBINE, argv[i][j]);
-                                        exit(BAD_COMBINE);
-                                }
-                        /* min cannot be combined with other options */
-                        } else if (MATCH_S(i, j, MIN)) {
-                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
-                                        ARG_CHECK(i);
-                                        minLen = strtol(argv[i],
-                                                 (char **)NULL, 10);
-                                        break;
-                                }
-                                else {
-                                        fprintf(stderr, "%s [%c]\n",
-                                                NO_COMBINE, argv[i][j]);
-                                        exit(BAD_COMBINE);
-                                }
-                        /* tab-width cannot be combined with other options */
-                        } else if (MATCH_S(i, j, TABWIDTH)) {
-                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
-                                        ARG_CHECK(i);
-                                        tabWidth = strtol(argv[i],
-                                                   (char **)NULL, 10);
-                                        break;
-                                }
-                                else {
-                                        fprintf(stderr, "%s [%c]\n",
-                                                NO_COMBINE, argv[i][j]);
-                                        exit(BAD_COMBINE);
-                                }
-                        /* printAll overrides the offenders when set */
-                        } else if (MATCH_S(i, j, MATCHES)) {
-                                if (print) printAll = true;
-                                if (!print) {
-                                        print = true;
-                                        offenders = false;
-                                }
-                        } else if (MATCH_S(i, j, OFFENDERS)) {
-                                if (print) printAll = true;
-                                if (!print) {
-                                        print = true;
-                                        offenders = true;
-                                }
-                        } else if (MATCH_S(i, j, LINE_NUMS)) {
-                                lineNums = true;
-                        } else if (MATCH_S(i, j, TRUNCATE)) {
-                                truncate = true;
-                        } else if (MATCH_S(i, j, COLOR)) {
-                                color = true;
-                        } else if (MATCH_S(i, j, LINE_LENGTHS)) {
-                                lineLengths = true;
-                        } else if (MATCH_S(i, j, NEWLINES)) {
-                                newlines = true;
-                        } else if (MATCH_S(i, j, INVERT)) {
-                                inverted = true;
-                        } else if (MATCH_S(i, j, ALT)) {
-                                alternate = true;
-                        } else if (MATCH_S(i, j, HELP)) {
-                                fprintf(stdout, "%s", HELP_ME);
-                                exit(EXIT_SUCCESS);
-                        /* Unrecognized option */
-                        } else {
-                                fprintf(stderr, "%s [%s]\n", BAD_OPTION,
-                                        argv[i]);
-                                exit(WHAT_IS_THAT_FLAG);
+                        /* Loop through for short form options */
+                        else for (int j = 1; argv[i][j] != '\0'; ++j) {
+                        /* max cannot be combined with other options */
+                        if (MATCH_S(i, j, MAX)) {
+                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
+                                        ARG_CHECK(i);
+                                        maxLen = strtol(argv[i],
+                                                 (char **)NULL, 10);
+                                        config.given |= SECTION_MAX;
+                                        break;
+                                }
+                                else {
+                                        fprintf(stderr, "%s [%c]\n",
+                                                NO_COMBINE, argv[i][j]);
+                                        exit(BAD_COMBINE);
+                                }
+                        /* min cannot be combined with other options */
+                        } else if (MATCH_S(i, j, MIN)) {
+                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
+                                        ARG_CHECK(i);
+                                        minLen = strtol(argv[i],
+                                                 (char **)NULL, 10);
+                                        config.given |= SECTION_MIN;
+                                        break;
+                                }
+                                else {
+                                        fprintf(stderr, "%s [%c]\n",
+                                                NO_COMBINE, argv[i][j]);
+                                        exit(BAD_COMBINE);
+                                }
+                        /* tab-width cannot be combined with other options */
+                        } else if (MATCH_S(i, j, TABWIDTH)) {
+                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
+                                        ARG_CHECK(i);
+                                        tabWidth = strtol(argv[i],
+                                                   (char **)NULL, 10);
+                                        config.given |= SECTION_TABS;
+                                        break;
+                                }
+                                else {
+                                        fprintf(stderr, "%s [%c]\n",
+                                                NO_COMBINE, argv[i][j]);
+                                        exit(BAD_COMBINE);
+                                }
+                        /* jobs cannot be combined with other options */
+                        } else if (MATCH_S(i, j, JOBS)) {
+                                if ((j == 1) && (argv[i][j + 1] == NULLCHAR)) {
+                                        ARG_CHECK(i);
+                                        jobs = strtol(argv[i],
+                                                 (char **)NULL, 10);
+                                        break;
+                                }
+                                else {
+                                        fprintf(stderr, "%s [%c]\n",
+                                                NO_COMBINE, argv[i][j]);
+                                        exit(BAD_COMBINE);
+                                }
+                        /* printAll overrides the offenders when set */
+                        } else if (MATCH_S(i, j, MATCHES)) {
+                                if (print) printAll = true;
+                                if (!print) {
+                                        print = true;
+                                        offenders = false;
+                                }
+                        } else if (MATCH_S(i, j, OFFENDERS)) {
+                                if (print) printAll = true;
+                                if (!print) {
+                                        print = true;
+                                        offenders = true;
+                                }
+                        } else if (MATCH_S(i, j, LINE_NUMS)) {
+                                lineNums = true;
+                        } else if (MATCH_S(i, j, TRUNCATE)) {
+                                truncating = true;
+                        } else if (MATCH_S(i, j, COLOR)) {
+                                color = true;
+                        } else if (MATCH_S(i, j, LINE_LENGTHS)) {
+                                lineLengths = true;
+                        } else if (MATCH_S(i, j, NEWLINES)) {
+                                newlines = true;
+                        } else if (MATCH_S(i, j, INVERT)) {
+                                inverted = true;
+                        } else if (MATCH_S(i, j, ALT)) {
+                                alternate = true;
+                        } else if (MATCH_S(i, j, RECURSIVE)) {
+                                recursive = true;
+                        } else if (MATCH_S(i, j, QUIET)) {
+                                quiet = true;
+                        } else if (MATCH_S(i, j, HELP)) {
+                                fprintf(stdout, "%s%s", HELP_ME, HELP_END);
+                                exit(EXIT_SUCCESS);
+                        /* Unrecognized option */
+                        } else {
+                                fprintf(stderr, "%s [%s]\n", BAD_OPTION,
+                                        argv[i]);
+                                exit(WHAT_IS_THAT_FLAG);
+                        }
+
+                        }
+                } else break;
+        }
+        return i;
+}
+
+ /* Print all flags to check if they're set correctly */
+inline static void print_flags(int i, int argc)
+{
+        fprintf(stderr, "argc: [%d], option groups specified:[%d]\n", argc, i);
+        fprintf(stderr, "%s: %lu\n", "maxLen", (unsigned long) maxLen);
+        fprintf(stderr, "%s: %lu\n", "minLen", (unsigned long) minLen);
+        fprintf(stderr, "%s: %lu\n", "tabWidth", (unsigned long) tabWidth);
+        fprintf(stderr, "%s: %lu\n", "jobs", (unsigned long) jobs);
+        fprintf(stderr, "%s: %s\n", "print", print ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "printAll", printAll ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "offenders",
+                                    offenders ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "matches", !offenders ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "lineNums", lineNums ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "color", color ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "lineLengths",
+                                    lineLengths ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "count newlines?",
+                                    newlines ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "alternate", alternate ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "summary", summary ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "histogram",
+                                    histogram ? "true" : "false");
+        fprintf(stderr, "%s: %lu\n", "top", (unsigned long) topLines);
+        fprintf(stderr, "%s: %s\n", "recursive",
+                                    recursive ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "gitignore",
+                                    gitignore ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "io_uring", uring ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "quiet", quiet ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "cache", cacheName ? cacheName : "none");
+        fprintf(stderr, "%s: %s\n", "cacheStrict",
+                                    cacheStrict ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "diff", diffName ? diffName : "none");
+        fprintf(stderr, "%s: %s\n", "stats", stats ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "utf8", utf8 ? "true" : "false");
+        fprintf(stderr, "%s: %s\n", "keepTabs", keepTabs ? "true" : "false");
+        fprintf(stderr, "%s: %d\n", "format", (int) format);
+        fprintf(stderr, "%s: %s\n", "daemon",
+                                    daemonName ? daemonName : "none");
+        fprintf(stderr, "%s: %s\n", "client",
+                                    clientName ? clientName : "none");
+        fprintf(stderr, "%s: %s\n", "config",
+                                    configName ? configName : ".lenrc");
+        fprintf(stderr, "%s: %lu\n", "ignorePatterns",
+                                     (unsigned long) nexempts);
+        fprintf(stderr, "%s: %lu\n", "includes",
+                                     (unsigned long) includes.count);
+        fprintf(stderr, "%s: %lu\n", "excludes",
+                                     (unsigned long) excludes.count);
+}
+
+static const char *ESC = "\033[";
+static const char *INV = "\033[1;7;";
+
+static struct esc esc_default;
+static struct esc esc_good;
+static struct esc esc_bad;
+static struct esc esc_file;
+static struct esc esc_file_alt;
+
+static void esc_set(struct esc *e, const char *prefix, COLOR_T c)
+{
+        int n = snprintf(e->seq, sizeof(e->seq), "%s%sm", prefix, c);
+        e->len = n < (int) sizeof(e->seq) ? (size_t) n : 0;
+}
+
+static void term_init(void)
+{
+        const char *prefix = inverted ? INV : ESC;
+
+        esc_set(&esc_default, ESC, "0");
+        esc_set(&esc_good, prefix, good_color);
+        esc_set(&esc_bad, prefix, bad_color);
+        esc_set(&esc_file, prefix, file_color);
+        esc_set(&esc_file_alt, prefix, file_alt);
+}
+
+inline static void term_default(struct outbuf *out)
+{
+        ob_write(out, esc_default.seq, esc_default.len);
+}
+
+inline static void term_color(struct outbuf *out, bool isGood)
+{
+        const struct esc *e = isGood ? &esc_good : &esc_bad;
+        ob_write(out, e->seq, e->len);
+}
+
+/* Not thread safe: only ever called for headers, in file order */
+inline static void term_file(struct outbuf *out)
+{
+    static bool alt = false;
+    if (color) {
+        const struct esc *e = alt ? &esc_file : &esc_file_alt;
+        ob_write(out, e->seq, e->len);
+    }
+    if (alternate) alt = !alt;
+}
+
+static void print_header(struct outbuf *out, const struct job *job)
+{
+        bool isStdin = job->name[0] == READ_STDIN &&
+                       job->name[1] == NULLCHAR;
+        const char *name = isStdin ? "Standard Input" : job->name;
+
+        if (format == FORMAT_CHECKSTYLE) {
+                ob_write(out, "<file name=\"", 12);
+                xml_string(out, job->name);
+                ob_write(out, "\">\n", 3);
+                return;
+        }
+        if (format != FORMAT_TEXT) return;
+
+        term_file(out);
+        ob_write(out, "--|", 3);
+        ob_num(out, (unsigned long) job->number, 0);
+        ob_write(out, ": ", 2);
+        ob_write(out, name, strlen(name));
+        ob_write(out, "|--\n", 4);
+        term_default(out);
+}
+
+static void print_footer(struct outbuf *out)
+{
+        if (format == FORMAT_CHECKSTYLE) ob_write(out, "</file>\n", 8);
+}
+
+static enum format strtoformat(const char *str)
+{
+        if (strcmp(str, "ndjson") == 0)         return FORMAT_NDJSON;
+        else if (strcmp(str, "sarif") == 0)     return FORMAT_SARIF;
+        else if (strcmp(str, "checkstyle") == 0) return FORMAT_CHECKSTYLE;
+
+        fprintf(stderr, "%s %s %s\n", BAD_ARG, str,
+                "is not one of ndjson, sarif or checkstyle");
+        exit(BAD_ARGS);
+}
+
+/* How many bytes of well-formed UTF-8 start a NUL-terminated str: no */
+/* overlong forms, surrogates or code points past U+10FFFF. 0 if none. */
+static size_t utf8_valid(const char *str)
+{
+        const unsigned char *p = (const unsigned char *) str;
+        unsigned char c = p[0];
+        size_t n = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 :
+                   c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xBF;
+
+        if (n < 2) return n;
+        if (c == 0xE0) lo = 0xA0;
+        else if (c == 0xED) hi = 0x9F;
+        else if (c == 0xF0) lo = 0x90;
+        else if (c == 0xF4) hi = 0x8F;
+        if (p[1] < lo || p[1] > hi) return 0;
+        for (size_t k = 2; k < n; ++k)
+                if ((p[k] & 0xC0) != 0x80) return 0;
+        return n;
+}
+
+/* Writes str as the inside of a JSON string */
+static void json_string(struct outbuf *out, const char *str)
+{
+        const char *run = str;
+
+        while (*str != NULLCHAR) {
+                unsigned char c = *str;
+                size_t n = c < 0x80 ? 1 : utf8_valid(str);
+                if (n > 1 ||
+                    (n == 1 && c >= 0x20 && c != '"' && c != '\\')) {
+                        str += n;
+                        continue;
+                }
+
+                ob_write(out, run, str - run);
+                run = ++str;
+                ob_putc(out, '\\');
+                if (n == 0) {
+                        ob_write(out, "ufffd", 5);
+                } else if (c == '"' || c == '\\') {
+                        ob_putc(out, c);
+                } else if (c == '\n') {
+                        ob_putc(out, 'n');
+                } else if (c == TAB) {
+                        ob_putc(out, 't');
+                } else {
+                        ob_write(out, "u00", 3);
+                        ob_putc(out, "0123456789abcdef"[c >> 4]);
+                        ob_putc(out, "0123456789abcdef"[c & 15]);
+                }
+        }
+        ob_write(out, run, str - run);
+}
+
+/* Writes str as the inside of an XML attribute. Tabs and line endings */
+/* are written as references so that they aren't read back as spaces. */
+static void xml_string(struct outbuf *out, const char *str)
+{
+        const char *run = str;
+
+        while (*str != NULLCHAR) {
+                unsigned char c = *str;
+                size_t n = c < 0x80 ? 1 : utf8_valid(str);
+                const char *entity;
+
+                if (n == 0) {
+                        entity = "\xEF\xBF\xBD";
+                        n = 1;
+                } else switch (c) {
+                case '&':       entity = "&amp;";       break;
+                case '<':       entity = "&lt;";        break;
+                case '>':       entity = "&gt;";        break;
+                case '"':       entity = "&quot;";      break;
+                case '\'':      entity = "&apos;";      break;
+                case '\t':      entity = "&#9;";        break;
+                case '\n':      entity = "&#10;";       break;
+                case '\r':      entity = "&#13;";       break;
+                default:
+                        if (c < 0x20) {
+                                entity = "\xEF\xBF\xBD";
+                                break;
+                        }
+                        str += n;
+                        continue;
+                }
+                ob_write(out, run, str - run);
+                ob_write(out, entity, strlen(entity));
+                str += n;
+                run = str;
+        }
+        ob_write(out, run, str - run);
+}
+
+/* Keeps what RFC 3986 leaves unreserved, and slashes between segments */
+static void uri_string(struct outbuf *out, const char *str)
+{
+        for (; *str != NULLCHAR; ++str) {
+                unsigned char c = *str;
+                if (isalnum(c) || c == '-' || c == '.' || c == '_' ||
+                    c == '~' || c == '/') {
+                        ob_putc(out, c);
+                        continue;
+                }
+                ob_putc(out, '%');
+                ob_putc(out, "0123456789ABCDEF"[c >> 4]);
+                ob_putc(out, "0123456789ABCDEF"[c & 15]);
+        }
+}
+
+static void format_open(struct outbuf *out)
+{
+        static const char sarif[] =
+                "{\"version\":\"2.1.0\",\"$schema\":"
+                "\"https://json.schemastore.org/sarif-2.1.0.json\","
+                "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"len\","
+                "\"rules\":[{\"id\":\"line-length\",\"shortDescription\":"
+                "{\"text\":\"Line length out of range\"}}]}},"
+                "\"results\":[\n";
+        static const char checkstyle[] =
+                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<checkstyle version=\"4.3\">\n";
+
+        if (format == FORMAT_SARIF)
+                ob_write(out, sarif, sizeof(sarif) - 1);
+        else if (format == FORMAT_CHECKSTYLE)
+                ob_write(out, checkstyle, sizeof(checkstyle) - 1);
+}
+
+static void format_close(struct outbuf *out)
+{
+        if (format == FORMAT_SARIF) ob_write(out, "\n]}]}\n", 6);
+        else if (format == FORMAT_CHECKSTYLE)
+                ob_write(out, "</checkstyle>\n", 14);
+}
+
+/* Only sarif's records are separated, by commas. Called in output */
+/* order, which is only ever on the main thread.                  */
+static void format_separator(struct outbuf *out)
+{
+        static bool first = true;
+
+        if (format != FORMAT_SARIF) return;
+        if (!first) ob_write(out, ",\n", 2);
+        first = false;
+}
+
+/* Line numbers of chunks and the separators of parallel runs are left */
+/* to the writer, the same as -n line numbers are                       */
+static void print_record(struct outbuf *out, struct job *job, size_t line,
+                         size_t len)
+{
+        /* In the units -l shows and -m and -M were given in */
+        size_t shown = newlines ? len : len - 1;
+        size_t max = newlines ? maxLen : maxLen - 1;
+        size_t min = newlines ? minLen : minLen - 1;
+        size_t over = shown > max ? shown - max : 0;
+        size_t under = shown < min ? min - shown : 0;
+
+        if (job->deferHeader) job_mark(job, out->len, MARK_SEPARATOR);
+        else format_separator(out);
+
+        switch (format) {
+        case FORMAT_NDJSON:
+                ob_write(out, "{\"file\":\"", 9);
+                json_string(out, job->name);
+                ob_write(out, "\",\"line\":", 9);
+                break;
+        case FORMAT_SARIF:
+                ob_write(out, "{\"ruleId\":\"line-length\",\"level\":"
+                              "\"error\",\"message\":{\"text\":\"", 59);
+                break;
+        case FORMAT_CHECKSTYLE:
+                ob_write(out, "<error line=\"", 13);
+                break;
+        default:
+                return;
+        }
+
+        if (format == FORMAT_SARIF) {
+                ob_write(out, "Line is ", 8);
+                ob_num(out, shown, 0);
+                ob_write(out, over ? " columns long, over the maximum of " :
+                                     " columns long, under the minimum of ",
+                         over ? 35 : 36);
+                ob_num(out, over ? max : min, 0);
+                ob_write(out, "\"},\"locations\":[{\"physicalLocation\":"
+                              "{\"artifactLocation\":{\"uri\":\"", 64);
+                uri_string(out, job->name);
+                ob_write(out, "\"},\"region\":{\"startLine\":", 25);
+        }
+
+        if (job->deferLines) job_mark(job, out->len, line);
+        else ob_num(out, line, 0);
+
+        switch (format) {
+        case FORMAT_NDJSON:
+                ob_write(out, ",\"length\":", 10);
+                ob_num(out, shown, 0);
+                ob_write(out, ",\"min\":", 7);
+                ob_num(out, min, 0);
+                ob_write(out, ",\"max\":", 7);
+                ob_num(out, max, 0);
+                ob_write(out, ",\"over\":", 8);
+                ob_num(out, over, 0);
+                ob_write(out, ",\"under\":", 9);
+                ob_num(out, under, 0);
+                ob_write(out, "}\n", 2);
+                break;
+        case FORMAT_SARIF:
+                if (over) {
+                        ob_write(out, ",\"startColumn\":", 15);
+                        ob_num(out, max + 1, 0);
+                }
+                ob_write(out, "}}}]}", 5);
+                break;
+        default:
+                if (over) {
+                        ob_write(out, "\" column=\"", 10);
+                        ob_num(out, max + 1, 0);
+                }
+                ob_write(out, "\" severity=\"error\" message=\"Line is ", 36);
+                ob_num(out, shown, 0);
+                ob_write(out, over ? " columns long, over the maximum of " :
+                                     " columns long, under the minimum of ",
+                         over ? 35 : 36);
+                ob_num(out, over ? max : min, 0);
+                ob_write(out, "\" source=\"len.line-length\"/>\n", 29);
+                break;
+        }
+}
+
+static void ob_init(struct outbuf *ob, FILE *sink)
+{
+        ob->data = NULL;
+        ob->len = 0;
+        ob->cap = 0;
+        ob->sink = sink;
+        ob->flushed = 0;
+        if (sink != NULL) {
+                ob->data = malloc(OUT_BUFFER);
+                if (ob->data == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                ob->cap = OUT_BUFFER;
+        }
+}
+
+static void ob_flush(struct outbuf *ob)
+{
+        if (ob->sink == NULL || ob->len == 0) return;
+        fwrite(ob->data, 1, ob->len, ob->sink);
+        ob->flushed += ob->len;
+        ob->len = 0;
+}
+
+/* Makes room for n more bytes: flushes if there is a sink, grows if not. */
+/* With a sink, n may still not fit afterwards; callers check.           */
+static void ob_room(struct outbuf *ob, size_t n)
+{
+        if (ob->cap - ob->len >= n) return;
+        if (ob->sink != NULL) {
+                ob_flush(ob);
+                return;
+        }
+
+        size_t cap = ob->cap ? ob->cap : 4096;
+        while (cap - ob->len < n) cap *= 2;
+        char *grown = realloc(ob->data, cap);
+        if (grown == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        ob->data = grown;
+        ob->cap = cap;
+}
+
+static void ob_write(struct outbuf *ob, const char *p, size_t n)
+{
+        if (n == 0) return;
+        ob_room(ob, n);
+        if (ob->cap - ob->len < n) {
+                fwrite(p, 1, n, ob->sink);
+                ob->flushed += n;
+                return;
+        }
+        memcpy(ob->data + ob->len, p, n);
+        ob->len += n;
+}
+
+static void ob_fill(struct outbuf *ob, char c, size_t n)
+{
+        while (n > 0) {
+                ob_room(ob, n);
+                size_t fits = ob->cap - ob->len < n ? ob->cap - ob->len : n;
+                memset(ob->data + ob->len, c, fits);
+                ob->len += fits;
+                n -= fits;
+        }
+}
+
+inline static unsigned long long ob_total(const struct outbuf *ob)
+{
+        return ob->flushed + ob->len;
+}
+
+inline static void ob_putc(struct outbuf *ob, char c)
+{
+        if (ob->len == ob->cap) ob_room(ob, 1);
+        ob->data[ob->len++] = c;
+}
+
+static void ob_num(struct outbuf *ob, unsigned long n, int width)
+{
+        char digits[3 * sizeof(n)];
+        int count = 0;
+
+        do {
+                digits[sizeof(digits) - ++count] = '0' + n % 10;
+                n /= 10;
+        } while (n > 0);
+
+        if (width > count) ob_fill(ob, ' ', width - count);
+        ob_write(ob, digits + sizeof(digits) - count, count);
+}
+
+/* Walks a line's columns for render_line(), remembering where in the */
+/* raw bytes, and how far into a tab, the last stretch ended          */
+struct cursor {
+        const char      *text;
+        size_t          bytes;
+        size_t          index;
+        size_t          col;
+        size_t          tabEnd;
+        size_t          indent;
+};
+
+/* Whether a terminal, with its tab stops every TERM_TABS columns from */
+/* the start of the printed line, takes a tab to where len counts it   */
+/* to. Only then can --keep-tabs print it as it is without the columns */
+/* after it, and with them colors and -r cuts, moving on screen.       */
+#define TERM_TABS 8
+
+inline static bool tab_fits(const struct cursor *cur)
+{
+        size_t at = cur->indent + cur->col;
+        return at - at % TERM_TABS + TERM_TABS == cur->indent + cur->tabEnd;
+}
+
+/* Prints columns up to (not including) column to. Runs without tabs go */
+/* out in one piece; tabs come out as spaces, one per column, or with   */
+/* --keep-tabs as they are when they fit before to whole and the        */
+/* terminal puts them where they're counted.                            */
+static void render_cols(struct outbuf *out, struct cursor *cur, size_t to)
+{
+        while (cur->col < to && cur->index < cur->bytes) {
+                const char *p = cur->text + cur->index;
+
+                if (*p == TAB) {
+                        bool fresh = cur->tabEnd <= cur->col;
+                        if (fresh) cur->tabEnd = tab_stop(cur->col);
+                        if (keepTabs && fresh && cur->tabEnd <= to &&
+                            tab_fits(cur)) {
+                                ob_putc(out, TAB);
+                                cur->col = cur->tabEnd;
+                                ++cur->index;
+                                continue;
+                        }
+                        size_t stop = cur->tabEnd < to ? cur->tabEnd : to;
+                        ob_fill(out, ' ', stop - cur->col);
+                        cur->col = stop;
+                        if (stop == cur->tabEnd) ++cur->index;
+                        continue;
+                }
+
+                /* Whole characters only: one too wide to fit before */
+                /* to waits for the next span                         */
+                if (utf8) {
+                        size_t at = cur->index;
+                        size_t col = cur->col;
+                        const char *end = cur->text + cur->bytes;
+                        while (at < cur->bytes) {
+                                size_t run = text_run(cur->text + at, end,
+                                                      true);
+                                if (run > to - col) run = to - col;
+                                at += run;
+                                col += run;
+                                if (at == cur->bytes ||
+                                    (unsigned char) cur->text[at] < 0x80)
+                                        break;
+
+                                size_t width;
+                                size_t n = utf8_char(cur->text + at, end,
+                                                     &width);
+                                if (col + width > to) break;
+                                at += n;
+                                col += width;
+                        }
+                        if (at == cur->index) return;
+                        ob_write(out, p, at - cur->index);
+                        cur->index = at;
+                        cur->col = col;
+                        continue;
+                }
+
+                size_t run = to - cur->col;
+                if (run > cur->bytes - cur->index)
+                        run = cur->bytes - cur->index;
+                const char *tab = memchr(p, TAB, run);
+                if (tab != NULL) run = tab - p;
+
+                ob_write(out, p, run);
+                cur->index += run;
+                cur->col += run;
+        }
+}
+
+/* A line comes out in up to three spans, split where the color changes: */
+/* once the line passes maxLen (where -r cuts it off) and once it reaches */
+/* minLen. Neither happens at or past the end of the line.               */
+static void render_line(struct outbuf *out, const struct line *ln,
+                        size_t indent)
+{
+        struct render r;
+
+        render_start(&r, ln->len, indent);
+        render_feed(out, &r, ln->text, ln->bytes);
+        render_end(out, &r, ln->len);
+}
+
+static void render_start(struct render *r, size_t len, size_t indent)
+{
+        r->col = 0;
+        r->tabEnd = 0;
+        r->indent = indent;
+        r->maxPending = true;
+        r->minPending = true;
+        r->truncated = false;
+
+        /* Only turn green once we pass minLen, but don't turn green */
+        /* if only printing lines out of tolerance                   */
+        r->minColor = color && minLen != 1 && (len <= maxLen || printAll);
+}
+
+/* A color change is only made once text past it turns up, which is */
+/* how it never happens at the end of a line                        */
+static void render_feed(struct outbuf *out, struct render *r, const char *p,
+                        size_t n)
+{
+        struct cursor cur = { p, n, 0, r->col, r->tabEnd, r->indent };
+
+        /* Only turn red once we pass maxLen, but we have to remember */
+        /* that the length counts the newline as a single char        */
+        size_t maxAt = maxLen - 1;
+        size_t minAt = minLen - 1;
+
+        /* Without a color change or cut there, a line isn't split at  */
+        /* all, so --keep-tabs can keep the tabs across the limits     */
+        bool maxSplit = color || truncating;
+
+        while (!r->truncated) {
+                size_t at = r->maxPending && maxSplit ? maxAt : SIZE_MAX;
+                if (r->minPending && r->minColor && minAt < at) at = minAt;
+
+                render_cols(out, &cur, at);
+                if (cur.index == cur.bytes) break;
+
+                if (r->maxPending && at == maxAt) {
+                        r->maxPending = false;
+                        if (color) term_color(out, false);
+                        if (truncating) {
+                                ob_putc(out, TRUNCATE_CHAR);
+                                r->truncated = true;
+                                break;
+                        }
+                }
+                if (r->minPending && at == minAt) {
+                        r->minPending = false;
+                        if (r->minColor) term_color(out, true);
+                }
+        }
+        r->col = cur.col;
+        r->tabEnd = cur.tabEnd;
+}
+
+static void render_end(struct outbuf *out, const struct render *r,
+                       size_t len)
+{
+        /* We don't want to rear pad if no minimum length is set.    */
+        /* Don't punish empty lines, but don't forget to account for */
+        /* the newline in nonempty lines                             */
+        if (minLen != 1 && len > 1 && r->col < minLen && color) {
+                term_color(out, false);
+                if (r->col < minLen - 1)
+                        ob_fill(out, REAR_PADDING, minLen - 1 - r->col);
+        }
+
+        /* The last character should be a newline. We take */
+        /* this opporunity to reset terminal text color.   */
+        if (color) term_default(out);
+        ob_putc(out, '\n');
+}
+
+static struct hist *hist_new(void)
+{
+        struct hist *h = calloc(1, sizeof(*h));
+        if (h == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        return h;
+}
+
+inline static void hist_add(struct hist *h, size_t length)
+{
+        if (length < HIST_EXACT) ++h->exact[length];
+        else ++h->log2[63 - __builtin_clzll(length)];
+        ++h->count;
+        h->sum += length;
+        if (length > h->max) h->max = length;
+}
+
+static void hist_merge(struct hist *into, const struct hist *from)
+{
+        for (size_t k = 0; k < HIST_EXACT; ++k)
+                into->exact[k] += from->exact[k];
+        for (size_t k = 0; k < 64; ++k) into->log2[k] += from->log2[k];
+        into->count += from->count;
+        into->blank += from->blank;
+        into->sum += from->sum;
+        if (from->max > into->max) into->max = from->max;
+}
+
+/* Smallest length at or below which permille/1000 of the lines fall.  */
+/* Past HIST_EXACT only the power of two is known, so its top is given */
+/* (but never more than the longest line).                            */
+static size_t hist_percentile(const struct hist *h, unsigned permille)
+{
+        unsigned long long want = (h->count * permille + 999) / 1000;
+        unsigned long long seen = 0;
+
+        if (want == 0) want = 1;
+        for (size_t k = 0; k < HIST_EXACT; ++k) {
+                seen += h->exact[k];
+                if (seen >= want) return k;
+        }
+        for (size_t k = 0; k < 64; ++k) {
+                seen += h->log2[k];
+                if (seen >= want) {
+                        size_t top = ((size_t) 2 << k) - 1;
+                        return top < h->max ? top : h->max;
+                }
+        }
+        return h->max;
+}
+
+static void report_line(struct outbuf *out, const char *name,
+                        unsigned long long n)
+{
+        ob_write(out, name, strlen(name));
+        ob_write(out, ": ", 2);
+        ob_num(out, n, 0);
+        ob_putc(out, '\n');
+}
+
+/* Lengths below HIST_EXACT are bucketed by tens, longer ones by power */
+/* of two. Empty buckets are left out.                                 */
+static void report_buckets(struct outbuf *out, const struct hist *h)
+{
+        for (size_t k = 0; k < HIST_EXACT; k += 10) {
+                unsigned long long n = 0;
+                size_t top = k + 9 < HIST_EXACT ? k + 9 : HIST_EXACT - 1;
+                for (size_t v = k; v <= top; ++v) n += h->exact[v];
+                if (n == 0) continue;
+                ob_num(out, k, 5);
+                ob_putc(out, '-');
+                ob_num(out, top, 0);
+                ob_write(out, ": ", 2);
+                ob_num(out, n, 0);
+                ob_putc(out, '\n');
+        }
+        for (size_t k = 0; k < 64; ++k) {
+                if (h->log2[k] == 0) continue;
+                ob_num(out, (size_t) 1 << k, 5);
+                ob_putc(out, '-');
+                ob_num(out, ((size_t) 2 << k) - 1, 0);
+                ob_write(out, ": ", 2);
+                ob_num(out, h->log2[k], 0);
+                ob_putc(out, '\n');
+        }
+}
+
+static void report_hist(struct outbuf *out, const struct hist *h)
+{
+        char mean[32];
+        int n = snprintf(mean, sizeof(mean), "mean: %.2f\n",
+                         h->count ? (double) h->sum / h->count : 0.0);
+
+        report_line(out, "lines", h->count + h->blank);
+        report_line(out, "blank", h->blank);
+        report_line(out, "max", h->max);
+        ob_write(out, mean, n);
+        report_line(out, "p50", hist_percentile(h, 500));
+        report_line(out, "p90", hist_percentile(h, 900));
+        report_line(out, "p99", hist_percentile(h, 990));
+        report_line(out, "p99.9", hist_percentile(h, 999));
+        if (histogram) report_buckets(out, h);
+}
+
+static void report_job(struct outbuf *out, struct job *job,
+                       struct hist *total)
+{
+        if (MANY_FILES) print_header(out, job);
+        report_hist(out, job->hist);
+        hist_merge(total, job->hist);
+        free(job->hist);
+        job->hist = NULL;
+}
+
+static void report_total(struct outbuf *out, const struct hist *total)
+{
+        term_file(out);
+        ob_write(out, "--|All files|--\n", 16);
+        term_default(out);
+        report_hist(out, total);
+}
+
+static struct top *top_new(void)
+{
+        struct top *t = calloc(1, sizeof(*t));
+        if (t == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        return t;
+}
+
+/* True if a goes before b when the shortest is let go: the shorter, */
+/* or else the one from a later file, or else from later in the file */
+inline static bool top_below(const struct top_line *a,
+                             const struct top_line *b)
+{
+        if (a->len != b->len) return a->len < b->len;
+        if (a->number != b->number) return a->number > b->number;
+        return a->line > b->line;
+}
+
+static void top_sift(struct top *t, size_t k)
+{
+        struct top_line *l = t->lines;
+
+        for (;;) {
+                size_t least = k;
+                size_t c = 2 * k + 1;
+                if (c < t->count && top_below(&l[c], &l[least])) least = c;
+                if (c + 1 < t->count && top_below(&l[c + 1], &l[least]))
+                        least = c + 1;
+                if (least == k) return;
+
+                struct top_line swap = l[k];
+                l[k] = l[least];
+                l[least] = swap;
+                k = least;
+        }
+}
+
+/* Puts line in, owning what it points to, and drops the shortest if */
+/* that makes too many                                                */
+static void top_put(struct top *t, struct top_line *line)
+{
+        if (t->count == topLines) {
+                if (!top_below(&t->lines[0], line)) {
+                        free(line->name);
+                        free(line->text);
+                        return;
+                }
+                free(t->lines[0].name);
+                free(t->lines[0].text);
+                t->lines[0] = *line;
+                top_sift(t, 0);
+                return;
+        }
+
+        if (t->count == t->cap) {
+                size_t cap = t->cap ? 2 * t->cap : 16;
+                if (cap > topLines) cap = topLines;
+                struct top_line *l = realloc(t->lines, cap * sizeof(*l));
+                if (l == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                t->lines = l;
+                t->cap = cap;
+        }
+
+        /* Up from the bottom to where it goes */
+        size_t k = t->count++;
+        while (k > 0 && top_below(line, &t->lines[(k - 1) / 2])) {
+                t->lines[k] = t->lines[(k - 1) / 2];
+                k = (k - 1) / 2;
+        }
+        t->lines[k] = *line;
+}
+
+inline static void top_offer(struct top *t, const struct top_line *cand)
+{
+        /* Most lines are turned away here, copying nothing */
+        if (t->count == topLines && !top_below(&t->lines[0], cand)) return;
+
+        struct top_line line = *cand;
+        if (line.offset == SIZE_MAX) {
+                line.text = malloc(line.bytes ? line.bytes : 1);
+                if (line.text == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                memcpy(line.text, cand->text, line.bytes);
+        } else {
+                line.text = NULL;
+        }
+        top_put(t, &line);
+}
+
+static void top_merge(struct top *into, struct top *from, const char *name,
+                      size_t lineBase, size_t offsetBase)
+{
+        for (size_t k = 0; k < from->count; ++k) {
+                struct top_line *line = &from->lines[k];
+
+                line->line += lineBase;
+                if (line->offset != SIZE_MAX) line->offset += offsetBase;
+
+                /* Copying the name can wait until it's sure to be kept */
+                if (into->count == topLines && !top_below(&into->lines[0],
+                                                          line)) {
+                        free(line->text);
+                        continue;
+                }
+                if (name != NULL) {
+                        line->dev = from->dev;
+                        line->ino = from->ino;
+                        line->mtime = from->mtime;
+                        line->name = strdup(name);
+                        if (line->name == NULL) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
+                        }
+                }
+                top_put(into, line);
+        }
+        from->count = 0;
+}
+
+static void top_free(struct top *t)
+{
+        if (t == NULL) return;
+        for (size_t k = 0; k < t->count; ++k) {
+                free(t->lines[k].name);
+                free(t->lines[k].text);
+        }
+        free(t->lines);
+        free(t->first);
+        free(t);
+}
+
+/* Longest first, ties going to the earlier line */
+static int top_order(const void *a, const void *b)
+{
+        if (top_below(a, b)) return 1;
+        if (top_below(b, a)) return -1;
+        return 0;
+}
+
+/* Exits, the file's line being lost */
+static void top_lost(struct outbuf *out, const char *what, const char *name,
+                     const char *why)
+{
+        ob_flush(out);
+        fprintf(stderr, "%s %s %s\n", what, name, why);
+        exit(BAD_FILE);
+}
+
+/* Opens the file a mapped line is to be read back from. One that isn't */
+/* the file that was checked any more is reported.                      */
+static int top_reopen(struct outbuf *out, const struct top_line *line)
+{
+        struct stat st;
+        int fdno = open(line->name, O_RDONLY);
+        if (fdno < 0 || fstat(fdno, &st) != 0)
+                top_lost(out, "Could not open file", line->name,
+                         "for reading");
+        if (line->ino != 0 &&
+            ((uint64_t) st.st_dev != line->dev ||
+             (uint64_t) st.st_ino != line->ino ||
+             (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec !=
+             line->mtime))
+                top_lost(out, "File", line->name, "changed after it was "
+                         "checked");
+        return fdno;
+}
+
+/* Reads a mapped line back from fdno a window at a time, closing it */
+static void top_reread(struct outbuf *out, struct render *r,
+                       const struct top_line *line, int fdno, char *buf)
+{
+        size_t done = 0;
+        size_t left = 0;
+        while (done < line->bytes) {
+                size_t want = line->bytes - done;
+                if (want > SCAN_BLOCK - left) want = SCAN_BLOCK - left;
+                ssize_t got = pread(fdno, buf + left, want,
+                                    (off_t) (line->offset + done));
+                if (got < 0 && errno == EINTR) continue;
+                if (got < 0)
+                        top_lost(out, "Could not read file", line->name,
+                                 "again");
+                if (got == 0)
+                        top_lost(out, "File", line->name, "changed after it "
+                                 "was checked");
+
+                /* Characters split between reads wait for the rest */
+                size_t n = left + (size_t) got;
+                size_t cut = utf8 ? utf8_cut(buf, n) : n;
+                render_feed(out, r, buf, cut);
+                left = n - cut;
+                memmove(buf, buf + cut, left);
+                done += (size_t) got;
+        }
+        render_feed(out, r, buf, left);
+        close(fdno);
+}
+
+static void report_top(struct outbuf *out, struct top *t)
+{
+        struct job job;
+        char *buf = NULL;
+        int shown = 0;
+
+        qsort(t->lines, t->count, sizeof(*t->lines), top_order);
+        memset(&job, 0, sizeof(job));
+
+        for (size_t k = 0; k < t->count; ++k) {
+                const struct top_line *line = &t->lines[k];
+                struct render r;
+
+                /* Colored and cut off by the limits its file had */
+                limits_for(line->name);
+
+                /* Checked before anything of the line is printed */
+                int fdno = line->offset == SIZE_MAX ? -1 :
+                           top_reopen(out, line);
+
+                /* A header whenever the file changes from the last line's */
+                if (MANY_FILES && line->number != shown) {
+                        job.name = line->name;
+                        job.number = line->number;
+                        print_header(out, &job);
+                        shown = line->number;
+                }
+
+                render_start(&r, line->len,
+                             print_prefix(out, &job, line->line, line->len));
+                if (line->offset == SIZE_MAX) {
+                        render_feed(out, &r, line->text, line->bytes);
+                } else {
+                        if (buf == NULL) buf = malloc(SCAN_BLOCK);
+                        if (buf == NULL) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
+                        }
+                        top_reread(out, &r, line, fdno, buf);
+                }
+                if (line->cut && !r.truncated) ob_putc(out, TRUNCATE_CHAR);
+                render_end(out, &r, line->len);
+        }
+
+        for (size_t k = 0; k < t->count; ++k) {
+                free(t->lines[k].name);
+                free(t->lines[k].text);
+        }
+        free(t->lines);
+        free(t->first);
+        free(buf);
+}
+
+inline static uint64_t stats_clock(void)
+{
+        struct timespec ts;
+
+        if (!stats) return 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+inline static uint64_t stats_lap(uint64_t *into, uint64_t since)
+{
+        uint64_t now = stats_clock();
+        *into += now - since;
+        return now;
+}
+
+static void stats_merge(struct stats *into, const struct stats *from)
+{
+        into->bytes += from->bytes;
+        into->lines += from->lines;
+        if (from->longest > into->longest) into->longest = from->longest;
+        into->written += from->written;
+        into->open += from->open;
+        into->scan += from->scan;
+        into->render += from->render;
+}
+
+static void stats_spread(struct job **list, size_t n, uint64_t start)
+{
+        if (!stats || n == 0) return;
+
+        uint64_t share = (stats_clock() - start) / n;
+        for (size_t k = 0; k < n; ++k) list[k]->stats.open += share;
+}
+
+/* The report goes to stderr through a buffer of its own, so that a */
+/* line per file doesn't cost a write per file                      */
+static struct outbuf statsOut;
+
+static void stats_line(const struct stats *st, const char *name)
+{
+        char line[256];
+
+        if (statsOut.sink == NULL) {
+                ob_init(&statsOut, stderr);
+                int n = snprintf(line, sizeof(line),
+                                 "%12s %10s %8s %12s %10s %10s %10s  %s\n",
+                                 "bytes", "lines", "longest", "written",
+                                 "open/read", "scan", "render", "file");
+                ob_write(&statsOut, line, n);
+        }
+
+        int n = snprintf(line, sizeof(line),
+                         "%12llu %10llu %8lu %12llu %10.6f %10.6f %10.6f  ",
+                         st->bytes, st->lines, (unsigned long) st->longest,
+                         st->written, st->open / 1e9,
+                         st->scan / 1e9, st->render / 1e9);
+        ob_write(&statsOut, line, n);
+        ob_write(&statsOut, name, strlen(name));
+        ob_putc(&statsOut, '\n');
+}
+
+static void stats_job(const struct job *job, struct stats *total)
+{
+        stats_line(&job->stats, job->name);
+        stats_merge(total, &job->stats);
+}
+
+static void stats_total(const struct stats *total, uint64_t start)
+{
+        char line[64];
+
+        if (statsOut.sink == NULL) ob_init(&statsOut, stderr);
+        if (MANY_FILES) stats_line(total, "All files");
+        int n = snprintf(line, sizeof(line), "wall: %.6f s\n",
+                         (stats_clock() - start) / 1e9);
+        ob_write(&statsOut, line, n);
+        ob_flush(&statsOut);
+        free(statsOut.data);
+}
+
+/* Mixes one more word into a hash */
+inline static uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+        h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 33);
+}
+
+static uint64_t content_hash(const char *p, size_t n)
+{
+        uint64_t h = n;
+        uint64_t v;
+
+        for (; n >= 8; p += 8, n -= 8) {
+                memcpy(&v, p, 8);
+                h = hash_mix(h, v);
+        }
+        v = 0;
+        if (n > 0) memcpy(&v, p, n);
+        return hash_mix(h, v);
+}
+
+/* Only regular files are cached. Stdin never is. */
+static bool cache_key(const char *name, struct cache_key *key)
+{
+        struct stat st;
+
+        if (name[0] == READ_STDIN && name[1] == NULLCHAR) return false;
+        if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+        key->dev = (uint64_t) st.st_dev;
+        key->ino = (uint64_t) st.st_ino;
+        key->size = (uint64_t) st.st_size;
+        key->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 +
+                     st.st_mtim.tv_nsec;
+        return true;
+}
+
+static struct cache_slot *cache_slot(uint64_t k)
+{
+        return (struct cache_slot *) cache.map + 1 + (k & (cache.slots - 1));
+}
+
+/* Anything that changes lengths or verdicts is part of the key. The */
+/* limits are the file's own, so this goes for the file being checked */
+inline static uint32_t cache_settings(void)
+{
+        return (uint32_t) hash_mix(hash_mix(hash_mix(hash_mix(hash_mix(
+                          CACHE_VERSION, maxLen), minLen), tabWidth),
+                          newlines | utf8 << 1), exemptsHash);
+}
+
+inline static uint64_t cache_home(const struct cache_key *key)
+{
+        return hash_mix(hash_mix(key->dev, key->ino), cache_settings());
+}
+
+inline static bool cache_same(const struct cache_slot *s,
+                              const struct cache_key *key)
+{
+        return s->dev == key->dev && s->ino == key->ino &&
+               s->size == key->size && s->mtime == key->mtime &&
+               s->settings == cache_settings();
+}
+
+static bool cache_lookup(const struct cache_key *key, uint64_t hash,
+                  bool *violated)
+{
+        uint64_t home = cache_home(key);
+
+        for (unsigned p = 0; p < CACHE_PROBES; ++p) {
+                struct cache_slot *s = cache_slot(home + p);
+                struct cache_slot copy;
+                uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+                /* Odd means someone is writing it */
+                if (seq == 0 || seq & 1) continue;
+                memcpy(&copy, s, sizeof(copy));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+                        continue;
+
+                if (!cache_same(&copy, key)) continue;
+                if (cacheStrict && (!(copy.flags & CACHE_HASHED) ||
+                                    copy.hash != hash))
+                        return false;
+                *violated = copy.flags & CACHE_VIOLATED;
+                return true;
+        }
+        return false;
+}
+
+/* Goes in the file's own slot if it has one, else an empty one, else */
+/* over whatever is in its first slot. A slot another writer holds is */
+/* left alone: the result just isn't cached this time.                */
+static void cache_store(const struct cache_key *key, uint64_t hash,
+                 const struct job *job)
+{
+        uint64_t home = cache_home(key);
+        struct cache_slot *s = NULL;
+
+        for (unsigned p = 0; p < CACHE_PROBES && s == NULL; ++p) {
+                struct cache_slot *at = cache_slot(home + p);
+                if (at->dev == key->dev && at->ino == key->ino &&
+                    at->settings == cache_settings())
+                        s = at;
+        }
+        for (unsigned p = 0; p < CACHE_PROBES && s == NULL; ++p) {
+                struct cache_slot *at = cache_slot(home + p);
+                if (__atomic_load_n(&at->seq, __ATOMIC_RELAXED) == 0)
+                        s = at;
+        }
+        if (s == NULL) s = cache_slot(home);
+
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        if (seq & 1 ||
+            !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+
+        s->dev = key->dev;
+        s->ino = key->ino;
+        s->size = key->size;
+        s->mtime = key->mtime;
+        s->settings = cache_settings();
+        s->flags = (job->violated ? CACHE_VIOLATED : 0) |
+                   (cacheStrict ? CACHE_HASHED : 0);
+        s->hash = hash;
+        s->longest = job->longest < UINT32_MAX ?
+                     (uint32_t) job->longest : UINT32_MAX;
+        s->shortest = job->shortest < UINT32_MAX ?
+                      (uint32_t) job->shortest : UINT32_MAX;
+        __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* A new cache file is set up under a lock, so two runs starting at */
+/* once agree on it. Anything that isn't a cache is left untouched.  */
+static bool cache_open(const char *name)
+{
+        int fd = open(name, O_RDWR | O_CREAT, 0666);
+        struct flock lock;
+        struct stat st;
+        size_t len = (CACHE_SLOTS + 1) * sizeof(struct cache_slot);
+        bool ok = false;
+
+        if (fd < 0) return false;
+
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        if (fcntl(fd, F_SETLKW, &lock) == 0 && fstat(fd, &st) == 0) {
+                char magic[sizeof(CACHE_MAGIC)];
+
+                if (st.st_size == 0) {
+                        ok = ftruncate(fd, (off_t) len) == 0 &&
+                             pwrite(fd, CACHE_MAGIC, sizeof(magic), 0) ==
+                             (ssize_t) sizeof(magic);
+                } else {
+                        ok = (size_t) st.st_size == len &&
+                             pread(fd, magic, sizeof(magic), 0) ==
+                             (ssize_t) sizeof(magic) &&
+                             memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+                }
+                lock.l_type = F_UNLCK;
+                fcntl(fd, F_SETLK, &lock);
+        }
+
+        if (ok) {
+                void *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED) ok = false;
+                else {
+                        cache.map = map;
+                        cache.mapLen = len;
+                        cache.slots = CACHE_SLOTS;
+                }
+        }
+        close(fd);
+        return ok;
+}
+
+/* Paths in a diff may be quoted, and may be followed by a tab and a */
+/* timestamp. git's b/ prefix goes, if git wrote the diff.           */
+static char *diff_path(const char *p, const char *end, bool git)
+{
+        if (p < end && *p == '"') {
+                ++p;
+                const char *q = memchr(p, '"', end - p);
+                if (q != NULL) end = q;
+        } else {
+                const char *tab = memchr(p, TAB, end - p);
+                if (tab != NULL) end = tab;
+        }
+        if (git && end - p > 2 && p[0] == 'b' && p[1] == '/') p += 2;
+
+        char *path = malloc(end - p + 1);
+        if (path == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        memcpy(path, p, end - p);
+        path[end - p] = NULLCHAR;
+        return path;
+}
+
+static void diff_hunk(struct dfile *df, size_t first, size_t count)
+{
+        if (count == 0) return;
+
+        /* Touching hunks become one */
+        if (df->count > 0 && df->hunks[df->count - 1].last >= first) {
+                size_t last = first + count;
+                if (last > df->hunks[df->count - 1].last)
+                        df->hunks[df->count - 1].last = last;
+                return;
+        }
+        if (df->count == df->cap) {
+                size_t cap = df->cap ? 2 * df->cap : 8;
+                struct hunk *grown = realloc(df->hunks,
+                                             cap * sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                df->hunks = grown;
+                df->cap = cap;
+        }
+        df->hunks[df->count].first = first;
+        df->hunks[df->count].last = first + count;
+        ++df->count;
+}
+
+static void diff_load(const char *name)
+{
+        struct source src = { NULL, NULL, 0, 0, NULL, 0, false, NULL,
+                               0, false, false, false, 0, NULL, 0, false,
+                               NULL, { 0 }, 0 };
+        size_t cap = 0;
+        struct dfile *df = NULL;
+
+        if (!source_open(&src, name)) {
+                fprintf(stderr, "%s %s %s\n", "Could not open diff",
+                                              name, "for reading");
+                exit(BAD_FILE);
+        }
+
+        /* Streams are read whole; diffs are never that big */
+        char *text = (char *) src.map;
+        size_t size = src.mapLen;
+        if (src.fd != NULL) {
+                size_t got;
+                text = NULL;
+                size = 0;
+                do {
+                        if (size == cap) {
+                                cap = cap ? 2 * cap : SCAN_BLOCK;
+                                char *grown = realloc(text, cap);
+                                if (grown == NULL) {
+                                        fprintf(stderr, "%s\n", NO_MEMORY);
+                                        exit(MEM_EXCEEDED);
+                                }
+                                text = grown;
+                        }
+                        got = source_read(&src, text + size, cap - size);
+                        size += got;
+                } while (got > 0);
+        }
+
+        /* Lines left in the hunk being read, on either side. Until */
+        /* both run out, a line that looks like a header is a line  */
+        /* that was added or removed.                               */
+        size_t oldLeft = 0;
+        size_t newLeft = 0;
+        bool git = false;
+        const char *p = text;
+        const char *end = text + size;
+        while (p < end) {
+                const char *eol = memchr(p, '\n', end - p);
+                if (eol == NULL) eol = end;
+                const char *stop = eol;
+                if (stop > p && stop[-1] == '\r') --stop;
+
+                if (oldLeft > 0 || newLeft > 0) {
+                        char c = stop > p ? *p : ' ';
+                        if (c != '+' && c != '\\' && oldLeft > 0) --oldLeft;
+                        if (c != '-' && c != '\\' && newLeft > 0) --newLeft;
+                        p = eol + 1;
+                        continue;
+                }
+
+                if (stop - p >= 11 && memcmp(p, "diff --git ", 11) == 0) {
+                        git = true;
+                } else if (stop - p >= 4 && memcmp(p, "+++ ", 4) == 0) {
+                        /* Deleted files have nothing left to check */
+                        df = NULL;
+                        if (stop - p != 13 ||
+                            memcmp(p + 4, "/dev/null", 9) != 0) {
+                                struct dfile *grown = realloc(diff.files,
+                                        (diff.count + 1) * sizeof(*grown));
+                                if (grown == NULL) {
+                                        fprintf(stderr, "%s\n", NO_MEMORY);
+                                        exit(MEM_EXCEEDED);
+                                }
+                                diff.files = grown;
+                                df = &diff.files[diff.count++];
+                                memset(df, 0, sizeof(*df));
+                                df->name = diff_path(p + 4, stop, git);
+                        }
+                        git = false;
+                } else if (df != NULL && stop - p >= 4 &&
+                           memcmp(p, "@@ -", 4) == 0) {
+                        char *after;
+                        strtoul(p + 4, &after, 10);
+                        oldLeft = *after == ',' ? strtoul(after + 1, NULL, 10)
+                                                : 1;
+                        const char *plus = memchr(p + 4, '+', stop - p - 4);
+                        if (plus != NULL) {
+                                size_t first = strtoul(plus + 1, &after, 10);
+                                newLeft = 1;
+                                if (*after == ',')
+                                        newLeft = strtoul(after + 1, NULL,
+                                                          10);
+                                diff_hunk(df, first, newLeft);
+                        } else {
+                                oldLeft = 0;
+                        }
+                }
+                p = eol + 1;
+        }
+
+        if (src.fd != NULL) free(text);
+        source_close(&src);
+
+        /* Files the diff adds no lines to are left out */
+        size_t kept = 0;
+        for (size_t k = 0; k < diff.count; ++k) {
+                if (diff.files[k].count > 0) diff.files[kept++] = diff.files[k];
+                else free(diff.files[k].name);
+        }
+        diff.count = kept;
+        diff.names = malloc((kept + 1) * sizeof(*diff.names));
+        if (diff.names == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        for (size_t k = 0; k < kept; ++k) diff.names[k] = diff.files[k].name;
+        diff.names[kept] = NULL;
+}
+
+static bool source_skip(struct source *src)
+{
+        struct line ln;
+
+        if (src->fd != NULL) {
+                do {
+                        if (!source_next(src, &ln)) return false;
+                } while (ln.partial);
+                return true;
+        }
+
+        const char *p = src->map + src->pos;
+        const char *end = src->map + src->mapLen;
+        if (p >= end) return false;
+
+        while (p < end && *p != '\n' && *p != '\r' && *p != NULLCHAR) ++p;
+        if (p < end) {
+                if (*p == '\r' && p + 1 < end && p[1] == '\n') ++p;
+                ++p;
+        }
+        src->pos = p - src->map;
+        return true;
+}
+
+static bool diff_next(struct source *src, const struct dfile *df,
+                      size_t *h, size_t *line, struct line *ln)
+{
+        while (*h < df->count && *line + 1 >= df->hunks[*h].last) ++*h;
+        if (*h == df->count) return false;
+
+        while (*line + 1 < df->hunks[*h].first) {
+                if (!source_skip(src)) return false;
+                ++*line;
+        }
+        if (!source_next(src, ln)) return false;
+        ++*line;
+        return true;
+}
+
+/* Exits if name can't be a socket's */
+static void unix_address(struct sockaddr_un *addr, const char *name)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        if (strlen(name) >= sizeof(addr->sun_path)) {
+                fprintf(stderr, "%s %s %s\n", BAD_ARG, name,
+                        "is too long for a socket");
+                exit(BAD_ARGS);
+        }
+        strcpy(addr->sun_path, name);
+}
+
+/* False if the other end has gone */
+static bool send_all(int fd, const char *p, size_t n)
+{
+        while (n > 0) {
+                ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent <= 0) return false;
+                p += sent;
+                n -= (size_t) sent;
+        }
+        return true;
+}
+
+static uint64_t kept_hash(const char *path, const struct len_options *opts)
+{
+        uint64_t h = content_hash(path, strlen(path));
+        return hash_mix(hash_mix(hash_mix(h, opts->max), opts->min),
+                        opts->tabWidth | (uint64_t) opts->countNewlines << 32 |
+                        (uint64_t) opts->utf8 << 33);
+}
+
+/* The rest of the kept_ functions are called with kept.lock held */
+static struct kept_file *kept_find(const char *path,
+                                   const struct len_options *opts,
+                                   uint64_t hash)
+{
+        struct kept_file *kf = kept.buckets[hash & (kept.nbuckets - 1)];
+
+        for (; kf != NULL; kf = kf->next) {
+                if (kf->hash == hash && kf->opts.max == opts->max &&
+                    kf->opts.min == opts->min &&
+                    kf->opts.tabWidth == opts->tabWidth &&
+                    kf->opts.countNewlines == opts->countNewlines &&
+                    kf->opts.utf8 == opts->utf8 &&
+                    strcmp(kf->path, path) == 0)
+                        return kf;
+        }
+        return NULL;
+}
+
+/* Grows the table of watches to hold wd */
+static struct watch *kept_watch(int wd)
+{
+        if ((size_t) wd >= kept.nwatches) {
+                size_t n = kept.nwatches ? kept.nwatches : 64;
+                while (n <= (size_t) wd) n *= 2;
+                struct watch *grown = realloc(kept.watches,
+                                              n * sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                memset(grown + kept.nwatches, 0,
+                       (n - kept.nwatches) * sizeof(*grown));
+                kept.watches = grown;
+                kept.nwatches = n;
+        }
+        return &kept.watches[wd];
+}
+
+static void kept_remove(struct kept_file *kf);
+
+/* Drops a bucket's worth of results, going round the table in turn */
+static void kept_evict(void)
+{
+        size_t mask = kept.nbuckets - 1;
+
+        while (kept.buckets[kept.evict & mask] == NULL) ++kept.evict;
+        while (kept.buckets[kept.evict & mask] != NULL)
+                kept_remove(kept.buckets[kept.evict & mask]);
+        ++kept.evict;
+}
+
+static void kept_add(struct kept_file *kf)
+{
+        if (kept.count >= DAEMON_KEEP) kept_evict();
+
+        /* Chains stay short: one file per bucket on average at most */
+        if (kept.count >= kept.nbuckets) {
+                size_t n = kept.nbuckets * 2;
+                struct kept_file **grown = calloc(n, sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                for (size_t b = 0; b < kept.nbuckets; ++b) {
+                        while (kept.buckets[b] != NULL) {
+                                struct kept_file *f = kept.buckets[b];
+                                kept.buckets[b] = f->next;
+                                f->next = grown[f->hash & (n - 1)];
+                                grown[f->hash & (n - 1)] = f;
+                        }
+                }
+                free(kept.buckets);
+                kept.buckets = grown;
+                kept.nbuckets = n;
+        }
+
+        struct kept_file **at = &kept.buckets[kf->hash & (kept.nbuckets - 1)];
+        struct watch *w = kept_watch(kf->wd);
+        kf->next = *at;
+        *at = kf;
+        kf->nextWatch = w->files;
+        w->files = kf;
+        ++kept.count;
+}
+
+static void kept_free(struct kept_file *kf)
+{
+        free(kf->path);
+        free(kf->hits);
+        free(kf);
+}
+
+/* Stops watching wd once nothing kept or being checked needs it */
+static void kept_unwatch(int wd)
+{
+        struct watch *w = &kept.watches[wd];
+
+        if (w->files != NULL || w->users > 0 || !w->watched) return;
+        w->watched = false;
+#if defined(LEN_INOTIFY)
+        inotify_rm_watch(kept.inotify, wd);
+#endif
+}
+
+static void kept_remove(struct kept_file *kf)
+{
+        struct kept_file **at = &kept.buckets[kf->hash & (kept.nbuckets - 1)];
+        while (*at != kf) at = &(*at)->next;
+        *at = kf->next;
+
+        at = &kept.watches[kf->wd].files;
+        while (*at != kf) at = &(*at)->nextWatch;
+        *at = kf->nextWatch;
+
+        --kept.count;
+        kept_unwatch(kf->wd);
+        kept_free(kf);
+}
+
+/* Whatever happened to the file under wd, its results go */
+static void kept_changed(int wd)
+{
+        if (wd < 0) return;
+
+        struct watch *w = kept_watch(wd);
+        w->changed = ++kept.serial;
+        while (w->files != NULL) kept_remove(w->files);
+}
+
+/* Events were lost, so nothing kept can be trusted */
+static void kept_forget(void)
+{
+        for (size_t b = 0; b < kept.nbuckets; ++b) {
+                while (kept.buckets[b] != NULL) {
+                        struct kept_file *kf = kept.buckets[b];
+                        kept.buckets[b] = kf->next;
+                        kept_free(kf);
+                }
+        }
+        for (size_t w = 0; w < kept.nwatches; ++w) {
+                kept.watches[w].files = NULL;
+                kept_unwatch((int) w);
+        }
+        kept.count = 0;
+        kept.forgot = ++kept.serial;
+}
+
+/* Reads every event the kernel has queued */
+static void kept_drain(void)
+{
+#if defined(LEN_INOTIFY)
+        union {
+                struct inotify_event ev;
+                char bytes[4096];
+        } buf;
+        ssize_t n;
+
+        while ((n = read(kept.inotify, &buf, sizeof(buf))) > 0) {
+                for (ssize_t at = 0; at < n; ) {
+                        struct inotify_event *ev =
+                                (struct inotify_event *) (buf.bytes + at);
+                        if (ev->mask & IN_Q_OVERFLOW) kept_forget();
+                        else kept_changed(ev->wd);
+
+                        /* The kernel has dropped the watch itself */
+                        if (ev->mask & IN_IGNORED && ev->wd >= 0)
+                                kept_watch(ev->wd)->watched = false;
+                        at += sizeof(*ev) + ev->len;
+                }
+        }
+#endif
+}
+
+static int kept_hit(void *ctx, const struct len_line *line)
+{
+        struct kept_file *kf = ctx;
+
+        if (kf->count == kf->cap) {
+                size_t cap = kf->cap ? kf->cap * 2 : 16;
+                struct hit *grown = realloc(kf->hits, cap * sizeof(*grown));
+                if (grown == NULL) {
+                        fprintf(stderr, "%s\n", NO_MEMORY);
+                        exit(MEM_EXCEEDED);
+                }
+                kf->hits = grown;
+                kf->cap = cap;
+        }
+        kf->hits[kf->count].line = line->number;
+        kf->hits[kf->count].length = line->length;
+        ++kf->count;
+        return 0;
+}
+
+static void kept_reply(struct outbuf *out, const struct kept_file *kf,
+                       bool records)
+{
+        size_t count = records ? kf->count : 0;
+
+        ob_num(out, (unsigned long) kf->status, 0);
+        ob_putc(out, ' ');
+        ob_num(out, count, 0);
+        ob_putc(out, '\n');
+        for (size_t k = 0; k < count; ++k) {
+                ob_num(out, kf->hits[k].line, 0);
+                ob_putc(out, ' ');
+                ob_num(out, kf->hits[k].length, 0);
+                ob_putc(out, '\n');
+        }
+}
+
+/* Answers for one file, from what's kept if nothing has changed */
+static void daemon_check(struct outbuf *out, const char *path,
+                         const struct len_options *opts, bool records)
+{
+        struct stat st;
+        uint64_t hash = kept_hash(path, opts);
+        uint64_t since = 0;
+        int wd = -1;
+        bool keep = kept.inotify >= 0 && stat(path, &st) == 0 &&
+                    S_ISREG(st.st_mode);
+
+        if (keep) {
+                pthread_mutex_lock(&kept.lock);
+                kept_drain();
+                struct kept_file *found = kept_find(path, opts, hash);
+
+                /* The path may have been moved onto another file */
+                if (found != NULL && found->dev == (uint64_t) st.st_dev &&
+                    found->ino == (uint64_t) st.st_ino) {
+                        kept_reply(out, found, records);
+                        pthread_mutex_unlock(&kept.lock);
+                        return;
+                }
+                since = kept.serial;
+
+                /* Watched before it's read, so a change while it's read */
+                /* counts. The watch stays until this check is done.     */
+#if defined(LEN_INOTIFY)
+                wd = inotify_add_watch(kept.inotify, path, KEPT_EVENTS);
+#endif
+                if (wd >= 0) {
+                        struct watch *w = kept_watch(wd);
+                        ++w->users;
+                        w->watched = true;
+                }
+                pthread_mutex_unlock(&kept.lock);
+        }
+
+        struct kept_file *kf = calloc(1, sizeof(*kf));
+        if (kf == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        kf->opts = *opts;
+        kf->hash = hash;
+        kf->wd = wd;
+
+        int fd = path[0] == '/' ? open(path, O_RDONLY) : -1;
+        int verdict = LEN_EIO;
+        keep = keep && wd >= 0;
+        if (fd >= 0) {
+                keep = keep && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+                kf->dev = (uint64_t) st.st_dev;
+                kf->ino = (uint64_t) st.st_ino;
+                verdict = len_check_fd(opts, fd, kept_hit, kf);
+                close(fd);
+        }
+        kf->status = verdict < 0 ? 2 : verdict;
+        kept_reply(out, kf, records);
+
+        if (wd >= 0) {
+                pthread_mutex_lock(&kept.lock);
+                kept_drain();
+                struct watch *w = kept_watch(wd);
+                --w->users;
+                if (keep && verdict >= 0 && w->changed <= since &&
+                    kept.forgot <= since) {
+                        struct kept_file *old = kept_find(path, opts, hash);
+                        if (old != NULL) kept_remove(old);
+                        kf->path = strdup(path);
+                        if (kf->path == NULL) {
+                                fprintf(stderr, "%s\n", NO_MEMORY);
+                                exit(MEM_EXCEEDED);
+                        }
+                        kept_add(kf);
+                        kf = NULL;
+                }
+                kept_unwatch(wd);
+                pthread_mutex_unlock(&kept.lock);
+        }
+        if (kf != NULL) kept_free(kf);
+}
+
+/* Reads a request and answers it whole. Clients that send anything */
+/* else are hung up on.                                             */
+static void daemon_serve(int fd)
+{
+        FILE *from = fdopen(fd, "r");
+        char *field = NULL;
+        size_t cap = 0;
+        struct len_options opts;
+        unsigned countNewlines, wide, records;
+        unsigned long count;
+        struct outbuf out;
+
+        if (from == NULL) {
+                close(fd);
+                return;
+        }
+        ob_init(&out, NULL);
+
+        bool ok = getdelim(&field, &cap, NULLCHAR, from) > 0 &&
+                  strcmp(field, DAEMON_MAGIC) == 0 &&
+                  getdelim(&field, &cap, NULLCHAR, from) > 0 &&
+                  sscanf(field, "%u %u %u %u %u %u %lu", &opts.max,
+                         &opts.min, &opts.tabWidth, &countNewlines, &wide,
+                         &records, &count) == 7 &&
+                  opts.tabWidth > 0 && opts.max >= opts.min;
+        opts.countNewlines = countNewlines;
+        opts.utf8 = wide;
+
+        for (; ok && count > 0; --count) {
+                ok = getdelim(&field, &cap, NULLCHAR, from) > 0;
+                if (ok) daemon_check(&out, field, &opts, records);
+        }
+        if (ok) send_all(fd, out.data, out.len);
+
+        free(field);
+        free(out.data);
+        fclose(from);
+}
+
+static void *daemon_worker(void *arg)
+{
+        struct timeval idle = { DAEMON_TIMEOUT, 0 };
+
+        (void) arg;
+        for (;;) {
+                int fd = accept(kept.sock, NULL, NULL);
+                if (fd >= 0) {
+                        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle,
+                                   sizeof(idle));
+                        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle,
+                                   sizeof(idle));
+                        daemon_serve(fd);
+                } else if (errno != EINTR && errno != ECONNABORTED) {
+                        /* Out of descriptors, most likely: wait for */
+                        /* some to be closed rather than spin        */
+                        poll(NULL, 0, DAEMON_BACKOFF);
+                }
+        }
+        return NULL;
+}
+
+/* True if a daemon answers on the socket at addr */
+static bool daemon_alive(const struct sockaddr_un *addr)
+{
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool alive = fd >= 0 && connect(fd, (const struct sockaddr *) addr,
+                                        sizeof(*addr)) == 0;
+        if (fd >= 0) close(fd);
+        return alive;
+}
+
+static void daemon_run(const char *name, int count)
+{
+        struct sockaddr_un addr;
+
+        if (count > 0) {
+                fprintf(stderr, "%s %s\n", NO_COMBINE,
+                        "--daemon with file names");
+                exit(BAD_ARGS);
+        }
+        unix_address(&addr, name);
+
+        /* A socket left behind by a daemon that has gone is replaced. */
+        /* Only the owner may connect to it.                           */
+        mode_t mask = umask(0177);
+        kept.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool bound = kept.sock >= 0 && bind(kept.sock,
+                     (struct sockaddr *) &addr, sizeof(addr)) == 0;
+        if (!bound && kept.sock >= 0 && errno == EADDRINUSE &&
+            !daemon_alive(&addr)) {
+                unlink(name);
+                bound = bind(kept.sock, (struct sockaddr *) &addr,
+                             sizeof(addr)) == 0;
+        }
+        umask(mask);
+        if (!bound || listen(kept.sock, SOMAXCONN) != 0) {
+                fprintf(stderr, "%s %s\n", "Could not listen on", name);
+                exit(BAD_FILE);
+        }
+
+        /* Without inotify every request is checked afresh */
+        kept.inotify = -1;
+#if defined(LEN_INOTIFY)
+        kept.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        pthread_mutex_init(&kept.lock, NULL);
+        kept.nbuckets = DAEMON_BUCKETS;
+        kept.buckets = calloc(kept.nbuckets, sizeof(*kept.buckets));
+        if (kept.buckets == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+
+        /* One thread per CPU, unless -j asks for more than one */
+        unsigned threads = jobs;
+        if (threads <= 1) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cpus > 0 ? (unsigned) cpus : 1;
+        }
+        for (unsigned t = 1; t < threads; ++t) {
+                pthread_t tid;
+                if (pthread_create(&tid, NULL, daemon_worker, NULL)) break;
+                pthread_detach(tid);
+        }
+        daemon_worker(NULL);
+        exit(EXIT_SUCCESS);
+}
+
+/* Reads a reply line of two numbers */
+static bool client_line(FILE *from, char **line, size_t *cap,
+                        unsigned long *a, unsigned long *b)
+{
+        char *end;
+
+        if (getline(line, cap, from) <= 0 || !isdigit(**line)) return false;
+        *a = strtoul(*line, &end, 10);
+        if (*end != ' ' || !isdigit(end[1])) return false;
+        *b = strtoul(end + 1, &end, 10);
+        return *end == '\n';
+}
+
+static void client_run(const char *name, char **names, int count)
+{
+        struct sockaddr_un addr;
+        struct outbuf req;
+        char *line = NULL;
+        size_t cap = 0;
+        unsigned long status, hits;
+        bool violated = false;
+
+        if (count < 1) {
+                fprintf(stderr, "%s\n", NO_FILE);
+                exit(BAD_FILE);
+        }
+        for (int k = 0; k < count; ++k) {
+                if (names[k][0] == READ_STDIN && names[k][1] == NULLCHAR) {
+                        fprintf(stderr, "%s %s\n", NO_COMBINE,
+                                "--client with -");
+                        exit(BAD_ARGS);
+                }
+        }
+        unix_address(&addr, name);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+                close(fd);
+                return;
+        }
+
+        /* Lengths in the units -m and -M were given in, as for -l */
+        ob_init(&req, NULL);
+        ob_write(&req, DAEMON_MAGIC, sizeof(DAEMON_MAGIC));
+        ob_num(&req, newlines ? maxLen : maxLen - 1, 0);
+        ob_putc(&req, ' ');
+        ob_num(&req, newlines ? minLen : minLen - 1, 0);
+        ob_putc(&req, ' ');
+        ob_num(&req, tabWidth, 0);
+        ob_write(&req, newlines ? " 1" : " 0", 2);
+        ob_write(&req, utf8 ? " 1" : " 0", 2);
+        ob_write(&req, PRINTING ? " 1 " : " 0 ", 3);
+        ob_num(&req, (unsigned long) count, 0);
+        ob_putc(&req, NULLCHAR);
+
+        /* The daemon has its own working directory. Files that can't be */
+        /* found get an empty path, which it can't read either.          */
+        for (int k = 0; k < count; ++k) {
+                char *real = realpath(names[k], NULL);
+                if (real != NULL) ob_write(&req, real, strlen(real));
+                ob_putc(&req, NULLCHAR);
+                free(real);
+        }
+        bool sent = send_all(fd, req.data, req.len);
+        free(req.data);
+        shutdown(fd, SHUT_WR);
+
+        FILE *from = fdopen(fd, "r");
+        if (from == NULL) {
+                close(fd);
+                return;
+        }
+
+        /* Hung up on before answering: no harm done yet */
+        if (!sent || !client_line(from, &line, &cap, &status, &hits)) {
+                free(line);
+                fclose(from);
+                return;
+        }
+
+        struct outbuf out;
+        ob_init(&out, stdout);
+        format_open(&out);
+
+        for (int k = 0; k < count; ++k) {
+                struct job job;
+                bool lost = k > 0 &&
+                            !client_line(from, &line, &cap, &status, &hits);
+
+                if (!lost && status == 2) {
+                        ob_flush(&out);
+                        fprintf(stderr, "%s %s %s\n", "Could not open file",
+                                                      names[k], "for reading");
+                        exit(BAD_FILE);
+                }
+
+                memset(&job, 0, sizeof(job));
+                job.name = names[k];
+                job.number = k + 1;
+                job.out = &out;
+                job.headerAt = -1;
+                for (unsigned long h = 0; !lost && h < hits; ++h) {
+                        unsigned long at, length;
+                        lost = !client_line(from, &line, &cap, &at, &length);
+                        if (lost || !PRINTING) continue;
+                        if (h == 0) print_header(&out, &job);
+                        print_record(&out, &job, at,
+                                     newlines ? length : length + 1);
+                }
+
+                if (lost) {
+                        ob_flush(&out);
+                        fprintf(stderr, "%s %s\n", "Lost the daemon at",
+                                name);
+                        exit(BAD_FILE);
+                }
+                if (hits > 0 && PRINTING) print_footer(&out);
+                if (status == 1) violated = true;
+        }
+
+        format_close(&out);
+        ob_flush(&out);
+        free(out.data);
+        free(line);
+        fclose(from);
+        exit(violated ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static COLOR_T strtocolor(char *str)
+{
+        if (str == NULL) return def_str;
+
+        if      (strcmp(str, red_str) == 0)     return red;
+        else if (strcmp(str, green_str) == 0)   return green;
+        else if (strcmp(str, yellow_str) == 0)  return yellow;
+        else if (strcmp(str, blue_str) == 0)    return blue;
+        else if (strcmp(str, magenta_str) == 0) return magenta;
+        else if (strcmp(str, cyan_str) == 0)    return cyan;
+        else if (strcmp(str, white_str) == 0)   return white;
+        else if (strcmp(str, def_str) == 0)     return def;
+        else return def;
+}
+
+/* Regular files are mapped whole. Anything else, or anything mmap() */
+/* refuses, is read through stdio instead.                            */
+static bool source_open(struct source *src, const char *name)
+{
+        src->fd = NULL;
+        src->map = NULL;
+        src->mapLen = 0;
+        src->pos = 0;
+        src->borrowed = false;
+        src->have = 0;
+        src->eof = false;
+        src->skipLF = false;
+        src->inLine = false;
+        src->col = 0;
+        src->unpack = NULL;
+        src->headLen = 0;
+        source_measure(src, tabWidth, utf8);
+
+        if (name[0] == READ_STDIN) {
+                if (name[1] != NULLCHAR) return false;
+                src->fd = stdin;
+                return source_sniff(src) || source_failed(src);
+        }
+
+        int fdno = open(name, O_RDONLY);
+        if (fdno < 0) return false;
+        return source_fd(src, fdno) || source_failed(src);
+}
+
+/* Says why a stream couldn't be read, from what unpack_start() left */
+/* in errno. Exits if memory ran out; otherwise false.               */
+static bool source_failed(const struct source *src)
+{
+        if (errno == ENOMEM) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        if (errno == ENOSYS) {
+                fprintf(stderr, "%s %s %s\n", "Unable to load",
+                        codec_of(src->head, src->headLen) == CODEC_GZIP ?
+                        "libz.so.1" : "libzstd.so.1", "to decompress");
+        }
+        return false;
+}
+#endif
+
+static bool source_fd(struct source *src, int fdno)
+{
+        struct stat st;
+        if (fstat(fdno, &st) == 0 && S_ISREG(st.st_mode) &&
+            (unsigned long long) st.st_size <= SIZE_MAX) {
+                /* Nothing to map, and mmap() rejects zero lengths */
+                if (st.st_size == 0) {
+                        close(fdno);
+                        return true;
+                }
+
+                void *map = mmap(NULL, (size_t) st.st_size, PROT_READ,
+                                 MAP_PRIVATE, fdno, 0);
+
+                /* Compressed files are streamed through a decompressor */
+                if (map != MAP_FAILED &&
+                    codec_of(map, (size_t) st.st_size) != CODEC_NONE) {
+                        munmap(map, (size_t) st.st_size);
+                        map = MAP_FAILED;
+                }
+                if (map != MAP_FAILED) {
+                        posix_madvise(map, (size_t) st.st_size,
+                                      POSIX_MADV_SEQUENTIAL);
+                        close(fdno);
+                        src->map = map;
+                        src->mapLen = (size_t) st.st_size;
+                        return true;
+                }
+        }
+
+        src->fd = fdopen(fdno, "r");
+        if (src->fd == NULL) {
+                close(fdno);
+                return false;
+        }
+        return source_sniff(src);
+}
+
+/* Streams are read a little way into to see if they're compressed. */
+/* Either way, what was read is handed out again first. That's read */
+/* past stdio, so nothing is left in its buffer for a thread that   */
+/* reads the descriptor.                                             */
+static bool source_sniff(struct source *src)
+{
+        int fdno = fileno(src->fd);
+        ssize_t got = 1;
+
+        src->headLen = 0;
+        while (src->headLen < sizeof(src->head) && got > 0) {
+                got = fd_read(fdno, src->head + src->headLen,
+                              sizeof(src->head) - src->headLen);
+                if (got > 0) src->headLen += (size_t) got;
+        }
+
+        enum codec codec = codec_of(src->head, src->headLen);
+        if (codec == CODEC_NONE && (src->fd != stdin || !pipeStdin))
+                return true;
+
+        /* On failure head is left, to tell what it was */
+        src->unpack = unpack_start(src->fd, codec, src->head, src->headLen);
+        if (src->unpack == NULL) return false;
+        src->headLen = 0;
+        return true;
+}
+
+static size_t source_read(struct source *src, char *p, size_t n)
+{
+        size_t got = n < src->headLen ? n : src->headLen;
+
+        memcpy(p, src->head, got);
+        memmove(src->head, src->head + got, src->headLen - got);
+        src->headLen -= got;
+        if (got == n) return got;
+
+        if (src->unpack != NULL)
+                return got + unpack_read(src->unpack, p + got, n - got);
+        return got + fread(p + got, 1, n - got, src->fd);
+}
+
+/* Finds where a line ends, adding its columns to *cols. Stretches of */
+/* plain text are skipped over 16 bytes at a time.                    */
+inline static const char *line_kernel(const char *p, const char *end,
+                                      size_t *cols, size_t tabs, bool wide,
+                                      bool pow2)
+{
+        size_t col = *cols;
+
+        while (p < end) {
+                size_t run = text_run(p, end, wide);
+                p += run;
+                col += run;
+                if (p == end) break;
+
+                unsigned char c = *p;
+                if (c == '\n' || c == '\r' || c == NULLCHAR) break;
+                if (c == TAB) {
+                        col = tab_next(col, tabs, pow2);
+                        ++p;
+                } else {
+                        size_t width;
+                        p += utf8_char(p, end, &width);
+                        col += width;
+                }
+        }
+        *cols = col;
+        return p;
+}
+
+static const char *line_plain(const char *p, const char *end, size_t *cols,
+                              size_t tabs)
+{
+        return line_kernel(p, end, cols, tabs, false, false);
+}
+
+static const char *line_plain_pow2(const char *p, const char *end,
+                                   size_t *cols, size_t tabs)
+{
+        return line_kernel(p, end, cols, tabs, false, true);
+}
+
+static const char *line_utf8(const char *p, const char *end, size_t *cols,
+                             size_t tabs)
+{
+        return line_kernel(p, end, cols, tabs, true, false);
+}
+
+static const char *line_utf8_pow2(const char *p, const char *end,
+                                  size_t *cols, size_t tabs)
+{
+        return line_kernel(p, end, cols, tabs, true, true);
+}
+
+static const line_fn LINE_KERNELS[KERNEL_SETS] = {
+        line_plain, line_utf8, line_plain_pow2, line_utf8_pow2,
+};
+
+/* How much of n bytes can go without splitting a character at the end. */
+/* Only a lead byte with too few bytes after it is held back; anything  */
+/* utf8_char() wouldn't decode as one is a column of its own anyway.    */
+static size_t utf8_cut(const char *p, size_t n)
+{
+        for (size_t k = 1; k <= 3 && k <= n; ++k) {
+                unsigned char c = p[n - k];
+                if ((c & 0xC0) == 0x80) continue;
+
+                size_t need = c < 0xC2 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 :
+                              c < 0xF5 ? 4 : 1;
+                return need > k ? n - k : n;
+        }
+        return n;
+}
+
+/* Streams get their window once, the first time it's needed */
+static void source_buffer(struct source *src)
+{
+        if (src->size >= SCAN_BLOCK) return;
+
+        char *grown = realloc(src->buf, SCAN_BLOCK);
+        if (grown == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        src->buf = grown;
+        src->size = SCAN_BLOCK;
+}
+
+/* Moves what's left in the window to its front and reads in behind it */
+static void source_fill(struct source *src)
+{
+        size_t left = src->have - src->pos;
+
+        memmove(src->buf, src->buf + src->pos, left);
+        src->pos = 0;
+        src->have = left;
+
+        size_t want = src->size - left;
+        size_t got = source_read(src, src->buf + left, want);
+        if (got == 0) src->eof = true;
+        src->have += got;
+        if (src->stats != NULL) src->stats->bytes += got;
+}
+
+/* Streams hand out lines from the window. A line that won't fit in it */
+/* comes out as pieces, each as much of the window as holds whole      */
+/* characters, with partial set on all but the last. The last may be   */
+/* empty.                                                              */
+static bool source_stream(struct source *src, struct line *ln)
+{
+        source_buffer(src);
+
+        for (;;) {
+                if (src->pos == src->have && !src->eof) source_fill(src);
+
+                /* The \n of a \r\n the last window ended between */
+                if (src->skipLF && src->pos < src->have) {
+                        src->skipLF = false;
+                        if (src->buf[src->pos] == '\n') ++src->pos;
+                        continue;
+                }
+
+                const char *start = src->buf + src->pos;
+                const char *end = src->buf + src->have;
+                size_t col = src->col;
+                const char *p = src->line(start, end, &col, src->tabs);
+
+                if (p < end) {
+                        ln->text = start;
+                        ln->bytes = p - start;
+                        ln->len = col + 1;
+                        ln->partial = false;
+
+                        if (*p == '\r') {
+                                if (p + 1 == end) src->skipLF = true;
+                                else if (p[1] == '\n') ++p;
+                        }
+                        src->pos = p + 1 - src->buf;
+                        src->inLine = false;
+                        src->col = 0;
+                        return true;
+                }
+
+                /* Room for more of the line, so go get it */
+                if (!src->eof && (src->pos > 0 || src->have < src->size)) {
+                        source_fill(src);
+                        continue;
+                }
+
+                size_t n = end - start;
+                if (src->eof) {
+                        /* A last line without a newline */
+                        if (n == 0 && !src->inLine) return false;
+                        ln->partial = false;
+                        src->inLine = false;
+                        src->col = 0;
+                } else {
+                        size_t cut = src->wide ? utf8_cut(start, n) : n;
+                        if (cut < n) {
+                                col = src->col;
+                                src->line(start, start + cut, &col,
+                                          src->tabs);
+                                n = cut;
                         }
+                        ln->partial = true;
+                        src->inLine = true;
+                        src->col = col;
+                }
+                ln->text = start;
+                ln->bytes = n;
+                ln->len = col + 1;
+                src->pos += n;
+                return true;
+        }
+}
+
+/* Hands out the next line, or returns false at the end of input. \n, \r, */
+/* \r\n and NUL all end a line, and a final line without a newline is    */
+/* counted as if it had one.                                             */
+static bool source_next(struct source *src, struct line *ln)
+{
+        if (src->fd != NULL) return source_stream(src, ln);
+
+        const char *start = src->map + src->pos;
+        const char *end = src->map + src->mapLen;
+        if (start >= end) return false;
+
+        size_t col = 0;
+        const char *p = src->line(start, end, &col, src->tabs);
+
+        ln->text = start;
+        ln->bytes = p - start;
+        ln->len = col + 1;
+        ln->partial = false;
+
+        if (p < end) {
+                if (*p == '\r' && p + 1 < end && p[1] == '\n') ++p;
+                ++p;
+        }
+        src->pos = p - src->map;
+        return true;
+}
+
+/* Reads lines out of part of a mapping that stays owned by the caller */
+static void source_range(struct source *src, const char *p, size_t n)
+{
+        src->fd = NULL;
+        src->map = p;
+        src->mapLen = n;
+        src->pos = 0;
+        src->borrowed = true;
+        source_measure(src, tabWidth, utf8);
+}
+
+static void source_measure(struct source *src, size_t tabs, bool wide)
+{
+        src->line = LINE_KERNELS[kernel_set(tabs, wide)];
+        src->tabs = tabs;
+        src->wide = wide;
+}
+
+static bool source_broken(const struct source *src)
+{
+        return src->unpack != NULL && unpack_broken(src->unpack);
+}
+
+static void source_close(struct source *src)
+{
+        /* Before the stream it reads from goes */
+        if (src->unpack != NULL) unpack_stop(src->unpack);
+        src->unpack = NULL;
+        src->headLen = 0;
+
+        if (src->borrowed) src->borrowed = false;
+        else if (src->map != NULL) munmap((void *) src->map, src->mapLen);
+        else if (src->fd != NULL && src->fd != stdin) fclose(src->fd);
+        src->map = NULL;
+        src->fd = NULL;
+}
+
+/* zlib's z_stream and the part of libzstd's streaming API used here, */
+/* as their headers declare them. Neither has changed in many years.  */
+struct zlib_stream {
+        const unsigned char *next_in;
+        unsigned        avail_in;
+        unsigned long   total_in;
+        unsigned char   *next_out;
+        unsigned        avail_out;
+        unsigned long   total_out;
+        const char      *msg;
+        void            *state;
+        void            *(*zalloc)(void *, unsigned, unsigned);
+        void            (*zfree)(void *, void *);
+        void            *opaque;
+        int             data_type;
+        unsigned long   adler;
+        unsigned long   reserved;
+};
+
+#define Z_OK            0
+#define Z_STREAM_END    1
+#define Z_NO_FLUSH      0
+#define Z_GZIP_AUTO     (15 + 32)       /* Largest window, any header    */
+
+struct zstd_in {
+        const void      *src;
+        size_t          size;
+        size_t          pos;
+};
+
+struct zstd_out {
+        void            *dst;
+        size_t          size;
+        size_t          pos;
+};
+
+static pthread_once_t codecsOnce = PTHREAD_ONCE_INIT;
+
+static struct {
+        int     (*inflateInit2_)(struct zlib_stream *z, int bits,
+                                 const char *version, int size);
+        int     (*inflate)(struct zlib_stream *z, int flush);
+        int     (*inflateReset)(struct zlib_stream *z);
+        int     (*inflateEnd)(struct zlib_stream *z);
+        void    *(*createDStream)(void);
+        size_t  (*freeDStream)(void *ds);
+        size_t  (*decompressStream)(void *ds, struct zstd_out *out,
+                                    struct zstd_in *in);
+        unsigned (*isError)(size_t code);
+        bool    gzip;                   /* Which of them loaded          */
+        bool    zstd;
+} codecs;
+
+struct unpack {
+        FILE            *in;
+        int             fdno;           /* in's, read directly           */
+        enum codec      codec;
+        pthread_t       tid;
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+
+        /* Shared, under lock */
+        char            *bufs[UNPACK_RING];
+        size_t          lens[UNPACK_RING];
+        bool            full[UNPACK_RING];
+        bool            done;           /* Nothing more will be filled   */
+        bool            closing;        /* The reader has gone           */
+        int             queued;         /* Buffers full                  */
+        int             users;          /* The last of the two frees it  */
+
+        /* The reader's */
+        int             reading;
+        size_t          pos;
+
+        /* The thread's, until done */
+        unsigned char   *input;
+        size_t          inLen;
+        size_t          inPos;
+        bool            inEnd;
+        bool            broken;
+        bool            member;         /* A whole gzip member was read  */
+        struct zlib_stream z;
+        void            *ds;
+        size_t          zstdLeft;       /* Nonzero: a frame isn't over   */
+};
 
+static enum codec codec_of(const char *p, size_t n)
+{
+        /* Magic, then deflate, the only method gzip has */
+        if (n >= 3 && memcmp(p, "\x1f\x8b\x08", 3) == 0) return CODEC_GZIP;
+        if (n >= 4 && memcmp(p, "\x28\xb5\x2f\xfd", 4) == 0)
+                return CODEC_ZSTD;
+        return CODEC_NONE;
+}
+
+/* dlsym() hands back functions as object pointers */
+static bool codec_sym(void *lib, const char *name, void *fn)
+{
+        void *sym = lib != NULL ? dlsym(lib, name) : NULL;
+        memcpy(fn, &sym, sizeof(sym));
+        return sym != NULL;
+}
+
+static void codecs_load(void)
+{
+        void *z = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+        codecs.gzip = codec_sym(z, "inflateInit2_", &codecs.inflateInit2_) &&
+                      codec_sym(z, "inflate", &codecs.inflate) &&
+                      codec_sym(z, "inflateReset", &codecs.inflateReset) &&
+                      codec_sym(z, "inflateEnd", &codecs.inflateEnd);
+
+        void *zs = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        codecs.zstd = codec_sym(zs, "ZSTD_createDStream",
+                                &codecs.createDStream) &&
+                      codec_sym(zs, "ZSTD_freeDStream",
+                                &codecs.freeDStream) &&
+                      codec_sym(zs, "ZSTD_decompressStream",
+                                &codecs.decompressStream) &&
+                      codec_sym(zs, "ZSTD_isError", &codecs.isError);
+}
+
+static ssize_t fd_read(int fdno, char *p, size_t n)
+{
+        ssize_t got;
+
+        do got = read(fdno, p, n);
+        while (got < 0 && errno == EINTR);
+        return got;
+}
+
+/* Tops up the input. False if there's none left. */
+static bool unpack_input(struct unpack *u)
+{
+        if (u->inPos < u->inLen) return true;
+        if (u->inEnd) return false;
+
+        ssize_t got = fd_read(u->fdno, (char *) u->input, UNPACK_INPUT);
+        u->inLen = got > 0 ? (size_t) got : 0;
+        u->inPos = 0;
+        if (got <= 0) u->inEnd = true;
+        return u->inLen > 0;
+}
+
+/* Reads until need bytes are in hand, or the input runs out */
+static void unpack_gather(struct unpack *u, size_t need)
+{
+        if (u->inLen - u->inPos >= need || u->inEnd) return;
+
+        memmove(u->input, u->input + u->inPos, u->inLen - u->inPos);
+        u->inLen -= u->inPos;
+        u->inPos = 0;
+        while (u->inLen < need && !u->inEnd) {
+                ssize_t got = fd_read(u->fdno, (char *) u->input + u->inLen,
+                                      UNPACK_INPUT - u->inLen);
+                if (got <= 0) u->inEnd = true;
+                else u->inLen += (size_t) got;
+        }
+}
+
+/* True if a read() of fdno would return at once */
+static bool fd_ready(int fdno)
+{
+        struct pollfd pfd = { fdno, POLLIN, 0 };
+        int rc;
+
+        do rc = poll(&pfd, 1, 0);
+        while (rc < 0 && errno == EINTR);
+        return rc != 0;
+}
+
+/* Plain input is handed on as soon as the reader runs out, and in */
+/* whole blocks while it keeps up. Nothing already read is held    */
+/* back waiting on more: the reader could need it to end a line.   */
+static size_t unpack_copy(struct unpack *u, char *out, size_t cap,
+                          bool *end)
+{
+        /* What was read to tell it wasn't compressed goes first */
+        size_t n = u->inLen - u->inPos;
+        memcpy(out, u->input + u->inPos, n);
+        u->inPos = u->inLen;
+
+        while (n < cap) {
+                if (n > 0 && !fd_ready(u->fdno)) break;
+
+                ssize_t got = fd_read(u->fdno, out + n, cap - n);
+                if (got <= 0) {
+                        *end = true;
+                        break;
+                }
+                n += (size_t) got;
+                if (__atomic_load_n(&u->queued, __ATOMIC_RELAXED) == 0)
+                        break;
+        }
+        return n;
+}
+
+/* Decompresses up to cap bytes into out. Sets *end at the end of the */
+/* input, and u->broken as well if it ended badly.                    */
+static size_t unpack_fill(struct unpack *u, char *out, size_t cap,
+                          bool *end)
+{
+        size_t n = 0;
+
+        if (u->codec == CODEC_NONE) return unpack_copy(u, out, cap, end);
+        while (n < cap) {
+                if (!unpack_input(u)) {
+                        /* Cut off partway through */
+                        if (u->codec == CODEC_GZIP ? u->z.state != NULL :
+                                                     u->zstdLeft != 0)
+                                u->broken = true;
+                        *end = true;
+                        return n;
+                }
+
+                if (u->codec == CODEC_ZSTD) {
+                        struct zstd_in in = { u->input, u->inLen, u->inPos };
+                        struct zstd_out to = { out, cap, n };
+                        size_t left = codecs.decompressStream(u->ds, &to,
+                                                              &in);
+                        if (codecs.isError(left)) break;
+                        u->zstdLeft = left;
+                        u->inPos = in.pos;
+                        n = to.pos;
+                        continue;
+                }
+
+                /* A finished gzip member may be followed by another. */
+                /* Anything else, even too little to be one, is      */
+                /* trailing bytes, as gzip -d ignores.               */
+                if (u->z.state == NULL && u->member) {
+                        unpack_gather(u, GZIP_HEADER);
+                        size_t left = u->inLen - u->inPos;
+                        if (left < GZIP_HEADER ||
+                            codec_of((char *) u->input + u->inPos,
+                                     left) != CODEC_GZIP) {
+                                *end = true;
+                                return n;
                         }
-                } else break;
+                }
+                if (u->z.state == NULL) {
+                        if (codecs.inflateInit2_(&u->z, Z_GZIP_AUTO, "1",
+                                                 (int) sizeof(u->z)) != Z_OK)
+                                break;
+                }
+                u->z.next_in = u->input + u->inPos;
+                u->z.avail_in = (unsigned) (u->inLen - u->inPos);
+                u->z.next_out = (unsigned char *) out + n;
+                u->z.avail_out = (unsigned) (cap - n);
+                int rc = codecs.inflate(&u->z, Z_NO_FLUSH);
+                u->inPos = u->inLen - u->z.avail_in;
+                n = cap - u->z.avail_out;
+                if (rc == Z_STREAM_END) {
+                        codecs.inflateEnd(&u->z);
+                        u->z.state = NULL;
+                        u->member = true;
+                } else if (rc != Z_OK) {
+                        break;
+                }
         }
-        return i;
+        if (n < cap) {
+                u->broken = true;
+                *end = true;
+        }
+        return n;
 }
 
- /* Print all flags to check if they're set correctly */
-inline static void print_flags(int i, int argc)
+static void unpack_free(struct unpack *u)
 {
-        fprintf(stderr, "argc: [%d], option groups specified:[%d]\n", argc, i);
-        fprintf(stderr, "%s: %lu\n", "maxLen", (unsigned long) maxLen);
-        fprintf(stderr, "%s: %lu\n", "minLen", (unsigned long) minLen);
-        fprintf(stderr, "%s: %lu\n", "tabWidth", (unsigned long) tabWidth);
-        fprintf(stderr, "%s: %s\n", "print", print ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "printAll", printAll ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "offenders",
-                                    offenders ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "matches", !offenders ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "lineNums", lineNums ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "color", color ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "lineLengths",
-                                    lineLengths ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "count newlines?",
-                                    newlines ? "true" : "false");
-        fprintf(stderr, "%s: %s\n", "alternate", alternate ? "true" : "false");
+        if (u->z.state != NULL) codecs.inflateEnd(&u->z);
+        if (u->ds != NULL) codecs.freeDStream(u->ds);
+        pthread_mutex_destroy(&u->lock);
+        pthread_cond_destroy(&u->cond);
+        free(u->bufs[0]);
+        free(u);
 }
 
-static const char *ESC = "\033[";
-static const char *INV = "\033[1;7;";
+/* True if the caller was the last user, and should free u */
+static bool unpack_leave(struct unpack *u)
+{
+        pthread_mutex_lock(&u->lock);
+        bool last = --u->users == 0;
+        pthread_mutex_unlock(&u->lock);
+        return last;
+}
 
-inline static void term_default()
+static void *unpack_worker(void *arg)
 {
-        printf("%s0m", ESC);
+        struct unpack *u = arg;
+        bool end = false;
+
+        for (int k = 0; !end; k = (k + 1) % UNPACK_RING) {
+                pthread_mutex_lock(&u->lock);
+                while (u->full[k] && !u->closing)
+                        pthread_cond_wait(&u->cond, &u->lock);
+                bool closing = u->closing;
+                pthread_mutex_unlock(&u->lock);
+                if (closing) break;
+
+                size_t n = unpack_fill(u, u->bufs[k], UNPACK_BLOCK, &end);
+
+                pthread_mutex_lock(&u->lock);
+                u->lens[k] = n;
+                u->full[k] = n > 0;
+                if (n > 0)
+                        __atomic_fetch_add(&u->queued, 1, __ATOMIC_RELAXED);
+                u->done = end;
+                pthread_cond_broadcast(&u->cond);
+                pthread_mutex_unlock(&u->lock);
+        }
+
+        /* Left to itself on stdin, which may never say any more */
+        if (unpack_leave(u)) unpack_free(u);
+        return NULL;
 }
 
-inline static void term_color(bool isGood)
+static struct unpack *unpack_start(FILE *in, enum codec codec,
+                                   const char *head, size_t n)
 {
-        fprintf(stdout, "%s%sm", inverted ? INV : ESC,
-                                 isGood ? good_color : bad_color);
+        pthread_once(&codecsOnce, codecs_load);
+        if (codec != CODEC_NONE &&
+            (codec == CODEC_GZIP ? !codecs.gzip : !codecs.zstd)) {
+                errno = ENOSYS;
+                return NULL;
+        }
+
+        struct unpack *u = calloc(1, sizeof(*u));
+        char *bufs = malloc(UNPACK_RING * UNPACK_BLOCK + UNPACK_INPUT);
+        if (u == NULL || bufs == NULL) {
+                free(u);
+                free(bufs);
+                errno = ENOMEM;
+                return NULL;
+        }
+        u->in = in;
+        u->fdno = fileno(in);
+        u->codec = codec;
+        for (int k = 0; k < UNPACK_RING; ++k)
+                u->bufs[k] = bufs + k * UNPACK_BLOCK;
+        u->input = (unsigned char *) bufs + UNPACK_RING * UNPACK_BLOCK;
+        u->users = 2;
+        memcpy(u->input, head, n);
+        u->inLen = n;
+        pthread_mutex_init(&u->lock, NULL);
+        pthread_cond_init(&u->cond, NULL);
+        if (codec == CODEC_ZSTD) u->ds = codecs.createDStream();
+        if ((codec == CODEC_ZSTD && u->ds == NULL) ||
+            pthread_create(&u->tid, NULL, unpack_worker, u)) {
+                unpack_free(u);
+                errno = ENOMEM;
+                return NULL;
+        }
+        return u;
 }
 
-inline static void term_file()
+/* Waits only until there's something to hand out */
+static size_t unpack_read(struct unpack *u, char *p, size_t n)
 {
-    static bool alt = false;
-    if (color) {
-        fprintf(stdout, "%s%sm", inverted ? INV : ESC,
-                                 alt ? file_color : file_alt);
-    }
-    if (alternate) alt = !alt;
+        size_t got = 0;
+
+        pthread_mutex_lock(&u->lock);
+        while (got < n) {
+                int k = u->reading;
+                while (!u->full[k] && !u->done && got == 0)
+                        pthread_cond_wait(&u->cond, &u->lock);
+                if (!u->full[k]) break;
+                pthread_mutex_unlock(&u->lock);
+
+                size_t take = u->lens[k] - u->pos;
+                if (take > n - got) take = n - got;
+                memcpy(p + got, u->bufs[k] + u->pos, take);
+                got += take;
+                u->pos += take;
+
+                pthread_mutex_lock(&u->lock);
+                if (u->pos == u->lens[k]) {
+                        u->full[k] = false;
+                        __atomic_fetch_sub(&u->queued, 1, __ATOMIC_RELAXED);
+                        u->pos = 0;
+                        u->reading = (k + 1) % UNPACK_RING;
+                        pthread_cond_broadcast(&u->cond);
+                }
+        }
+        pthread_mutex_unlock(&u->lock);
+        return got;
 }
 
-static COLOR_T strtocolor(char *str)
+static bool unpack_broken(struct unpack *u)
 {
-        if (str == NULL) return def_str;
+        pthread_mutex_lock(&u->lock);
+        bool broken = u->done && u->broken;
+        pthread_mutex_unlock(&u->lock);
+        return broken;
+}
 
-        if      (strcmp(str, red_str) == 0)     return red;
-        else if (strcmp(str, green_str) == 0)   return green;
-        else if (strcmp(str, yellow_str) == 0)  return yellow;
-        else if (strcmp(str, blue_str) == 0)    return blue;
-        else if (strcmp(str, magenta_str) == 0) return magenta;
-        else if (strcmp(str, cyan_str) == 0)    return cyan;
-        else if (strcmp(str, white_str) == 0)   return white;
-        else if (strcmp(str, def_str) == 0)     return def;
-        else return def;
+/* Files are closed once this returns, so the thread has to be done */
+/* with them. stdin never is, and -q shouldn't wait on it for input  */
+/* that may never come, so the thread is left to go when it wakes.   */
+static void unpack_stop(struct unpack *u)
+{
+        bool wait = u->in != stdin;
+
+        pthread_mutex_lock(&u->lock);
+        u->closing = true;
+        pthread_cond_broadcast(&u->cond);
+        pthread_mutex_unlock(&u->lock);
+
+        if (wait) pthread_join(u->tid, NULL);
+        else pthread_detach(u->tid);
+        if (unpack_leave(u)) unpack_free(u);
+}
+
+/* liblen. Lines are found and measured the way check_file() does it,   */
+/* through a source set up from the caller's options rather than the    */
+/* globals parseArgs() fills in, which nothing here reads.              */
+void len_options_init(struct len_options *opts)
+{
+        opts->max = 80;
+        opts->min = 1;
+        opts->tabWidth = 8;
+        opts->countNewlines = false;
+        opts->utf8 = false;
 }
 
-/* Expanding tabs is controlled by the MY_GETLINE_TABWIDTH define */
-/* If MY_GETLINE_TABWIDTH is defined, my_getline() will replace   */
-/* \t with however many spaces MY_GETLINE_TABWIDTH evaluates to   */
-size_t my_getline(char **buf, size_t *size, FILE *fd)
+static int len_check(const struct len_options *opts, struct source *src,
+                     len_callback cb, void *ctx)
 {
-        static const int  INIT_SIZE = 256;
-        static const char DELIM1 = '\n';
-        static const char DELIM2 = '\r';
-        static const char NULLCHAR = '\0';
+        struct line ln;
+        size_t number = 0;
+        int verdict = 0;
 
-        if (size == NULL) return (size_t) -1;
+        source_measure(src, opts->tabWidth, opts->utf8);
+        while (source_next(src, &ln)) {
+                const char *text = ln.text;
+                size_t bytes = ln.bytes;
 
-        if (*buf == NULL) {
-                *buf = malloc(INIT_SIZE * sizeof(**buf));
-                if (*buf == NULL) return (size_t) -1;
-                *size = INIT_SIZE;
+                /* Only a line that fit in one piece can be shown whole, */
+                /* and its first piece is all there is to exempt it     */
+                bool exempt = false;
+                if (ln.partial) {
+                        exempt = line_exempt(ln.text, ln.bytes);
+                        text = NULL;
+                        bytes = 0;
+                        while (ln.partial && source_next(src, &ln)) {}
+                }
+                ++number;
+
+                /* Blank lines are never out of range */
+                size_t width = ln.len - 1;
+                if (width == 0) continue;
+
+                size_t length = opts->countNewlines ? width + 1 : width;
+                if (length <= opts->max && length >= opts->min) continue;
+                if (text != NULL ? line_exempt(text, bytes) : exempt)
+                        continue;
+
+                verdict = 1;
+                if (cb == NULL) break;
+
+                struct len_line found = { number, length, text, bytes };
+                if (cb(ctx, &found) != 0) break;
         }
+        return verdict;
+}
 
-        int c;
-        size_t i = 0;
+int len_check_buffer(const struct len_options *opts, const char *buf,
+                     size_t n, len_callback cb, void *ctx)
+{
+        struct source src = { NULL, NULL, 0, 0, NULL, 0, false, NULL,
+                               0, false, false, false, 0, NULL, 0, false,
+                               NULL, { 0 }, 0 };
 
-        char peeking;
-        do {
-                if ((i + 2) >= *size){
-                        *buf = realloc(*buf, 2 * (*size) + 1);
-                        *size *= 2;
-                        if (*buf == NULL) {
-                                return (size_t) -1;
-                        }
+        if (opts->tabWidth == 0 || opts->max < opts->min) return LEN_EINVAL;
+
+        source_range(&src, buf, n);
+        int verdict = len_check(opts, &src, cb, ctx);
+        source_close(&src);
+        return verdict;
+}
+
+int len_check_fd(const struct len_options *opts, int fd, len_callback cb,
+                 void *ctx)
+{
+        struct source src = { NULL, NULL, 0, 0, NULL, 0, false, NULL,
+                               0, false, false, false, 0, NULL, 0, false,
+                               NULL, { 0 }, 0 };
+
+        if (opts->tabWidth == 0 || opts->max < opts->min) return LEN_EINVAL;
+
+        /* A copy to close, so the caller's stays open */
+        int fdno = dup(fd);
+        if (fdno < 0) return LEN_EIO;
+        if (!source_fd(&src, fdno)) {
+                int why = errno;
+                source_close(&src);
+                return why == ENOMEM ? LEN_ENOMEM : LEN_EIO;
+        }
+
+        /* Given its window here, source_next() never needs to grow one */
+        if (src.fd != NULL) {
+                src.buf = malloc(SCAN_BLOCK);
+                if (src.buf == NULL) {
+                        source_close(&src);
+                        return LEN_ENOMEM;
                 }
+                src.size = SCAN_BLOCK;
+        }
 
-                c = fgetc(fd);
-                if ((i + 2) >= *size){
-                        *buf = realloc(*buf, 2 * (*size) + 1);
-                        *size *= 2;
-                        if (*buf == NULL) {
-                                return (size_t) -1;
-                        }
+        int verdict = len_check(opts, &src, cb, ctx);
+        if (src.fd != NULL && (ferror(src.fd) || source_broken(&src)))
+                verdict = LEN_EIO;
+        source_close(&src);
+        free(src.buf);
+        return verdict;
+}
+
+#if !defined(LEN_LIBRARY)
+/* A tab counts as however many columns are left up to LEN_TABWIDTH */
+/* past the column it starts on, or a whole LEN_TABWIDTH there      */
+inline static size_t tab_stop(size_t col)
+{
+        return tab_next(col, LEN_TABWIDTH, false);
+}
+#endif
+
+inline static size_t tab_next(size_t col, size_t tabs, bool pow2)
+{
+#if defined(LEN_TABSTOPS)
+        size_t rem = pow2 ? col & (tabs - 1) : col % tabs;
+        return col + (rem ? rem : tabs);
+#else
+        (void) pow2;
+        return col + tabs;
+#endif
+}
+
+/* --utf8 widths, from Unicode 14.0: nonspacing and enclosing marks, */
+/* format characters and Hangul medial vowels and final consonants    */
+/* take up no columns; East Asian Wide and Fullwidth characters take  */
+/* up two. Everything else, unassigned code points included, is one.  */
+struct urange {
+        uint32_t        first;
+        uint32_t        last;
+};
+
+static const struct urange ZERO_WIDTH[] = {
+        { 0x00300, 0x0036F }, { 0x00483, 0x00489 }, { 0x00591, 0x005BD },
+        { 0x005BF, 0x005BF }, { 0x005C1, 0x005C2 }, { 0x005C4, 0x005C5 },
+        { 0x005C7, 0x005C7 }, { 0x00600, 0x00605 }, { 0x00610, 0x0061A },
+        { 0x0061C, 0x0061C }, { 0x0064B, 0x0065F }, { 0x00670, 0x00670 },
+        { 0x006D6, 0x006DD }, { 0x006DF, 0x006E4 }, { 0x006E7, 0x006E8 },
+        { 0x006EA, 0x006ED }, { 0x0070F, 0x0070F }, { 0x00711, 0x00711 },
+        { 0x00730, 0x0074A }, { 0x007A6, 0x007B0 }, { 0x007EB, 0x007F3 },
+        { 0x007FD, 0x007FD }, { 0x00816, 0x00819 }, { 0x0081B, 0x00823 },
+        { 0x00825, 0x00827 }, { 0x00829, 0x0082D }, { 0x00859, 0x0085B },
+        { 0x00890, 0x00891 }, { 0x00898, 0x0089F }, { 0x008CA, 0x00902 },
+        { 0x0093A, 0x0093A }, { 0x0093C, 0x0093C }, { 0x00941, 0x00948 },
+        { 0x0094D, 0x0094D }, { 0x00951, 0x00957 }, { 0x00962, 0x00963 },
+        { 0x00981, 0x00981 }, { 0x009BC, 0x009BC }, { 0x009C1, 0x009C4 },
+        { 0x009CD, 0x009CD }, { 0x009E2, 0x009E3 }, { 0x009FE, 0x009FE },
+        { 0x00A01, 0x00A02 }, { 0x00A3C, 0x00A3C }, { 0x00A41, 0x00A42 },
+        { 0x00A47, 0x00A48 }, { 0x00A4B, 0x00A4D }, { 0x00A51, 0x00A51 },
+        { 0x00A70, 0x00A71 }, { 0x00A75, 0x00A75 }, { 0x00A81, 0x00A82 },
+        { 0x00ABC, 0x00ABC }, { 0x00AC1, 0x00AC5 }, { 0x00AC7, 0x00AC8 },
+        { 0x00ACD, 0x00ACD }, { 0x00AE2, 0x00AE3 }, { 0x00AFA, 0x00AFF },
+        { 0x00B01, 0x00B01 }, { 0x00B3C, 0x00B3C }, { 0x00B3F, 0x00B3F },
+        { 0x00B41, 0x00B44 }, { 0x00B4D, 0x00B4D }, { 0x00B55, 0x00B56 },
+        { 0x00B62, 0x00B63 }, { 0x00B82, 0x00B82 }, { 0x00BC0, 0x00BC0 },
+        { 0x00BCD, 0x00BCD }, { 0x00C00, 0x00C00 }, { 0x00C04, 0x00C04 },
+        { 0x00C3C, 0x00C3C }, { 0x00C3E, 0x00C40 }, { 0x00C46, 0x00C48 },
+        { 0x00C4A, 0x00C4D }, { 0x00C55, 0x00C56 }, { 0x00C62, 0x00C63 },
+        { 0x00C81, 0x00C81 }, { 0x00CBC, 0x00CBC }, { 0x00CBF, 0x00CBF },
+        { 0x00CC6, 0x00CC6 }, { 0x00CCC, 0x00CCD }, { 0x00CE2, 0x00CE3 },
+        { 0x00D00, 0x00D01 }, { 0x00D3B, 0x00D3C }, { 0x00D41, 0x00D44 },
+        { 0x00D4D, 0x00D4D }, { 0x00D62, 0x00D63 }, { 0x00D81, 0x00D81 },
+        { 0x00DCA, 0x00DCA }, { 0x00DD2, 0x00DD4 }, { 0x00DD6, 0x00DD6 },
+        { 0x00E31, 0x00E31 }, { 0x00E34, 0x00E3A }, { 0x00E47, 0x00E4E },
+        { 0x00EB1, 0x00EB1 }, { 0x00EB4, 0x00EBC }, { 0x00EC8, 0x00ECD },
+        { 0x00F18, 0x00F19 }, { 0x00F35, 0x00F35 }, { 0x00F37, 0x00F37 },
+        { 0x00F39, 0x00F39 }, { 0x00F71, 0x00F7E }, { 0x00F80, 0x00F84 },
+        { 0x00F86, 0x00F87 }, { 0x00F8D, 0x00F97 }, { 0x00F99, 0x00FBC },
+        { 0x00FC6, 0x00FC6 }, { 0x0102D, 0x01030 }, { 0x01032, 0x01037 },
+        { 0x01039, 0x0103A }, { 0x0103D, 0x0103E }, { 0x01058, 0x01059 },
+        { 0x0105E, 0x01060 }, { 0x01071, 0x01074 }, { 0x01082, 0x01082 },
+        { 0x01085, 0x01086 }, { 0x0108D, 0x0108D }, { 0x0109D, 0x0109D },
+        { 0x01160, 0x011FF }, { 0x0135D, 0x0135F }, { 0x01712, 0x01714 },
+        { 0x01732, 0x01733 }, { 0x01752, 0x01753 }, { 0x01772, 0x01773 },
+        { 0x017B4, 0x017B5 }, { 0x017B7, 0x017BD }, { 0x017C6, 0x017C6 },
+        { 0x017C9, 0x017D3 }, { 0x017DD, 0x017DD }, { 0x0180B, 0x0180F },
+        { 0x01885, 0x01886 }, { 0x018A9, 0x018A9 }, { 0x01920, 0x01922 },
+        { 0x01927, 0x01928 }, { 0x01932, 0x01932 }, { 0x01939, 0x0193B },
+        { 0x01A17, 0x01A18 }, { 0x01A1B, 0x01A1B }, { 0x01A56, 0x01A56 },
+        { 0x01A58, 0x01A5E }, { 0x01A60, 0x01A60 }, { 0x01A62, 0x01A62 },
+        { 0x01A65, 0x01A6C }, { 0x01A73, 0x01A7C }, { 0x01A7F, 0x01A7F },
+        { 0x01AB0, 0x01ACE }, { 0x01B00, 0x01B03 }, { 0x01B34, 0x01B34 },
+        { 0x01B36, 0x01B3A }, { 0x01B3C, 0x01B3C }, { 0x01B42, 0x01B42 },
+        { 0x01B6B, 0x01B73 }, { 0x01B80, 0x01B81 }, { 0x01BA2, 0x01BA5 },
+        { 0x01BA8, 0x01BA9 }, { 0x01BAB, 0x01BAD }, { 0x01BE6, 0x01BE6 },
+        { 0x01BE8, 0x01BE9 }, { 0x01BED, 0x01BED }, { 0x01BEF, 0x01BF1 },
+        { 0x01C2C, 0x01C33 }, { 0x01C36, 0x01C37 }, { 0x01CD0, 0x01CD2 },
+        { 0x01CD4, 0x01CE0 }, { 0x01CE2, 0x01CE8 }, { 0x01CED, 0x01CED },
+        { 0x01CF4, 0x01CF4 }, { 0x01CF8, 0x01CF9 }, { 0x01DC0, 0x01DFF },
+        { 0x0200B, 0x0200F }, { 0x0202A, 0x0202E }, { 0x02060, 0x02064 },
+        { 0x02066, 0x0206F }, { 0x020D0, 0x020F0 }, { 0x02CEF, 0x02CF1 },
+        { 0x02D7F, 0x02D7F }, { 0x02DE0, 0x02DFF }, { 0x0302A, 0x0302D },
+        { 0x03099, 0x0309A }, { 0x0A66F, 0x0A672 }, { 0x0A674, 0x0A67D },
+        { 0x0A69E, 0x0A69F }, { 0x0A6F0, 0x0A6F1 }, { 0x0A802, 0x0A802 },
+        { 0x0A806, 0x0A806 }, { 0x0A80B, 0x0A80B }, { 0x0A825, 0x0A826 },
+        { 0x0A82C, 0x0A82C }, { 0x0A8C4, 0x0A8C5 }, { 0x0A8E0, 0x0A8F1 },
+        { 0x0A8FF, 0x0A8FF }, { 0x0A926, 0x0A92D }, { 0x0A947, 0x0A951 },
+        { 0x0A980, 0x0A982 }, { 0x0A9B3, 0x0A9B3 }, { 0x0A9B6, 0x0A9B9 },
+        { 0x0A9BC, 0x0A9BD }, { 0x0A9E5, 0x0A9E5 }, { 0x0AA29, 0x0AA2E },
+        { 0x0AA31, 0x0AA32 }, { 0x0AA35, 0x0AA36 }, { 0x0AA43, 0x0AA43 },
+        { 0x0AA4C, 0x0AA4C }, { 0x0AA7C, 0x0AA7C }, { 0x0AAB0, 0x0AAB0 },
+        { 0x0AAB2, 0x0AAB4 }, { 0x0AAB7, 0x0AAB8 }, { 0x0AABE, 0x0AABF },
+        { 0x0AAC1, 0x0AAC1 }, { 0x0AAEC, 0x0AAED }, { 0x0AAF6, 0x0AAF6 },
+        { 0x0ABE5, 0x0ABE5 }, { 0x0ABE8, 0x0ABE8 }, { 0x0ABED, 0x0ABED },
+        { 0x0FB1E, 0x0FB1E }, { 0x0FE00, 0x0FE0F }, { 0x0FE20, 0x0FE2F },
+        { 0x0FEFF, 0x0FEFF }, { 0x0FFF9, 0x0FFFB }, { 0x101FD, 0x101FD },
+        { 0x102E0, 0x102E0 }, { 0x10376, 0x1037A }, { 0x10A01, 0x10A03 },
+        { 0x10A05, 0x10A06 }, { 0x10A0C, 0x10A0F }, { 0x10A38, 0x10A3A },
+        { 0x10A3F, 0x10A3F }, { 0x10AE5, 0x10AE6 }, { 0x10D24, 0x10D27 },
+        { 0x10EAB, 0x10EAC }, { 0x10F46, 0x10F50 }, { 0x10F82, 0x10F85 },
+        { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x11070, 0x11070 },
+        { 0x11073, 0x11074 }, { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 },
+        { 0x110B9, 0x110BA }, { 0x110BD, 0x110BD }, { 0x110C2, 0x110C2 },
+        { 0x110CD, 0x110CD }, { 0x11100, 0x11102 }, { 0x11127, 0x1112B },
+        { 0x1112D, 0x11134 }, { 0x11173, 0x11173 }, { 0x11180, 0x11181 },
+        { 0x111B6, 0x111BE }, { 0x111C9, 0x111CC }, { 0x111CF, 0x111CF },
+        { 0x1122F, 0x11231 }, { 0x11234, 0x11234 }, { 0x11236, 0x11237 },
+        { 0x1123E, 0x1123E }, { 0x112DF, 0x112DF }, { 0x112E3, 0x112EA },
+        { 0x11300, 0x11301 }, { 0x1133B, 0x1133C }, { 0x11340, 0x11340 },
+        { 0x11366, 0x1136C }, { 0x11370, 0x11374 }, { 0x11438, 0x1143F },
+        { 0x11442, 0x11444 }, { 0x11446, 0x11446 }, { 0x1145E, 0x1145E },
+        { 0x114B3, 0x114B8 }, { 0x114BA, 0x114BA }, { 0x114BF, 0x114C0 },
+        { 0x114C2, 0x114C3 }, { 0x115B2, 0x115B5 }, { 0x115BC, 0x115BD },
+        { 0x115BF, 0x115C0 }, { 0x115DC, 0x115DD }, { 0x11633, 0x1163A },
+        { 0x1163D, 0x1163D }, { 0x1163F, 0x11640 }, { 0x116AB, 0x116AB },
+        { 0x116AD, 0x116AD }, { 0x116B0, 0x116B5 }, { 0x116B7, 0x116B7 },
+        { 0x1171D, 0x1171F }, { 0x11722, 0x11725 }, { 0x11727, 0x1172B },
+        { 0x1182F, 0x11837 }, { 0x11839, 0x1183A }, { 0x1193B, 0x1193C },
+        { 0x1193E, 0x1193E }, { 0x11943, 0x11943 }, { 0x119D4, 0x119D7 },
+        { 0x119DA, 0x119DB }, { 0x119E0, 0x119E0 }, { 0x11A01, 0x11A0A },
+        { 0x11A33, 0x11A38 }, { 0x11A3B, 0x11A3E }, { 0x11A47, 0x11A47 },
+        { 0x11A51, 0x11A56 }, { 0x11A59, 0x11A5B }, { 0x11A8A, 0x11A96 },
+        { 0x11A98, 0x11A99 }, { 0x11C30, 0x11C36 }, { 0x11C38, 0x11C3D },
+        { 0x11C3F, 0x11C3F }, { 0x11C92, 0x11CA7 }, { 0x11CAA, 0x11CB0 },
+        { 0x11CB2, 0x11CB3 }, { 0x11CB5, 0x11CB6 }, { 0x11D31, 0x11D36 },
+        { 0x11D3A, 0x11D3A }, { 0x11D3C, 0x11D3D }, { 0x11D3F, 0x11D45 },
+        { 0x11D47, 0x11D47 }, { 0x11D90, 0x11D91 }, { 0x11D95, 0x11D95 },
+        { 0x11D97, 0x11D97 }, { 0x11EF3, 0x11EF4 }, { 0x13430, 0x13438 },
+        { 0x16AF0, 0x16AF4 }, { 0x16B30, 0x16B36 }, { 0x16F4F, 0x16F4F },
+        { 0x16F8F, 0x16F92 }, { 0x16FE4, 0x16FE4 }, { 0x1BC9D, 0x1BC9E },
+        { 0x1BCA0, 0x1BCA3 }, { 0x1CF00, 0x1CF2D }, { 0x1CF30, 0x1CF46 },
+        { 0x1D167, 0x1D169 }, { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B },
+        { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 }, { 0x1DA00, 0x1DA36 },
+        { 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 }, { 0x1DA84, 0x1DA84 },
+        { 0x1DA9B, 0x1DA9F }, { 0x1DAA1, 0x1DAAF }, { 0x1E000, 0x1E006 },
+        { 0x1E008, 0x1E018 }, { 0x1E01B, 0x1E021 }, { 0x1E023, 0x1E024 },
+        { 0x1E026, 0x1E02A }, { 0x1E130, 0x1E136 }, { 0x1E2AE, 0x1E2AE },
+        { 0x1E2EC, 0x1E2EF }, { 0x1E8D0, 0x1E8D6 }, { 0x1E944, 0x1E94A },
+        { 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF },
+};
+
+static const struct urange WIDE[] = {
+        { 0x01100, 0x0115F }, { 0x0231A, 0x0231B }, { 0x02329, 0x0232A },
+        { 0x023E9, 0x023EC }, { 0x023F0, 0x023F0 }, { 0x023F3, 0x023F3 },
+        { 0x025FD, 0x025FE }, { 0x02614, 0x02615 }, { 0x02648, 0x02653 },
+        { 0x0267F, 0x0267F }, { 0x02693, 0x02693 }, { 0x026A1, 0x026A1 },
+        { 0x026AA, 0x026AB }, { 0x026BD, 0x026BE }, { 0x026C4, 0x026C5 },
+        { 0x026CE, 0x026CE }, { 0x026D4, 0x026D4 }, { 0x026EA, 0x026EA },
+        { 0x026F2, 0x026F3 }, { 0x026F5, 0x026F5 }, { 0x026FA, 0x026FA },
+        { 0x026FD, 0x026FD }, { 0x02705, 0x02705 }, { 0x0270A, 0x0270B },
+        { 0x02728, 0x02728 }, { 0x0274C, 0x0274C }, { 0x0274E, 0x0274E },
+        { 0x02753, 0x02755 }, { 0x02757, 0x02757 }, { 0x02795, 0x02797 },
+        { 0x027B0, 0x027B0 }, { 0x027BF, 0x027BF }, { 0x02B1B, 0x02B1C },
+        { 0x02B50, 0x02B50 }, { 0x02B55, 0x02B55 }, { 0x02E80, 0x02E99 },
+        { 0x02E9B, 0x02EF3 }, { 0x02F00, 0x02FD5 }, { 0x02FF0, 0x02FFB },
+        { 0x03000, 0x03029 }, { 0x0302E, 0x0303E }, { 0x03041, 0x03096 },
+        { 0x0309B, 0x030FF }, { 0x03105, 0x0312F }, { 0x03131, 0x0318E },
+        { 0x03190, 0x031E3 }, { 0x031F0, 0x0321E }, { 0x03220, 0x03247 },
+        { 0x03250, 0x04DBF }, { 0x04E00, 0x0A48C }, { 0x0A490, 0x0A4C6 },
+        { 0x0A960, 0x0A97C }, { 0x0AC00, 0x0D7A3 }, { 0x0F900, 0x0FA6D },
+        { 0x0FA70, 0x0FAD9 }, { 0x0FE10, 0x0FE19 }, { 0x0FE30, 0x0FE52 },
+        { 0x0FE54, 0x0FE66 }, { 0x0FE68, 0x0FE6B }, { 0x0FF01, 0x0FF60 },
+        { 0x0FFE0, 0x0FFE6 }, { 0x16FE0, 0x16FE3 }, { 0x16FF0, 0x16FF1 },
+        { 0x17000, 0x187F7 }, { 0x18800, 0x18CD5 }, { 0x18D00, 0x18D08 },
+        { 0x1AFF0, 0x1AFF3 }, { 0x1AFF5, 0x1AFFB }, { 0x1AFFD, 0x1AFFE },
+        { 0x1B000, 0x1B122 }, { 0x1B150, 0x1B152 }, { 0x1B164, 0x1B167 },
+        { 0x1B170, 0x1B2FB }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF },
+        { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 },
+        { 0x1F210, 0x1F23B }, { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 },
+        { 0x1F260, 0x1F265 }, { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 },
+        { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA },
+        { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 },
+        { 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC },
+        { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 },
+        { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 },
+        { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC },
+        { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6DD, 0x1F6DF },
+        { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7EB },
+        { 0x1F7F0, 0x1F7F0 }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 },
+        { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FA74 }, { 0x1FA78, 0x1FA7C },
+        { 0x1FA80, 0x1FA86 }, { 0x1FA90, 0x1FAAC }, { 0x1FAB0, 0x1FABA },
+        { 0x1FAC0, 0x1FAC5 }, { 0x1FAD0, 0x1FAD9 }, { 0x1FAE0, 0x1FAE7 },
+        { 0x1FAF0, 0x1FAF6 }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+static bool urange_has(const struct urange *r, size_t n, uint32_t cp)
+{
+        size_t lo = 0;
+        size_t hi = n;
+
+        if (cp < r[0].first || cp > r[n - 1].last) return false;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (cp > r[mid].last) lo = mid + 1;
+                else if (cp < r[mid].first) hi = mid;
+                else return true;
+        }
+        return false;
+}
+
+static size_t utf8_width(uint32_t cp)
+{
+        if (urange_has(ZERO_WIDTH, sizeof(ZERO_WIDTH) / sizeof(*ZERO_WIDTH),
+                       cp))
+                return 0;
+        if (urange_has(WIDE, sizeof(WIDE) / sizeof(*WIDE), cp)) return 2;
+        return 1;
+}
+
+inline static size_t text_run(const char *p, const char *end, bool wide)
+{
+        const char *q = p;
+
+#if defined(__SSE2__)
+        const __m128i nl  = _mm_set1_epi8('\n');
+        const __m128i cr  = _mm_set1_epi8('\r');
+        const __m128i tab = _mm_set1_epi8(TAB);
+        const __m128i nul = _mm_setzero_si128();
+
+        for (; end - q >= 16; q += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) q);
+                __m128i m = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                     _mm_cmpeq_epi8(v, cr)),
+                        _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                     _mm_cmpeq_epi8(v, nul)));
+                unsigned mask = (unsigned) _mm_movemask_epi8(m);
+                if (wide) mask |= (unsigned) _mm_movemask_epi8(v);
+                if (mask) return q - p + __builtin_ctz(mask);
+        }
+#endif
+        for (; q < end; ++q) {
+                unsigned char c = *q;
+                if ((wide && c >= 0x80) || c == '\n' || c == '\r' ||
+                    c == TAB || c == NULLCHAR)
+                        break;
+        }
+        return q - p;
+}
+
+inline static size_t utf8_char(const char *p, const char *end,
+                               size_t *width)
+{
+        unsigned char c = *p;
+        size_t n = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 :
+                   c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+
+        *width = 1;
+        if (n == 1) return 1;
+        if (n == 0 || (size_t) (end - p) < n) return 1;
+
+        uint32_t cp = c & (0x7F >> n);
+        for (size_t k = 1; k < n; ++k) {
+                unsigned char next = p[k];
+                if ((next & 0xC0) != 0x80) return 1;
+                cp = cp << 6 | (next & 0x3F);
+        }
+        *width = utf8_width(cp);
+        return n;
+}
+
+#if !defined(LEN_LIBRARY)
+/* Lets off a line out of range, one that ends at end */
+static bool scan_exempt(const struct scan *st, const char *end)
+{
+        if (st->start != NULL) return line_exempt(st->start, end - st->start);
+        return st->first != NULL && line_exempt(st->first, st->firstLen);
+}
+
+/* end is where the line ends, at its \n, \r or NUL if it has one */
+inline static void scan_line_end(struct scan *st, const char *end)
+{
+        size_t len = st->col + 1;
+
+        /* Blank lines are never violations. Once one is found, */
+        /* it's no use asking whether others are exempt.        */
+        if (len != 1) {
+                size_t shown = newlines ? len : len - 1;
+                if ((len < minLen || len > maxLen) && !st->violated &&
+                    !scan_exempt(st, end))
+                        st->violated = true;
+                if (shown > st->longest) st->longest = shown;
+                if (shown < st->shortest) st->shortest = shown;
+        }
+        ++st->lines;
+        if (st->hist != NULL) {
+                if (len == 1) ++st->hist->blank;
+                else hist_add(st->hist, newlines ? len : len - 1);
+        }
+        st->col = 0;
+        st->start = end + 1;
+}
+
+/* The kernels below take wide (--utf8) and pow2 as constants, and are */
+/* built once for each KERNEL_SETS so plain scans pay nothing for      */
+/* either. With wide, bytes past ASCII are special too.                */
+inline static bool scan_is_special(char c, bool wide)
+{
+        return c == '\n' || c == '\r' || c == TAB || c == NULLCHAR ||
+               (wide && (unsigned char) c >= 0x80);
+}
+
+/* A character cut short counts a column for each byte of it, the same */
+/* as utf8_char() makes of it                                         */
+inline static void scan_flush(struct scan *st)
+{
+        st->col += st->have;
+        st->need = 0;
+        st->have = 0;
+}
+
+/* Takes one byte past ASCII, a character of --utf8 text at a time */
+inline static void scan_utf8(struct scan *st, unsigned char c)
+{
+        /* Continuation bytes */
+        if (c < 0xC0) {
+                if (st->need == 0) {
+                        ++st->col;
+                        return;
                 }
-                /* Lines that are actually blank (no newline at all) are */
-                /* reported as invalid. Should only happen in an empty   */
-                /* file.                                                 */
-                if (c < 0){
-                        if (i == 0){
-                                *size = -1;
-                                return (size_t) -1;
-                        }
-                        else ++i;
+                st->cp = st->cp << 6 | (c & 0x3F);
+                ++st->have;
+                if (--st->need == 0) {
+                        st->col += utf8_width(st->cp);
+                        st->have = 0;
                 }
-                else {
-                        (*buf)[i] = c;
-                        /* UNIX line endings:       \n   */
-                        /* OSX line endings:        \r   */
-                        /* Windows line endings     \r\n */
-                        #if defined(MY_GETLINE_TABWIDTH)
-                                if ((*buf)[i] == TAB) {
-                                        if (*size <=
-                                            i + MY_GETLINE_TABWIDTH + 1) {
-                                                *buf = realloc(*buf,
-                                                              2 * (*size) + 1);
-                                                *size *= 2;
-                                                if (*buf == NULL)
-                                                        return (size_t) -1;
-                                        }
-                                        #if defined(MY_GETLINE_TABSTOPS)
-                                        int dst_to_tabstop =
-                                                ((i % MY_GETLINE_TABWIDTH) ?
-                                                (i % MY_GETLINE_TABWIDTH) :
-                                                MY_GETLINE_TABWIDTH);
-                                        for (size_t q = i;
-                                             q < i + dst_to_tabstop;
-                                             ++q) {
-                                                (*buf)[q] = ' ';
-                                        }
-                                        i += dst_to_tabstop - 1;
-                                        #else
-                                        for (size_t q = i;
-                                             q < i + MY_GETLINE_TABWIDTH;
-                                             ++q) {
-                                                (*buf)[q] = ' ';
-                                        }
-                                        i += MY_GETLINE_TABWIDTH - 1;
-                                        #endif
-                                }
-                        #endif
-                        /* UNIX or OS9 */
-                        if (((*buf)[i] == DELIM1) || (*buf)[i] == DELIM2) {
-                                /* Windows */
-                                if ((c == DELIM2) &&
-                                        (peeking = fgetc(fd)) != DELIM1)
-                                                ungetc(peeking, fd);
-                                (*buf)[++i] = NULLCHAR;
-                                return i;
+                return;
+        }
+
+        if (st->need) scan_flush(st);
+        unsigned more = c < 0xC2 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 :
+                        c < 0xF5 ? 3 : 0;
+        if (more == 0) {
+                ++st->col;
+                return;
+        }
+        st->cp = c & (0x3F >> more);
+        st->need = more;
+        st->have = 1;
+}
+
+/* Handles one \n, \r, \t or NUL, or with --utf8 a byte past ASCII.    */
+/* crAt remembers the last \r seen in the current block so the \n of a */
+/* \r\n pair isn't taken for a blank line.                             */
+inline static void scan_special(struct scan *st, const char *q,
+                                const char **crAt, bool wide, bool pow2)
+{
+        if (wide && (unsigned char) *q >= 0x80) {
+                scan_utf8(st, *q);
+                return;
+        }
+        if (wide && st->need) scan_flush(st);
+
+        switch (*q) {
+        case '\t':
+                st->col = tab_next(st->col, LEN_TABWIDTH, pow2);
+                return;
+        case '\n':
+                if (*crAt != NULL && q == *crAt + 1) {
+                        st->start = q + 1;
+                        return;
+                }
+                break;
+        case '\r':
+                *crAt = q;
+                break;
+        }
+        scan_line_end(st, q);
+}
+
+/* Walks the set bits of a movemask result. Bit k stands for p[k]. */
+inline static void scan_mask(struct scan *st, const char *p, unsigned mask,
+                             unsigned width, const char **crAt, bool wide,
+                             bool pow2)
+{
+        unsigned last = 0;
+        while (mask) {
+                unsigned k = __builtin_ctz(mask);
+                if (wide && k > last && st->need) scan_flush(st);
+                st->col += k - last;
+                scan_special(st, p + k, crAt, wide, pow2);
+                last = k + 1;
+                mask &= mask - 1;
+        }
+        if (wide && width > last && st->need) scan_flush(st);
+        st->col += width - last;
+}
+
+/* A \n at the start of a block may finish a \r\n split across blocks */
+inline static size_t scan_start(struct scan *st, const char *p, size_t n)
+{
+        bool skip = st->skipLF && n > 0 && *p == '\n';
+        st->skipLF = false;
+        if (skip && st->start == p) st->start = p + 1;
+        return skip ? 1 : 0;
+}
+
+inline static void scan_tail(struct scan *st, const char *p,
+                             const char *end, const char **crAt, bool wide,
+                             bool pow2)
+{
+        for (; p < end; ++p) {
+                if (scan_is_special(*p, wide)) {
+                        scan_special(st, p, crAt, wide, pow2);
+                } else {
+                        if (wide && st->need) scan_flush(st);
+                        ++st->col;
+                }
+        }
+        if (*crAt != NULL && *crAt == end - 1) st->skipLF = true;
+}
+
+inline static void scan_scalar(struct scan *st, const char *p, size_t n,
+                               bool wide, bool pow2)
+{
+        const char *crAt = NULL;
+        if (n == 0) return;
+
+        size_t skip = scan_start(st, p, n);
+        scan_tail(st, p + skip, p + n, &crAt, wide, pow2);
+}
+
+/* Stamps out a kernel for each of the KERNEL_SETS, and its table */
+#define SCAN_KERNELS(ISA, ATTR)                                              \
+ATTR static void scan_block_##ISA(struct scan *st, const char *p, size_t n) \
+{                                                                            \
+        scan_##ISA(st, p, n, false, false);                                  \
+}                                                                            \
+ATTR static void scan_block_##ISA##_utf8(struct scan *st, const char *p,    \
+                                         size_t n)                          \
+{                                                                            \
+        scan_##ISA(st, p, n, true, false);                                   \
+}                                                                            \
+ATTR static void scan_block_##ISA##_pow2(struct scan *st, const char *p,    \
+                                         size_t n)                          \
+{                                                                            \
+        scan_##ISA(st, p, n, false, true);                                   \
+}                                                                            \
+ATTR static void scan_block_##ISA##_utf8_pow2(struct scan *st,              \
+                                              const char *p, size_t n)      \
+{                                                                            \
+        scan_##ISA(st, p, n, true, true);                                    \
+}                                                                            \
+static const scan_fn SCAN_##ISA[KERNEL_SETS] = {                             \
+        scan_block_##ISA, scan_block_##ISA##_utf8,                           \
+        scan_block_##ISA##_pow2, scan_block_##ISA##_utf8_pow2,               \
+}
+
+SCAN_KERNELS(scalar, );
+
+#if defined(__SSE2__)
+inline static void scan_sse2(struct scan *st, const char *p, size_t n,
+                             bool wide, bool pow2)
+{
+        const char *crAt = NULL;
+        if (n == 0) return;
+
+        const char *end = p + n;
+        p += scan_start(st, p, n);
+
+        const __m128i nl  = _mm_set1_epi8('\n');
+        const __m128i cr  = _mm_set1_epi8('\r');
+        const __m128i tab = _mm_set1_epi8(TAB);
+        const __m128i nul = _mm_setzero_si128();
+
+        for (; end - p >= 16; p += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) p);
+                __m128i m = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                     _mm_cmpeq_epi8(v, cr)),
+                        _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                     _mm_cmpeq_epi8(v, nul)));
+                unsigned mask = (unsigned) _mm_movemask_epi8(m);
+                if (wide) mask |= (unsigned) _mm_movemask_epi8(v);
+
+                if (mask == 0) {
+                        if (wide && st->need) scan_flush(st);
+                        st->col += 16;
+                } else scan_mask(st, p, mask, 16, &crAt, wide, pow2);
+        }
+        scan_tail(st, p, end, &crAt, wide, pow2);
+}
+
+SCAN_KERNELS(sse2, );
+#endif
+
+#if defined(LEN_AVX2)
+__attribute__((target("avx2")))
+inline static void scan_avx2(struct scan *st, const char *p, size_t n,
+                             bool wide, bool pow2)
+{
+        const char *crAt = NULL;
+        if (n == 0) return;
+
+        const char *end = p + n;
+        p += scan_start(st, p, n);
+
+        const __m256i nl  = _mm256_set1_epi8('\n');
+        const __m256i cr  = _mm256_set1_epi8('\r');
+        const __m256i tab = _mm256_set1_epi8(TAB);
+        const __m256i nul = _mm256_setzero_si256();
+
+        for (; end - p >= 32; p += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) p);
+                __m256i m = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                                        _mm256_cmpeq_epi8(v, cr)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                        _mm256_cmpeq_epi8(v, nul)));
+                unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+                if (wide) mask |= (unsigned) _mm256_movemask_epi8(v);
+
+                if (mask == 0) {
+                        if (wide && st->need) scan_flush(st);
+                        st->col += 32;
+                } else scan_mask(st, p, mask, 32, &crAt, wide, pow2);
+        }
+        scan_tail(st, p, end, &crAt, wide, pow2);
+}
+
+SCAN_KERNELS(avx2, __attribute__((target("avx2"))));
+#endif
+#endif
+
+static int kernel_set(size_t tabs, bool wide)
+{
+        int set = 0;
+        if (wide) set |= KERNEL_WIDE;
+        if (tabs != 0 && (tabs & (tabs - 1)) == 0) set |= KERNEL_POW2;
+        return set;
+}
+
+#if !defined(LEN_LIBRARY)
+static void kernel_select(void)
+{
+        scan_kernels = SCAN_scalar;
+#if defined(LEN_AVX2)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                scan_kernels = SCAN_avx2;
+                return;
+        }
+#endif
+#if defined(__SSE2__)
+        scan_kernels = SCAN_sse2;
+#endif
+}
+
+/* A last line without a newline still counts, just as in source_next(). */
+/* end is where the text scanned last ends.                               */
+static void scan_finish(struct scan *st, const char *end)
+{
+        if (st->need) scan_flush(st);
+        if (st->col > 0) scan_line_end(st, end);
+        st->skipLF = false;
+}
+
+/* Keeps the first window of a line the window can't hold, to be */
+/* checked for exemption once its end is found                    */
+static void scan_hold(struct scan *st, const char *end)
+{
+        if (st->start == NULL) return;
+
+        size_t n = end - st->start;
+        if (n > SCAN_BLOCK) n = SCAN_BLOCK;
+        if (st->first == NULL) st->first = malloc(SCAN_BLOCK);
+        if (st->first == NULL) {
+                fprintf(stderr, "%s\n", NO_MEMORY);
+                exit(MEM_EXCEEDED);
+        }
+        memcpy(st->first, st->start, n);
+        st->firstLen = n;
+        st->start = NULL;
+}
+
+/* Just past the last line ending in the n bytes at p, or 0 if none */
+static size_t scan_cut(const char *p, size_t n)
+{
+        while (n > 0 && p[n - 1] != '\n' && p[n - 1] != '\r' &&
+               p[n - 1] != NULLCHAR)
+                --n;
+        return n;
+}
+
+/* Whether a -q scan can give up */
+inline static bool scan_stop(const struct scan *st, const struct job *job)
+{
+        return quiet && (st->violated || stopped_at(job->number));
+}
+
+static bool source_scan(struct source *src, struct job *job)
+{
+        struct scan st = { 0, false, false, job->hist, 0, SIZE_MAX, 0,
+                           0, 0, 0, src->map, NULL, 0 };
+        scan_fn scan_block = scan_kernels[kernel_set(src->tabs, src->wide)];
+        uint64_t t = stats_clock();
+        const char *end = src->map;
+
+        if (src->fd == NULL) {
+                /* -q goes a block at a time to see when to stop */
+                size_t step = quiet ? SCAN_BLOCK : src->mapLen;
+                for (size_t at = 0; at < src->mapLen && !scan_stop(&st, job);
+                     at += step) {
+                        size_t n = src->mapLen - at;
+                        scan_block(&st, src->map + at, n < step ? n : step);
+                        end = src->map + at + (n < step ? n : step);
+                }
+        } else {
+                source_buffer(src);
+                st.start = src->buf;
+
+                /* Blocks end after their last line ending, and the rest */
+                /* goes to the front for the next, so a line found out   */
+                /* of range is still there to be checked for exemption.  */
+                /* A line the window can't hold keeps its first window.  */
+                size_t keep = 0;
+                size_t got;
+                while (!scan_stop(&st, job) &&
+                       (got = source_read(src, src->buf + keep,
+                                          src->size - keep)) > 0) {
+                        t = stats_lap(&job->stats.open, t);
+                        job->stats.bytes += got;
+
+                        size_t n = keep + got;
+                        size_t cut = scan_cut(src->buf, n);
+                        bool ended = cut > 0;
+                        if (!ended && n < src->size) {
+                                keep = n;
+                                continue;
                         }
-                        ++i;
+                        if (!ended) cut = n;
+
+                        scan_block(&st, src->buf, cut);
+                        if (!ended) scan_hold(&st, src->buf + cut);
+                        keep = n - cut;
+                        memmove(src->buf, src->buf + cut, keep);
+                        if (ended) st.start = src->buf;
                 }
-        } while(c > 0); /* EOF returns a negative value */
+                if (keep > 0 && !scan_stop(&st, job))
+                        scan_block(&st, src->buf, keep);
+                end = src->buf + keep;
+        }
 
-        (*buf)[i] = NULLCHAR;
-        return i;
+        scan_finish(&st, end);
+        free(st.first);
+        stats_lap(&job->stats.scan, t);
+        if (quiet && st.violated) stop_all(job->number);
+        job->longest = st.longest;
+        job->shortest = st.shortest;
+        job->stats.lines += st.lines;
+        if (st.longest > job->stats.longest)
+                job->stats.longest = st.longest;
+        return st.violated;
 }
+#endif
@@ -0,0 +1,72 @@
+/* liblen: len's line length checks for use from other programs. Every  */
+/* call takes its options and its state from its arguments, so calls    */
+/* from any number of threads at once are safe. Nothing here exits or   */
+/* prints; errors come back as negative return values.                  */
+
+#ifndef LEN_H
+#define LEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define LEN_API __attribute__((visibility("default")))
+#else
+#define LEN_API
+#endif
+
+/* Return values other than 0 (all lines in range) and 1 (some weren't) */
+#define LEN_EINVAL      (-1)            /* Options that make no sense    */
+#define LEN_EIO         (-2)            /* Reading failed                */
+#define LEN_ENOMEM      (-3)
+
+/* The same options the command line takes, in the same units */
+struct len_options {
+        unsigned        max;            /* -m                            */
+        unsigned        min;            /* -M                            */
+        unsigned        tabWidth;       /* -t                            */
+        bool            countNewlines;  /* -N                            */
+        bool            utf8;           /* --utf8                        */
+};
+
+/* A line out of range. text is only valid during the callback and is */
+/* NULL for lines too long to have been held whole, which only happens */
+/* to lines longer than 64 KiB read by len_check_fd() from a stream.   */
+struct len_line {
+        size_t          number;         /* From 1                        */
+        size_t          length;         /* As -l shows it                */
+        const char      *text;          /* Not terminated, tabs and all  */
+        size_t          bytes;
+};
+
+/* Lines out of range that hold "len:ignore" are let off, as they are by */
+/* len itself, and never reach the callback or the return value.          */
+
+/* Called for each line out of range, in order. Returning nonzero stops */
+/* the check there.                                                     */
+typedef int (*len_callback)(void *ctx, const struct len_line *line);
+
+/* Fills in the command line's defaults */
+LEN_API void len_options_init(struct len_options *opts);
+
+/* Checks n bytes of text. With a NULL callback the check stops at the */
+/* first line out of range.                                             */
+LEN_API int len_check_buffer(const struct len_options *opts, const char *buf,
+                             size_t n, len_callback cb, void *ctx);
+
+/* Checks the file fd is open on. Regular files are mapped whole; */
+/* anything else is read from where it is through a fixed window, */
+/* however long its lines. gzip and zstd input is decompressed,   */
+/* and LEN_EIO returned if it's damaged. fd is left open.         */
+LEN_API int len_check_fd(const struct len_options *opts, int fd,
+                         len_callback cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
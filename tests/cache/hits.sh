@@ -0,0 +1,42 @@
+# --stats shows which files --cache answered for: they are not read, so
+# their bytes and lines are 0. A file that changes is read again, and a
+# change that keeps its size and time is only noticed by --cache-strict.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+long=$(awk 'BEGIN { while (length(s) < 90) s = s "a"; print s }')
+echo "$long" > one
+echo ok > two
+touch -r one ref
+
+run() {
+        "$LEN" --cache cache --stats "$@" 2> stats
+        status=$?
+        echo "$* -> $status"
+        awk 'NF == 8 && NR > 1 { print "  " $NF ": " $1 " " $2 }' stats
+}
+
+run one two
+run one two
+echo "$long" >> two
+run one two
+run -m 100 one two
+run -m 100 one two
+run one two
+run --cache-strict one two
+
+# Same size, same time, but now in range
+printf '%s\n%s\n' "${long%??????????????????????????????????????????????}" \
+                  "${long%?????????????????????????????????????????????}" > one
+touch -r ref one
+run one
+run --cache-strict one
+run one
+
+"$LEN" --cache cache -p one two > out
+echo "-p -> $?, $(wc -l < out) lines"
+# A file that isn't a cache is left alone
+echo junk > cache
+run one two
+cat cache
@@ -0,0 +1,43 @@
+# A 24 MiB file is split into three 8 MiB chunks under -j. Around the
+# first cut a long line runs across it, and the second falls between
+# the CR and LF of a CRLF line; line numbers, lengths, the summary and
+# the status must all come out as they do when it's checked whole.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+
+awk 'function emit(w) {
+        while (length(x) < w)
+                x = x x "x"
+        printf "%s\n", substr(x, 1, w)
+        pos += w + 1
+}
+function fill(to) {
+        while (pos + 40 <= to)
+                emit(++l % 5000 == 0 ? 81 : 39)
+        emit(to - pos - 1)
+}
+BEGIN {
+        x = "x"
+        b = 8388608
+        fill(b - 150)
+        emit(300)
+        fill(2 * b - 90)
+        printf "%s\r\n", substr(x, 1, 89)
+        pos += 91
+        fill(3 * b)
+}' > "$dir/big"
+
+cd "$dir" || exit 2
+wc -c < big
+"$LEN" -j 1 -pnl big > one
+echo "-j 1: $?"
+"$LEN" -j 4 -pnl big > four
+echo "-j 4: $?"
+cmp -s one four && echo same
+cut -c 1-20 four
+"$LEN" -j 1 --summary big > one
+"$LEN" -j 4 --summary big > four
+cmp -s one four && echo same
+cat four
+"$LEN" -j 4 -q big
+echo "-j 4 -q: $?"
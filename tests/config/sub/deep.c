@@ -0,0 +1,2 @@
+	ssssssssssssssssssssssssssssssssssssss
+sssssssssssssssssssssssssssssssssssssss
@@ -0,0 +1,62 @@
+# --client gives what a run without it does, whether the daemon answers
+# or isn't there, and the daemon notices when a file it knows changes.
+dir=$(mktemp -d) || exit 2
+pid=
+trap '[ -n "$pid" ] && kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+long=$(awk 'BEGIN { while (length(s) < 90) s = s "x"; print s }')
+printf 'ok\n%s\n' "$long" > one
+printf 'ok\n' > two
+
+# Waits for the daemon to answer, which a socket left behind by one that
+# died doesn't show
+start() {
+        "$LEN" --daemon sock 2> /dev/null &
+        pid=$!
+        i=0
+        while "$LEN" --client sock --stats two 2>&1 | grep -q bytes &&
+              [ $i -lt 100 ]; do
+                sleep 0.05
+                i=$((i + 1))
+        done
+}
+
+# Compares a --client run with the same run without it. Files the
+# client checks itself, with no daemon to answer, show up in --stats
+run() {
+        "$LEN" "$@" one two > without
+        a=$?
+        "$LEN" --client sock "$@" one two > with
+        b=$?
+        by=daemon
+        "$LEN" --client sock --stats "$@" one two 2>&1 > /dev/null |
+                grep -q bytes && by=client
+        cmp -s without with && echo "same $a $b, by the $by: $*"
+}
+
+run
+run --format ndjson
+start
+run
+run -q
+run --format ndjson
+run -m 100
+run -N -m 90
+printf 'ok\n' > one
+run
+printf 'ok\n%s\n' "$long" >> one
+run --format checkstyle
+
+# A daemon that died leaves its socket, which clients get past and a
+# new daemon replaces
+kill -9 $pid
+wait $pid 2> /dev/null
+run
+start
+run
+
+"$LEN" --client sock -p one two
+echo "-p: $?"
+"$LEN" --daemon other one
+echo "files: $?"
@@ -0,0 +1,34 @@
+# Files of very different sizes finish out of order under -j; what is
+# printed must still follow the command line, as it does with -j 1,
+# and a file that can't be opened still ends the run where it's named.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+
+set --
+i=0
+while [ $i -lt 24 ]; do
+        awk -v i=$i 'BEGIN {
+                n = (i % 4 == 0) ? 20000 : 8
+                for (l = 1; l <= n; l++) {
+                        w = (l % 7 == 0) ? 81 + i : 40
+                        s = ""
+                        while (length(s) < w)
+                                s = s "x"
+                        print s
+                }
+        }' > "$dir/f$i"
+        set -- "$@" "f$i"
+        i=$((i + 1))
+done
+set -- "$@" missing f1
+
+cd "$dir" || exit 2
+"$LEN" -j 1 -pnl "$@" > one
+echo "-j 1: $?"
+"$LEN" -j 4 -pnl "$@" > four
+echo "-j 4: $?"
+"$LEN" -j 0 -q "$@"
+echo "-j 0 -q: $?"
+cmp -s one four && echo same
+
+grep "^--|" four | cut -c 1-20
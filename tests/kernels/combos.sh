@@ -0,0 +1,19 @@
+# Each tab width, with and without --utf8 and -N, gets its own scan
+# kernel. For every combination the longest line the kernel finds with
+# nothing printed must be the longest -P prints, and must decide the
+# status at that limit and one under it.
+for t in 1 3 4 8 12; do
+        for flags in "" --utf8 -N "--utf8 -N"; do
+                set -- -t $t $flags
+                "$LEN" -Pl -m 1000 "$@" tabs.txt |
+                        awk -F '[][]' '{ print $2 + 0 }' > lengths
+                max=$(sort -n lengths | tail -n 1)
+                "$LEN" -m $max "$@" tabs.txt
+                fits=$?
+                "$LEN" -m $((max - 1)) "$@" tabs.txt
+                over=$?
+                echo "$*:" $(cat lengths) "- $fits $over"
+                "$LEN" --summary "$@" tabs.txt | grep -qx "max: $max" ||
+                        echo "  --summary disagrees"
+        done
+done
@@ -0,0 +1,11 @@
+# lib-test is built from lib-test.c against liblen.a by make test. The
+# same file is checked mapped, then from a pipe, then a line too long
+# to be held whole is read from a pipe.
+./lib-test < lines.txt
+cat lines.txt | ./lib-test | sed -n '/^stdin:/,$p'
+awk 'BEGIN {
+        while (length(s) < 70000)
+                s = s "x"
+        print "ok"
+        print s
+}' | ./lib-test | sed -n '/^stdin:/,$p'
@@ -0,0 +1,90 @@
+/* Tests for liblen, linked against liblen.a as another program would */
+/* be. Prints what each len_* call returns and the lines it hands its */
+/* callback, for tests/lib/calls.sh to compare.                       */
+/*                                                                    */
+/* Usage: lib-test < FILE                                             */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "len.h"
+
+/* Text for the buffer checks: a line in range, one too long, a tab, a */
+/* CRLF line, a long line let off by len:ignore and a blank line       */
+static const char TEXT[] =
+        "short\n"
+        "a line that runs on for a good while longer than forty columns\n"
+        "\tindented\n"
+        "crlf line\r\n"
+        "a long line that is let off with len:ignore in a comment here\n"
+        "\n"
+        "last, without a newline, and longer than the limit of forty";
+
+/* Prints each line found; ctx, if given, is how many to take before */
+/* stopping                                                          */
+static int show(void *ctx, const struct len_line *line)
+{
+        int *left = ctx;
+
+        if (line->text != NULL)
+                printf("  %zu [%zu]: %.*s\n", line->number, line->length,
+                       (int) line->bytes, line->text);
+        else
+                printf("  %zu [%zu]: (not held)\n", line->number,
+                       line->length);
+        return left != NULL && --*left == 0;
+}
+
+static void buffer(const char *what, const struct len_options *opts,
+                   const char *text, len_callback cb, void *ctx)
+{
+        printf("%s:\n", what);
+        printf("  -> %d\n", len_check_buffer(opts, text, strlen(text),
+                                             cb, ctx));
+}
+
+int main(void)
+{
+        struct len_options opts;
+        int left;
+
+        len_options_init(&opts);
+        printf("defaults: max %u min %u tabWidth %u countNewlines %d "
+               "utf8 %d\n", opts.max, opts.min, opts.tabWidth,
+               opts.countNewlines, opts.utf8);
+
+        opts.max = 40;
+        buffer("max 40", &opts, TEXT, show, NULL);
+        buffer("no callback", &opts, TEXT, NULL, NULL);
+        left = 1;
+        buffer("stop after one", &opts, TEXT, show, &left);
+
+        opts.max = 80;
+        opts.min = 10;
+        buffer("min 10", &opts, TEXT, show, NULL);
+        opts.countNewlines = true;
+        buffer("min 10, counting newlines", &opts, TEXT, show, NULL);
+
+        len_options_init(&opts);
+        opts.max = 4;
+        opts.tabWidth = 3;
+        buffer("tabWidth 3", &opts, "\tx\nab\tc\n", show, NULL);
+        buffer("bytes", &opts, "\xe6\x97\xa5\xe6\x9c\xac\n", show, NULL);
+        opts.utf8 = true;
+        buffer("utf8", &opts, "\xe6\x97\xa5\xe6\x9c\xac\n", show, NULL);
+        buffer("empty", &opts, "", show, NULL);
+
+        len_options_init(&opts);
+        opts.tabWidth = 0;
+        buffer("tabWidth 0", &opts, TEXT, show, NULL);
+        len_options_init(&opts);
+        opts.min = 81;
+        buffer("min over max", &opts, TEXT, show, NULL);
+        printf("fd, min over max: %d\n", len_check_fd(&opts, 0, show, NULL));
+
+        len_options_init(&opts);
+        printf("bad fd: %d\n", len_check_fd(&opts, -1, show, NULL));
+        printf("stdin:\n");
+        printf("  -> %d\n", len_check_fd(&opts, 0, show, NULL));
+        return 0;
+}
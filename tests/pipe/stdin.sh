@@ -0,0 +1,40 @@
+# stdin read on a thread of its own, which -j 2 asks for even with one
+# CPU, must give what the same lines give from a file. Lines run across
+# the reader's blocks, and one writer leaves gaps between its writes.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+awk 'BEGIN {
+        y = "y"
+        while (length(y) < 300000)
+                y = y y
+        for (l = 1; l <= 40000; l++) {
+                s = substr(y, 1, (l % 1000 == 0) ? 300000 : (l * 7) % 97)
+                printf "%s%s\n", s, (l % 3 == 0) ? "\r" : ""
+        }
+}' > lines
+
+for args in "-pnl" "-pnlr -m 90" "--summary" "--top 3 -nr" "-q"; do
+        "$LEN" $args lines > file
+        a=$?
+        cat lines | "$LEN" -j 2 $args - > pipe
+        b=$?
+        cat lines | "$LEN" -j 1 $args - > serial
+        c=$?
+        cmp -s file pipe && cmp -s file serial &&
+                echo "same $a $b $c: $args, $(wc -l < file) lines"
+done
+
+{
+        head -n 100 lines
+        sleep 0.2
+        tail -n +101 lines
+} | "$LEN" -j 2 -pnlr -m 90 - > pipe
+echo "gaps: $?"
+"$LEN" -pnlr -m 90 lines | cmp -s - pipe && echo same
+
+# -q stops reading at the first line out of range
+yes "$(awk 'BEGIN { while (length(s) < 100) s = s "z"; print s }')" |
+        "$LEN" -j 2 -q -
+echo "endless: $?"
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Regression tests for len: sh tests/run.sh [LEN]
+#
+# Each directory under tests/ holds the files its runs check. A run NAME
+# is NAME.args, the arguments for len quoted as for the shell, and
+# NAME.out, what it must print. len is run from inside the directory,
+# with stdin from /dev/null unless the arguments redirect it, and must
+# exit with the status in NAME.status, or 0 if there's none. What goes
+# to stderr isn't compared. Runs that take more than one command, or
+# files made on the spot, are NAME.sh instead, a script run the same
+# way with $LEN set; what it prints and its status are compared. With
+# UPDATE=1 set, .out and .status files are written from what is done
+# instead, to be looked over before they're committed.
+
+len=${1:-./len}
+case $len in
+/*) ;;
+*) len=$(pwd)/$len ;;
+esac
+tests=$(cd "$(dirname "$0")" && pwd)
+export LEN="$len"
+out=$(mktemp) || exit 2
+trap 'rm -f "$out"' EXIT
+
+passed=0
+failed=0
+for file in "$tests"/*/*.args "$tests"/*/*.sh; do
+        [ -f "$file" ] || continue
+        dir=${file%/*}
+        run=${file%.*}
+        name=${run#"$tests"/}
+
+        case $file in
+        *.args) (cd "$dir" && eval "exec \"\$len\" $(cat "$file")") ;;
+        *.sh) (cd "$dir" && exec sh "${file##*/}") ;;
+        esac < /dev/null > "$out" 2> /dev/null
+        status=$?
+
+        if [ -n "$UPDATE" ]; then
+                cp "$out" "$run.out"
+                rm -f "$run.status"
+                [ $status -ne 0 ] && echo $status > "$run.status"
+                echo "updated $name"
+                continue
+        fi
+
+        want=0
+        [ -f "$run.status" ] && want=$(cat "$run.status")
+        if [ $status -ne "$want" ]; then
+                echo "FAIL $name: exited $status, not $want"
+                failed=$((failed + 1))
+        elif ! cmp -s "$out" "$run.out"; then
+                echo "FAIL $name: output differs"
+                diff "$run.out" "$out" | head -n 20
+                failed=$((failed + 1))
+        else
+                passed=$((passed + 1))
+        fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
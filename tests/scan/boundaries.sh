@@ -0,0 +1,27 @@
+# Lines ending on either side of the 16 and 32 byte blocks the vector
+# kernels take at a time, and of the limit, checked with nothing
+# printed (the kernels) and with -p (line by line). The two have to
+# agree: both statuses, then how many lines -p printed.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+
+for w in 15 16 17 31 32 33 47 63 64 65 79 80 81 95 96 97; do
+        for kind in plain tab cr nul crlf last; do
+                f=$dir/$w-$kind
+                awk -v w=$w -v kind=$kind 'BEGIN {
+                        line = sprintf("%*s", w, ""); gsub(/ /, "x", line)
+                        if (kind == "tab") line = "\t" substr(line, 9)
+                        if (kind == "cr") line = line "\rshort"
+                        if (kind == "nul") line = substr(line, 1, 8) "\0" substr(line, 10)
+                        end = kind == "crlf" ? "\r\n" : "\n"
+                        for (k = 0; k < 7; k++) printf "%s%s", substr(line, 1, k), end
+                        printf "%s", line
+                        if (kind != "last") printf "%s%s", end, "tail" end
+                }' > "$f"
+                "$LEN" -m $((w - 1)) "$f"; over=$?
+                "$LEN" -m $w "$f"; fits=$?
+                "$LEN" -M $((w + 1)) -m 200 "$f"; under=$?
+                printed=$("$LEN" -p -m $((w - 1)) "$f" | wc -l)
+                echo "$w $kind: $over $fits $under $printed"
+        done
+done
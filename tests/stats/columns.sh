@@ -0,0 +1,24 @@
+# --stats goes to stderr and leaves stdout as it is; the times vary from
+# run to run, so only the counts and names are kept from its report.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+printf 'short\n%090d\n\tx\n' 0 > one
+printf 'ok\r\nok\r\n' > two
+: > empty
+
+run() {
+        "$LEN" --stats "$@" > out 2> stats
+        echo "$* -> $?, $(wc -c < out) bytes out"
+        awk 'NR == 1 { print "  " $1, $2, $3, $4, $NF; next }
+             NF == 8 { print "  " $1, $2, $3, $4, $8 }
+             NF == 9 { print "  " $1, $2, $3, $4, $8, $9 }
+             $1 == "wall:" { print "  wall" }' stats
+}
+
+run one
+run -pnl one two empty
+run -pnl -j 2 one two empty
+run -q one two
+run -p - < one
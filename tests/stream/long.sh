@@ -0,0 +1,43 @@
+# Lines read from a pipe are checked a 64 KiB block at a time. These
+# put a line across several blocks, a CRLF and a tab on either side of
+# a block's end, and a last line with no newline, and check that what
+# carries over between blocks gives the lengths the whole lines have.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+awk 'function line(c, n) {
+        s = c
+        while (length(s) < n)
+                s = s s
+        return substr(s, 1, n)
+}
+BEGIN {
+        printf "%s\n", line("a", 131071)
+        printf "%s\r\n", line("b", 65535)
+        printf "%s\t%s\n", line("c", 65534), "cc"
+        printf "ok\n"
+        printf "%s", line("d", 300000)
+}' > lines
+
+run() {
+        cat lines | "$LEN" "$@" - > out
+        echo "$* -> $?"
+        cut -c 1-30 out
+}
+
+run -pnlr
+run -pnlrN
+run -pnlr -t 4
+run -Pnlr -M 65536 -m 200000
+run --summary
+cat lines | "$LEN" -p -m 100000 - | cksum
+awk 'length($0) > 100000' lines | cksum
+
+# Memory doesn't grow with the length of a line: this one is longer
+# than the address space it gets
+(
+        ulimit -v 262144
+        head -c 400000000 /dev/zero | tr '\0' x | "$LEN" -pr -m 20 -
+        echo " -> $?"
+)
@@ -0,0 +1,52 @@
+# Whether or not io_uring can be had here, --io-uring must not change
+# what is printed: small files go through it, while a file too big for
+# its buffers, an empty file and a FIFO are read as usual.
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+mkdir tree
+i=0
+while [ $i -lt 40 ]; do
+        awk -v i=$i 'BEGIN {
+                for (l = 1; l <= i; l++)
+                        printf "%*s\n", 70 + (l * i) % 20, i
+        }' > tree/f$i
+        i=$((i + 1))
+done
+awk 'BEGIN {
+        for (l = 1; l <= 2000; l++)
+                printf "%*s\n", (l % 100 == 0) ? 90 : 60, l
+}' > tree/big
+: > tree/empty
+mkfifo fifo
+
+# Runs naming the FIFO have it written to in the background; runs that
+# may stop before opening it mustn't name it, or the writer would hang
+feed() {
+        case " $* " in
+        *" fifo "*) printf 'one\n%090d\n' 0 > fifo & ;;
+        esac
+}
+
+run() {
+        feed "$@"
+        "$LEN" "$@" > without
+        a=$?
+        wait
+        feed "$@"
+        "$LEN" --io-uring "$@" > with
+        b=$?
+        wait
+        cmp -s without with && echo "same $a $b: $*"
+}
+
+run -pnl tree/f3 tree/big fifo tree/f39 tree/empty tree/f12
+run -pnl -j 3 tree/f3 tree/big fifo tree/f39 tree/empty tree/f12
+run -pnl -R tree fifo
+run -pnl -R -j 3 tree fifo
+run --summary -R tree fifo
+run -q -R tree
+run -q -j 3 tree/f1 tree/big tree/f39
+run -pnl tree/f5 missing tree/f6
+wc -l < with
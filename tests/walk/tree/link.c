@@ -0,0 +1 @@
+a.c
\ No newline at end of file
@@ -0,0 +1,2 @@
+ok
+000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000